@@ -9,6 +9,7 @@ LOCAL_SRC_FILES := \
     RenderBase.cpp \
     RenderDirectView.cpp \
     RenderTopView.cpp \
+    WarpMesh.cpp \
     ConfigManager.cpp \
     glError.cpp \
     shader.cpp \
@@ -17,7 +18,8 @@ LOCAL_SRC_FILES := \
     StreamHandler.cpp \
     WindowSurface.cpp \
     FormatConvert.cpp \
-    RenderPixelCopy.cpp
+    RenderPixelCopy.cpp \
+    FrameSynchronizer.cpp
 
 LOCAL_SHARED_LIBRARIES := \
     libbinder \
@@ -39,6 +41,9 @@ LOCAL_STATIC_LIBRARIES := \
     libmath \
     libjsoncpp \
 
+# For the extended info identifiers the EVS manager understands
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../manager
+
 LOCAL_STRIP_MODULE := keep_symbols
 
 LOCAL_INIT_RC := evs_app.rc
@@ -74,10 +79,45 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/automotive/evs
 LOCAL_SRC_FILES := $(LOCAL_MODULE)
 include $(BUILD_PREBUILT)
 
+##################################
+# Turns our PNGs into texture files the app can map straight into GL.  Small images are baked
+# uncompressed.  LabeledChecker would take 4MB that way, so it's compressed to ETC, taking 512KB.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := tools/evs_bake_texture.cpp
+LOCAL_STATIC_LIBRARIES := libpng libz libETC1
+LOCAL_CFLAGS += -Wall -Werror
+LOCAL_MODULE := evs_bake_texture
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+EVS_BAKE_TEXTURE := $(LOCAL_INSTALLED_MODULE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := CarFromTop.tex
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/automotive/evs
+include $(BUILD_SYSTEM)/base_rules.mk
+$(LOCAL_BUILT_MODULE): PRIVATE_TOOL := $(EVS_BAKE_TEXTURE)
+$(LOCAL_BUILT_MODULE): $(LOCAL_PATH)/CarFromTop.png $(EVS_BAKE_TEXTURE)
+	@mkdir -p $(dir $@)
+	$(PRIVATE_TOOL) $< $@
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := LabeledChecker.tex
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/automotive/evs
+include $(BUILD_SYSTEM)/base_rules.mk
+$(LOCAL_BUILT_MODULE): PRIVATE_TOOL := $(EVS_BAKE_TEXTURE)
+$(LOCAL_BUILT_MODULE): $(LOCAL_PATH)/LabeledChecker.png $(EVS_BAKE_TEXTURE)
+	@mkdir -p $(dir $@)
+	$(PRIVATE_TOOL) --etc $< $@
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := evs_app_default_resources
 LOCAL_REQUIRED_MODULES := \
     config.json \
     CarFromTop.png \
-    LabeledChecker.png
+    LabeledChecker.png \
+    CarFromTop.tex \
+    LabeledChecker.tex
 include $(BUILD_PHONY_PACKAGE)
\ No newline at end of file
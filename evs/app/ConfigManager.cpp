@@ -20,6 +20,8 @@
 #include <fstream>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+#include <system/graphics.h>
 
 
 static const float kDegreesToRadians = M_PI / 180.0f;
@@ -94,6 +96,13 @@ bool ConfigManager::initialize(const char* configFileName)
         }
         complete &= readChildNodeAsFloat("display", displayNode, "frontRange", &mFrontRangeInCarSpace);
         complete &= readChildNodeAsFloat("display", displayNode, "rearRange",  &mRearRangeInCarSpace);
+        mWarpMeshCachePath = displayNode.get("warpMeshCache", "").asString();
+        mSyncToleranceMs = displayNode.get("syncTolerance", mSyncToleranceMs).asFloat();
+        mSyncHoldBack = displayNode.get("syncHoldBack", mSyncHoldBack).asUInt();
+        if (mSyncHoldBack < 1) {
+            printf("Camera frame hold back must be at least 1\n");
+            mSyncHoldBack = 1;
+        }
     }
 
 
@@ -131,11 +140,36 @@ bool ConfigManager::initialize(const char* configFileName)
             Json::Value usageNode = node.get("function", "");
             const char *function = usageNode.asCString();
 
+            // YUV formats let us sample the camera's buffers without any conversion to RGBA
+            uint32_t outputFormat = 0;
+            const std::string formatName = node.get("format", "").asString();
+            if (formatName == "yuyv") {
+                outputFormat = HAL_PIXEL_FORMAT_YCBCR_422_I;
+            } else if (formatName == "nv21") {
+                outputFormat = HAL_PIXEL_FORMAT_YCRCB_420_SP;
+            } else if (formatName == "rgba") {
+                outputFormat = HAL_PIXEL_FORMAT_RGBA_8888;
+            } else if (!formatName.empty()) {
+                printf("Ignoring unrecognized camera format '%s'\n", formatName.c_str());
+            }
+
             float yaw   = node.get("yaw", 0).asFloat();
             float pitch = node.get("pitch", 0).asFloat();
             float hfov  = node.get("hfov", 0).asFloat();
             float vfov  = node.get("vfov", 0).asFloat();
 
+            // A fisheye lens can see beyond 180 degrees, which a rectilinear one never could
+            float fisheye[4] = {0};
+            Json::Value fisheyeNode = node["fisheye"];
+            bool isFisheye = false;
+            if (fisheyeNode.isArray()) {
+                for (unsigned i = 0; i < 4 && i < fisheyeNode.size(); i++) {
+                    fisheye[i] = fisheyeNode[i].asFloat();
+                    isFisheye |= (fisheye[i] != 0.0f);
+                }
+            }
+            const float maxFov = isFisheye ? 359.0f : 179.0f;
+
             // Wrap the direction angles to be in the 180deg to -180deg range
             // Rotate 180 in yaw if necessary to flip the pitch into the +/-90degree range
             pitch = normalizeToPlusMinus180degrees(pitch);
@@ -150,17 +184,19 @@ bool ConfigManager::initialize(const char* configFileName)
             yaw = normalizeToPlusMinus180degrees(yaw);
 
             // Range check the FOV values to ensure they are postive and less than 180degrees
-            if (hfov > 179.0f) {
-                printf("Pathological horizontal field of view %f clamped to 179 degrees\n", hfov);
-                hfov = 179.0f;
+            if (hfov > maxFov) {
+                printf("Pathological horizontal field of view %f clamped to %.0f degrees\n",
+                       hfov, maxFov);
+                hfov = maxFov;
             }
             if (hfov < 1.0f) {
                 printf("Pathological horizontal field of view %f clamped to 1 degree\n", hfov);
                 hfov = 1.0f;
             }
-            if (vfov > 179.0f) {
-                printf("Pathological horizontal field of view %f clamped to 179 degrees\n", vfov);
-                vfov = 179.0f;
+            if (vfov > maxFov) {
+                printf("Pathological horizontal field of view %f clamped to %.0f degrees\n",
+                       vfov, maxFov);
+                vfov = maxFov;
             }
             if (vfov < 1.0f) {
                 printf("Pathological horizontal field of view %f clamped to 1 degree\n", vfov);
@@ -178,6 +214,8 @@ bool ConfigManager::initialize(const char* configFileName)
             info.vfov        = vfov  * kDegreesToRadians;
             info.cameraId    = cameraId;
             info.function    = function;
+            info.outputFormat = outputFormat;
+            memcpy(info.fisheye, fisheye, sizeof(info.fisheye));
 
             mCameras.push_back(info);
         }
@@ -18,6 +18,7 @@
 
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 
 class ConfigManager {
@@ -30,6 +31,10 @@ public:
         float pitch = 0;    // positive upward (ie: right hand rule about local x axis)
         float hfov  = 0;    // radians
         float vfov  = 0;    // radians
+        uint32_t outputFormat = 0;  // Android pixel format to ask the camera for, or zero for
+                                    // its default
+        float fisheye[4] = {0};     // Equidistant fisheye lens distortion coefficients k1-k4,
+                                    // or all zero for a rectilinear lens
     };
 
     bool initialize(const char* configFileName);
@@ -69,6 +74,14 @@ public:
 
     const std::vector<CameraInfo>& getCameras() const   { return mCameras; };
 
+    // Where to keep the top view's warp mesh between runs, or empty to build it every time
+    const std::string& getWarpMeshCachePath() const     { return mWarpMeshCachePath; };
+
+    // How far apart in time the camera frames we stitch together may be, and how many recent
+    // frames each camera keeps so we have some to choose from
+    float getSyncToleranceMs() const    { return mSyncToleranceMs; };
+    unsigned getSyncHoldBack() const    { return mSyncHoldBack; };
+
 private:
     // Camera information
     std::vector<CameraInfo> mCameras;
@@ -85,6 +98,9 @@ private:
     // Display information
     float    mFrontRangeInCarSpace;     // How far the display extends in front of the car
     float    mRearRangeInCarSpace;      // How far the display extends behind the car
+    std::string mWarpMeshCachePath;     // Empty if we shouldn't keep our warp mesh
+    float    mSyncToleranceMs = 10.0f;
+    unsigned mSyncHoldBack = 1;
 
     // Top view car image information
     float mCarGraphicFrontPixel;    // How many pixels from the top of the image does the car start
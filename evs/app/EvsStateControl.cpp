@@ -18,6 +18,7 @@
 #include "RenderTopView.h"
 #include "RenderPixelCopy.h"
 
+#include <algorithm>
 #include <stdio.h>
 #include <string.h>
 
@@ -61,12 +62,68 @@ EvsStateControl::EvsStateControl(android::sp <IVehicle>       pVnet,
 #if 1
     // This way we only ever deal with cameras which exist in the system
     // Build our set of cameras for the states we support
+    refreshCameraList();
+#else // This way we use placeholders for cameras in the configuration but not reported by EVS
+    // Build our set of cameras for the states we support
+    ALOGD("Requesting camera list");
+    for (auto&& info: config.getCameras()) {
+        if (info.function.find("reverse") != std::string::npos) {
+            mCameraList[State::REVERSE].push_back(info);
+        }
+        if (info.function.find("right") != std::string::npos) {
+            mCameraList[State::RIGHT].push_back(info);
+        }
+        if (info.function.find("left") != std::string::npos) {
+            mCameraList[State::LEFT].push_back(info);
+        }
+        if (info.function.find("park") != std::string::npos) {
+            mCameraList[State::PARKING].push_back(info);
+        }
+    }
+#endif
+
+    ALOGD("State controller ready");
+}
+
+
+// How often we look again for configured cameras the EVS service hasn't reported yet, and how
+// long after starting we give up on them
+static const std::chrono::milliseconds kCameraListRetryInterval(500);
+static const std::chrono::seconds kCameraListRetryTimeout(30);
+
+// How often we report our rendering performance
+static const std::chrono::seconds kFrameStatsInterval(10);
+
+
+// Returns true if both lists name the same cameras in the same order
+static bool sameCameras(const std::vector<ConfigManager::CameraInfo>& a,
+                        const std::vector<ConfigManager::CameraInfo>& b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](const ConfigManager::CameraInfo& x, const ConfigManager::CameraInfo& y) {
+                          return x.cameraId == y.cameraId;
+                      });
+}
+
+
+bool EvsStateControl::refreshCameraList() {
     ALOGD("Requesting camera list");
-    mEvs->getCameraList([this, &config](hidl_vec<CameraDesc> cameraList) {
+
+    const auto now = std::chrono::steady_clock::now();
+    if (mCameraListDeadline == std::chrono::steady_clock::time_point()) {
+        mCameraListDeadline = now + kCameraListRetryTimeout;
+    }
+
+    // Start over, since cameras may have come or gone since we last asked
+    std::vector<ConfigManager::CameraInfo> cameraList[NUM_STATES];
+    std::vector<std::string> reported;
+    unsigned camerasFound = 0;
+    mEvs->getCameraList([this, &cameraList, &reported, &camerasFound]
+                        (hidl_vec<CameraDesc> evsCameras) {
                             ALOGI("Camera list callback received %zu cameras",
-                                  cameraList.size());
-                            for (auto&& cam: cameraList) {
+                                  evsCameras.size());
+                            for (auto&& cam: evsCameras) {
                                 ALOGD("Found camera %s", cam.cameraId.c_str());
+                                reported.push_back(cam.cameraId);
                                 bool cameraConfigFound = false;
 
                                 // Check our configuration for information about this camera
@@ -75,22 +132,23 @@ EvsStateControl::EvsStateControl(android::sp <IVehicle>       pVnet,
                                 // If more than one camera is listed for a given function, we'll
                                 // list all of them and let the UX/rendering logic use one, some
                                 // or all of them as appropriate.
-                                for (auto&& info: config.getCameras()) {
+                                for (auto&& info: mConfig.getCameras()) {
                                     if (cam.cameraId == info.cameraId) {
                                         // We found a match!
                                         if (info.function.find("reverse") != std::string::npos) {
-                                            mCameraList[State::REVERSE].push_back(info);
+                                            cameraList[State::REVERSE].push_back(info);
                                         }
                                         if (info.function.find("right") != std::string::npos) {
-                                            mCameraList[State::RIGHT].push_back(info);
+                                            cameraList[State::RIGHT].push_back(info);
                                         }
                                         if (info.function.find("left") != std::string::npos) {
-                                            mCameraList[State::LEFT].push_back(info);
+                                            cameraList[State::LEFT].push_back(info);
                                         }
                                         if (info.function.find("park") != std::string::npos) {
-                                            mCameraList[State::PARKING].push_back(info);
+                                            cameraList[State::PARKING].push_back(info);
                                         }
                                         cameraConfigFound = true;
+                                        camerasFound++;
                                         break;
                                     }
                                 }
@@ -101,26 +159,35 @@ EvsStateControl::EvsStateControl(android::sp <IVehicle>       pVnet,
                             }
                         }
     );
-#else // This way we use placeholders for cameras in the configuration but not reported by EVS
-    // Build our set of cameras for the states we support
-    ALOGD("Requesting camera list");
-    for (auto&& info: config.getCameras()) {
-        if (info.function.find("reverse") != std::string::npos) {
-            mCameraList[State::REVERSE].push_back(info);
-        }
-        if (info.function.find("right") != std::string::npos) {
-            mCameraList[State::RIGHT].push_back(info);
-        }
-        if (info.function.find("left") != std::string::npos) {
-            mCameraList[State::LEFT].push_back(info);
+
+    // Until every configured camera shows up, we'll keep checking for the rest for a while
+    mCamerasMissing = (camerasFound < mConfig.getCameras().size());
+    mNextCameraListCheck = now + kCameraListRetryInterval;
+    if (mCamerasMissing && now >= mCameraListDeadline) {
+        for (auto&& info : mConfig.getCameras()) {
+            if (std::find(reported.begin(), reported.end(), info.cameraId) == reported.end()) {
+                ALOGW("Configured camera %s never showed up", info.cameraId.c_str());
+            }
         }
-        if (info.function.find("park") != std::string::npos) {
-            mCameraList[State::PARKING].push_back(info);
+        ALOGW("Giving up on missing cameras after %lld seconds",
+              static_cast<long long>(kCameraListRetryTimeout.count()));
+        mCamerasMissing = false;
+    }
+
+    // Note whether the cameras for the state we're showing have changed.  A camera replaced by
+    // another leaves the count alone, so we compare which cameras they are.
+    bool changed = false;
+    for (unsigned state = 0; state < NUM_STATES; state++) {
+        if (!sameCameras(cameraList[state], mCameraList[state])) {
+            changed |= (state == mCurrentState);
+            mCameraList[state] = cameraList[state];
+
+            // An idle renderer for this state refers to its old camera list
+            mIdleRenderers[state] = nullptr;
         }
     }
-#endif
 
-    ALOGD("State controller ready");
+    return changed;
 }
 
 
@@ -157,7 +224,12 @@ void EvsStateControl::updateLoop() {
                     run = false;
                     break;
                 case Op::CHECK_VEHICLE_STATE:
-                    // Just running selectStateForCurrentConditions below will take care of this
+                    // selectStateForCurrentConditions below will query the vehicle again
+                    mVehicleStateStale = true;
+                    break;
+                case Op::PROPERTY_CHANGED:
+                    cachePropertyValue(static_cast<int32_t>(cmd.arg1),
+                                       static_cast<int32_t>(cmd.arg2));
                     break;
                 case Op::TOUCH_EVENT:
                     // Implement this given the x/y location of the touch event
@@ -167,6 +239,15 @@ void EvsStateControl::updateLoop() {
             }
         }
 
+        // The EVS manager answers camera list requests right away with whatever it has found
+        // so far, so keep asking while any of our cameras is still missing
+        if (mCamerasMissing && std::chrono::steady_clock::now() >= mNextCameraListCheck) {
+            if (refreshCameraList()) {
+                // The state we're in has new cameras to show, so set it up again
+                mCameraListChanged = true;
+            }
+        }
+
         // Review vehicle state and choose an appropriate renderer
         if (!selectStateForCurrentConditions()) {
             ALOGE("selectStateForCurrentConditions failed so we're going to die");
@@ -175,6 +256,20 @@ void EvsStateControl::updateLoop() {
 
         // If we have an active renderer, give it a chance to draw
         if (mCurrentRenderer) {
+            // Do the CPU side of the next frame while the GPU is still drawing the previous one
+            std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
+            bool prepared = mCurrentRenderer->prepareFrame();
+            mFrameStats.cpuTime += std::chrono::steady_clock::now() - prepareStart;
+            if (!prepared) {
+                // If drawing failed, we want to exit quickly so an app restart can happen
+                finishPendingFrame();
+                run = false;
+                continue;
+            }
+
+            // The previous frame has to be displayed before we can have the target buffer back
+            finishPendingFrame();
+
             // Get the output buffer we'll use to display the imagery
             BufferDesc tgtBuffer = {};
             mDisplay->getTargetBuffer([&tgtBuffer](const BufferDesc& buff) {
@@ -185,19 +280,34 @@ void EvsStateControl::updateLoop() {
             if (tgtBuffer.memHandle == nullptr) {
                 ALOGE("Didn't get requested output buffer -- skipping this frame.");
             } else {
-                // Generate our output image
-                if (!mCurrentRenderer->drawFrame(tgtBuffer)) {
+                // Generate our output image, which we'll send back for display once it's done
+                std::chrono::steady_clock::time_point drawStart = std::chrono::steady_clock::now();
+                bool drawn = mCurrentRenderer->submitFrame(tgtBuffer);
+                mFrameStats.cpuTime += std::chrono::steady_clock::now() - drawStart;
+                mPendingTarget = tgtBuffer;
+
+                // Note whether this frame shows video the cameras sent since we switched
+                if (mAwaitingFirstVideo) {
+                    const int64_t switchNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            mSwitchStart.time_since_epoch()).count();
+                    mPendingShowsNewVideo = mCurrentRenderer->isShowingVideoSince(switchNs);
+                }
+
+                if (!drawn) {
                     // If drawing failed, we want to exit quickly so an app restart can happen
+                    finishPendingFrame();
                     run = false;
                 }
-
-                // Send the finished image back for display
-                mDisplay->returnTargetBufferForDisplay(tgtBuffer);
             }
         } else {
-            // No active renderer, so sleep until somebody wakes us with another command
+            // No active renderer, so sleep until somebody wakes us with another command,
+            // or it's time to look for missing cameras again
             std::unique_lock<std::mutex> lock(mLock);
-            mWakeSignal.wait(lock);
+            if (mCamerasMissing) {
+                mWakeSignal.wait_until(lock, mNextCameraListCheck);
+            } else {
+                mWakeSignal.wait(lock);
+            }
         }
     }
 
@@ -215,15 +325,25 @@ bool EvsStateControl::selectStateForCurrentConditions() {
     static int32_t sDummySignal = int32_t(VehicleTurnSignal::NONE);
 
     if (mVehicle != nullptr) {
-        // Query the car state
-        if (invokeGet(&mGearValue) != StatusCode::OK) {
-            ALOGE("GEAR_SELECTION not available from vehicle.  Exiting.");
-            return false;
+        if (!mVehicleStateStale && !mVehicleStateChanged && !mCameraListChanged) {
+            // Nothing has happened that could change our mind
+            return true;
         }
-        if ((mTurnSignalValue.prop == 0) || (invokeGet(&mTurnSignalValue) != StatusCode::OK)) {
-            // Silently treat missing turn signal state as no turn signal active
-            mTurnSignalValue.value.int32Values.setToExternal(&sDummySignal, 1);
-            mTurnSignalValue.prop = 0;
+        mVehicleStateChanged = false;
+
+        if (mVehicleStateStale) {
+            // Query the car state
+            if (invokeGet(&mGearValue) != StatusCode::OK) {
+                ALOGE("GEAR_SELECTION not available from vehicle.  Exiting.");
+                return false;
+            }
+            if ((mTurnSignalValue.prop == 0) ||
+                (invokeGet(&mTurnSignalValue) != StatusCode::OK)) {
+                // Silently treat missing turn signal state as no turn signal active
+                mTurnSignalValue.value.int32Values.setToExternal(&sDummySignal, 1);
+                mTurnSignalValue.prop = 0;
+            }
+            mVehicleStateStale = false;
         }
     } else {
         // While testing without a vehicle, behave as if we're in reverse for the first 20 seconds
@@ -278,13 +398,92 @@ StatusCode EvsStateControl::invokeGet(VehiclePropValue *pRequestedPropValue) {
 }
 
 
+void EvsStateControl::cachePropertyValue(int32_t propId, int32_t value) {
+    VehiclePropValue* pPropValue = nullptr;
+    if (propId == static_cast<int32_t>(VehicleProperty::GEAR_SELECTION)) {
+        pPropValue = &mGearValue;
+    } else if (propId != 0 && propId == mTurnSignalValue.prop) {
+        // A zero prop means the vehicle doesn't report its turn signal, and we leave it off
+        pPropValue = &mTurnSignalValue;
+    } else {
+        return;
+    }
+
+    if (pPropValue->value.int32Values.size() == 1 && pPropValue->value.int32Values[0] == value) {
+        // Nothing new
+        return;
+    }
+
+    // Replace rather than write through the existing vector, which might refer to our dummy value
+    hidl_vec<int32_t> newValues;
+    newValues.resize(1);
+    newValues[0] = value;
+    pPropValue->value.int32Values = newValues;
+    mVehicleStateChanged = true;
+}
+
+
+void EvsStateControl::finishPendingFrame() {
+    if (mPendingTarget.memHandle == nullptr) {
+        return;
+    }
+
+    // Wait for the GPU to finish with the target, then send it back for display
+    std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+    uint64_t gpuTimeNs = 0;
+    RenderBase::waitForFrame(&gpuTimeNs);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    mDisplay->returnTargetBufferForDisplay(mPendingTarget);
+    mPendingTarget = {};
+
+    // Report how long it took from deciding to change state until we showed its cameras.  A
+    // camera the previous state showed too already has a frame, so we wait for a newer one.
+    if (mAwaitingFirstVideo && mPendingShowsNewVideo) {
+        mAwaitingFirstVideo = false;
+        mPendingShowsNewVideo = false;
+        ALOGI("State %d showed its first video frame %.1f ms after the switch", mCurrentState,
+              std::chrono::duration<double, std::milli>(now - mSwitchStart).count());
+    }
+
+    // Keep track of how we're doing
+    if (mFrameStats.frames == 0) {
+        mFrameStats.start = waitStart;
+    }
+    mFrameStats.frames++;
+    mFrameStats.waitTime += now - waitStart;
+    if (gpuTimeNs > 0) {
+        mFrameStats.gpuTimeNs += gpuTimeNs;
+        mFrameStats.gpuTimedFrames++;
+    }
+
+    std::chrono::steady_clock::duration elapsed = now - mFrameStats.start;
+    if (elapsed >= kFrameStatsInterval) {
+        using msec = std::chrono::duration<double, std::milli>;
+        const double frames = mFrameStats.frames;
+        const double gpuMs = (mFrameStats.gpuTimedFrames > 0) ?
+                             mFrameStats.gpuTimeNs / 1e6 / mFrameStats.gpuTimedFrames : 0.0;
+        ALOGI("Rendered %u frames at %.1f fps:  cpu %.2f ms, gpu %.2f ms, "
+              "waiting on gpu %.2f ms per frame",
+              mFrameStats.frames, frames * 1000.0 / msec(elapsed).count(),
+              msec(mFrameStats.cpuTime).count() / frames, gpuMs,
+              msec(mFrameStats.waitTime).count() / frames);
+        mFrameStats = {};
+    }
+}
+
+
 bool EvsStateControl::configureEvsPipeline(State desiredState) {
     static bool isGlReady = false;
 
-    if (mCurrentState == desiredState) {
+    if (mCurrentState == desiredState && !mCameraListChanged) {
         // Nothing to do here...
         return true;
     }
+    const bool cameraListChanged = mCameraListChanged;
+    const bool wasGlReady = isGlReady;
+    mCameraListChanged = false;
+    mSwitchStart = std::chrono::steady_clock::now();
 
     ALOGD("Switching to state %d.", desiredState);
     ALOGD("  Current state %d has %zu cameras", mCurrentState,
@@ -309,7 +508,10 @@ bool EvsStateControl::configureEvsPipeline(State desiredState) {
         // Assumes that SurfaceFlinger is available always after being launched.
 
         // Do we need a new direct view renderer?
-        if (mCameraList[desiredState].size() == 1) {
+        if (mIdleRenderers[desiredState]) {
+            // We've shown this state before, and already have its renderer
+            mDesiredRenderer = std::move(mIdleRenderers[desiredState]);
+        } else if (mCameraList[desiredState].size() == 1) {
             // We have a camera assigned to this state for direct view.
             mDesiredRenderer = std::make_unique<RenderDirectView>(mEvs,
                                                                   mCameraList[desiredState][0]);
@@ -334,9 +536,15 @@ bool EvsStateControl::configureEvsPipeline(State desiredState) {
         isGlReady = true;
     }
 
-    // Since we're changing states, shut down the current renderer
+    // Since we're changing states, shut down the current renderer once it's done drawing.
+    // We hold onto GL renderers to use again, but not a CPU renderer from before GL was ready,
+    // nor one whose camera list is out of date.
+    finishPendingFrame();
     if (mCurrentRenderer != nullptr) {
         mCurrentRenderer->deactivate();
+        if (wasGlReady && !cameraListChanged) {
+            mIdleRenderers[mCurrentState] = std::move(mCurrentRenderer);
+        }
         mCurrentRenderer = nullptr; // It's a smart pointer, so destructs on assignment to null
     }
 
@@ -344,15 +552,28 @@ bool EvsStateControl::configureEvsPipeline(State desiredState) {
     if (mDesiredRenderer == nullptr) {
         ALOGD("Turning off the display");
         mDisplay->setDisplayState(DisplayState::NOT_VISIBLE);
+        mAwaitingFirstVideo = false;
+
+        // Nothing is being shown, so stop all the cameras
+        RenderBase::releaseUnusedVideoTextures();
     } else {
         mCurrentRenderer = std::move(mDesiredRenderer);
 
         // Start the camera stream
         ALOGD("EvsStartCameraStreamTiming start time: %" PRId64 "ms", android::elapsedRealtime());
+        std::chrono::steady_clock::time_point activateStart = std::chrono::steady_clock::now();
         if (!mCurrentRenderer->activate()) {
             ALOGE("New renderer failed to activate");
             return false;
         }
+        ALOGI("Renderer activated in %.1f ms",
+              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                        activateStart).count());
+        mAwaitingFirstVideo = true;
+        mPendingShowsNewVideo = false;
+
+        // Stop the cameras we were showing that the new renderer didn't pick up
+        RenderBase::releaseUnusedVideoTextures();
 
         // Activate the display
         ALOGD("EvsActivateDisplayTiming start time: %" PRId64 "ms", android::elapsedRealtime());
@@ -27,6 +27,7 @@
 #include <android/hardware/automotive/evs/1.0/IEvsCamera.h>
 
 #include <thread>
+#include <chrono>
 
 
 using namespace ::android::hardware::automotive::evs::V1_0;
@@ -61,7 +62,8 @@ public:
 
     enum class Op {
         EXIT,
-        CHECK_VEHICLE_STATE,
+        CHECK_VEHICLE_STATE,    // Query the vehicle for its current state
+        PROPERTY_CHANGED,       // arg1 is a vehicle property id, arg2 its new int32 value
         TOUCH_EVENT,
     };
 
@@ -80,23 +82,57 @@ public:
 private:
     void updateLoop();
     StatusCode invokeGet(VehiclePropValue *pRequestedPropValue);
+    void cachePropertyValue(int32_t propId, int32_t value);
     bool selectStateForCurrentConditions();
+    bool refreshCameraList();   // Returns true if the current state's cameras changed
     bool configureEvsPipeline(State desiredState);  // Only call from one thread!
+    void finishPendingFrame();
 
     sp<IVehicle>                mVehicle;
     sp<IEvsEnumerator>          mEvs;
     sp<IEvsDisplay>             mDisplay;
     const ConfigManager&        mConfig;
 
+    // Our cached copies of the vehicle state, kept current by property change events.  We only
+    // query the vehicle when first starting and when asked to check on it.
     VehiclePropValue            mGearValue;
     VehiclePropValue            mTurnSignalValue;
+    bool                        mVehicleStateStale = true;      // Query before next use
+    bool                        mVehicleStateChanged = true;    // Not yet acted upon
 
     State                       mCurrentState = OFF;
 
     std::vector<ConfigManager::CameraInfo>  mCameraList[NUM_STATES];
+    bool                        mCamerasMissing = false;    // Configured but not yet reported
+    bool                        mCameraListChanged = false; // Current state needs reconfiguring
+    std::chrono::steady_clock::time_point   mNextCameraListCheck;
+    std::chrono::steady_clock::time_point   mCameraListDeadline;    // Stop checking after this
     std::unique_ptr<RenderBase> mCurrentRenderer;
     std::unique_ptr<RenderBase> mDesiredRenderer;
 
+    // GL renderers we've switched away from, kept so that switching back skips rebuilding their
+    // shaders and textures.  Dropped when their state's camera list changes.
+    std::unique_ptr<RenderBase> mIdleRenderers[NUM_STATES];
+
+    // When we last changed state, and whether we're still waiting to show its video
+    std::chrono::steady_clock::time_point   mSwitchStart;
+    bool                        mAwaitingFirstVideo = false;
+    bool                        mPendingShowsNewVideo = false;  // Frame in flight ends the wait
+
+    // The display gives us only one target buffer, so at most one frame is in flight:  the one
+    // the GPU may still be drawing while we go around the loop to handle our next commands and
+    // prepare the next frame.
+    BufferDesc                  mPendingTarget = {};
+
+    struct FrameStats {
+        unsigned                                frames = 0;
+        std::chrono::steady_clock::duration     cpuTime   = {};   // Building and submitting
+        std::chrono::steady_clock::duration     waitTime  = {};   // Blocked on the GPU
+        uint64_t                                gpuTimeNs = 0;
+        unsigned                                gpuTimedFrames = 0;
+        std::chrono::steady_clock::time_point   start;
+    } mFrameStats;
+
     std::thread                 mRenderThread;  // The thread that runs the main rendering loop
 
     // Other threads may want to spur us into action, so we provide a thread safe way to do that
@@ -19,20 +19,28 @@
 
 #include "EvsStateControl.h"
 
+#include <map>
+
 /*
- * This class listens for asynchronous updates from the Vehicle HAL.  While the EVS
- * applications is active, it can poll the vehicle state directly.  However, when it goes to
- * sleep, we need these notifications to bring it active again.
+ * This class listens for asynchronous updates from the Vehicle HAL and hands the new property
+ * values to the state controller, so it doesn't have to poll the vehicle while it's rendering.
+ * When nothing has been delivered for a while, we ask the controller to query the vehicle
+ * directly in case we've missed something.
  */
 class EvsVehicleListener : public IVehicleCallback {
 public:
     // Methods from ::android::hardware::automotive::vehicle::V2_0::IVehicleCallback follow.
-    Return<void> onPropertyEvent(const hidl_vec <VehiclePropValue> & /*values*/) override {
+    Return<void> onPropertyEvent(const hidl_vec <VehiclePropValue> & values) override {
         {
-            // Our use case is so simple, we don't actually need to update a variable,
-            // but the docs seem to say we have to take the lock anyway to keep
-            // the condition variable implementation happy.
+            // Only the latest value of each property matters, so a burst of events for the
+            // same property collapses into one update
             std::lock_guard<std::mutex> g(mLock);
+            for (auto&& value: values) {
+                // The properties we subscribe to all carry a single int32 value
+                if (value.value.int32Values.size() > 0) {
+                    mLatestValues[value.prop] = value.value.int32Values[0];
+                }
+            }
         }
         mEventCond.notify_one();
         return Return<void>();
@@ -50,31 +58,47 @@ public:
         return Return<void>();
     }
 
-    bool waitForEvents(int timeout_ms) {
+    // Returns false if no new values arrived before the timeout
+    bool waitForEvents(int timeout_ms, std::map<int32_t, int32_t>* pValues) {
         std::unique_lock<std::mutex> g(mLock);
-        std::cv_status result = mEventCond.wait_for(g, std::chrono::milliseconds(timeout_ms));
-        return (result == std::cv_status::no_timeout);
+        bool delivered = mEventCond.wait_for(g, std::chrono::milliseconds(timeout_ms),
+                                             [this](){ return !mLatestValues.empty(); });
+        pValues->swap(mLatestValues);
+        mLatestValues.clear();
+        return delivered;
     }
 
     void run(EvsStateControl *pStateController) {
+        std::map<int32_t, int32_t> values;
         while (true) {
             // Wait until we have an event to which to react
             // (wake up and validate our current state "just in case" every so often)
-            waitForEvents(5000);
-
-            // If we were delivered an event (or it's been a while) update as necessary
-            EvsStateControl::Command cmd = {
-                .operation = EvsStateControl::Op::CHECK_VEHICLE_STATE,
-                .arg1      = 0,
-                .arg2      = 0,
-            };
-            pStateController->postCommand(cmd);
+            if (waitForEvents(5000, &values)) {
+                // Pass along the new values so the controller can update its state from them
+                for (auto&& entry: values) {
+                    EvsStateControl::Command cmd = {
+                        .operation = EvsStateControl::Op::PROPERTY_CHANGED,
+                        .arg1      = static_cast<uint32_t>(entry.first),
+                        .arg2      = static_cast<uint32_t>(entry.second),
+                    };
+                    pStateController->postCommand(cmd);
+                }
+            } else {
+                // It's been a while, so have the controller ask the vehicle directly
+                EvsStateControl::Command cmd = {
+                    .operation = EvsStateControl::Op::CHECK_VEHICLE_STATE,
+                    .arg1      = 0,
+                    .arg2      = 0,
+                };
+                pStateController->postCommand(cmd);
+            }
         }
     }
 
 private:
     std::mutex mLock;
     std::condition_variable mEventCond;
+    std::map<int32_t, int32_t> mLatestValues;   // Property id to value, not yet passed along
 };
 
 #endif //CAR_EVS_APP_VEHICLELISTENER_H
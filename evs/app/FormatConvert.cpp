@@ -16,6 +16,14 @@
 
 #include "FormatConvert.h"
 
+#include <string.h>
+#include <algorithm>
+#include <system/graphics.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 
 // Round up to the nearest multiple of the given alignment value
 template<unsigned alignment>
@@ -167,3 +175,185 @@ void copyMatchedInterleavedFormats(unsigned width, unsigned height,
         dst = (uint8_t*)dst + dstStridePixels * pixelSize;
     }
 }
+
+
+// The same conversion as yuvToRgbx in 6 bit fixed point, which the NEON code below matches
+static const int kFixedR_V =  73;   // 1.140 * 64
+static const int kFixedG_U = -25;   // -0.395 * 64
+static const int kFixedG_V = -37;   // -0.581 * 64
+static const int kFixedB_U = 130;   // 2.032 * 64
+
+static inline uint8_t clampFixed(int v) {
+    v = (v + 32) >> 6;
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static inline uint32_t yuvToRgbxFixed(int Y, int U, int V) {
+    const int y = Y << 6;
+    U -= 128;
+    V -= 128;
+    return (clampFixed(y + kFixedR_V*V)                 ) |
+           (clampFixed(y + kFixedG_U*U + kFixedG_V*V) <<  8) |
+           (clampFixed(y + kFixedB_U*U)               << 16) |
+           0xFF000000;  // Fill the alpha channel with ones
+}
+
+
+#if defined(__ARM_NEON)
+// Converts eight pixels given their luma and the chroma to go with each.  Saturating at each
+// step gives the same clamping as the scalar version.
+static inline uint8x8x4_t yuvToRgbxNeon(uint8x8_t Y, int16x8_t U, int16x8_t V) {
+    const int16x8_t y = vreinterpretq_s16_u16(vshll_n_u8(Y, 6));
+    const int16x8_t r = vqaddq_s16(y, vmulq_n_s16(V, kFixedR_V));
+    const int16x8_t g = vqaddq_s16(vqaddq_s16(y, vmulq_n_s16(U, kFixedG_U)),
+                                   vmulq_n_s16(V, kFixedG_V));
+    const int16x8_t b = vqaddq_s16(y, vmulq_n_s16(U, kFixedB_U));
+
+    uint8x8x4_t rgbx;
+    rgbx.val[0] = vqrshrun_n_s16(r, 6);
+    rgbx.val[1] = vqrshrun_n_s16(g, 6);
+    rgbx.val[2] = vqrshrun_n_s16(b, 6);
+    rgbx.val[3] = vdup_n_u8(0xFF);
+    return rgbx;
+}
+
+static inline int16x8_t centerChroma(uint8x8_t C) {
+    return vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(C)), vdupq_n_s16(128));
+}
+#endif
+
+
+// Each takes a row of luma and the chroma that goes with it
+static void convertRowNV21(unsigned width, const uint8_t* rowY, const uint8_t* rowUV,
+                           uint32_t* dst) {
+    unsigned c = 0;
+#if defined(__ARM_NEON)
+    for (; c + 16 <= width; c += 16) {
+        // Eight chroma pairs, each shared by two neighboring pixels
+        const uint8x8x2_t uv = vld2_u8(rowUV + c);
+        const uint8x8x2_t u = vzip_u8(uv.val[0], uv.val[0]);
+        const uint8x8x2_t v = vzip_u8(uv.val[1], uv.val[1]);
+        const uint8x16_t Y = vld1q_u8(rowY + c);
+
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + c),
+                yuvToRgbxNeon(vget_low_u8(Y), centerChroma(u.val[0]), centerChroma(v.val[0])));
+        vst4_u8(reinterpret_cast<uint8_t*>(dst + c + 8),
+                yuvToRgbxNeon(vget_high_u8(Y), centerChroma(u.val[1]), centerChroma(v.val[1])));
+    }
+#endif
+    for (; c < width; c++) {
+        const unsigned uCol = (c & ~1);     // uCol is always even and repeats 1:2 with Y values
+        dst[c] = yuvToRgbxFixed(rowY[c], rowUV[uCol], rowUV[uCol | 1]);
+    }
+}
+
+static void convertRowYV12(unsigned width, const uint8_t* rowY, const uint8_t* rowU,
+                           const uint8_t* rowV, uint32_t* dst) {
+    for (unsigned c = 0; c < width; c++) {
+        dst[c] = yuvToRgbxFixed(rowY[c], rowU[c/2], rowV[c/2]);
+    }
+}
+
+static void convertRowYUYV(unsigned width, const uint8_t* row, uint32_t* dst) {
+    unsigned c = 0;
+#if defined(__ARM_NEON)
+    for (; c + 16 <= width; c += 16) {
+        // Sixteen pixels as eight Y0 U Y1 V groups, converted as the even then the odd pixels
+        const uint8x8x4_t yuyv8 = vld4_u8(row + c*2);
+        const int16x8_t U = centerChroma(yuyv8.val[1]);
+        const int16x8_t V = centerChroma(yuyv8.val[3]);
+        const uint8x8x4_t even = yuvToRgbxNeon(yuyv8.val[0], U, V);
+        const uint8x8x4_t odd  = yuvToRgbxNeon(yuyv8.val[2], U, V);
+
+        uint8x16x4_t rgbx;
+        for (unsigned i = 0; i < 4; i++) {
+            const uint8x8x2_t zipped = vzip_u8(even.val[i], odd.val[i]);
+            rgbx.val[i] = vcombine_u8(zipped.val[0], zipped.val[1]);
+        }
+        vst4q_u8(reinterpret_cast<uint8_t*>(dst + c), rgbx);
+    }
+#endif
+    for (; c < width; c += 2) {
+        const uint8_t* pair = row + c*2;
+        dst[c] = yuvToRgbxFixed(pair[0], pair[1], pair[3]);
+        if (c + 1 < width) {
+            dst[c + 1] = yuvToRgbxFixed(pair[2], pair[1], pair[3]);
+        }
+    }
+}
+
+
+// Returns the given source row as RGBx, converting it into rowBuffer if need be
+static const uint32_t* sourceRow(uint32_t srcFormat, unsigned srcWidth, unsigned srcHeight,
+                                 const uint8_t* src, unsigned srcStridePixels,
+                                 unsigned row, uint32_t* rowBuffer) {
+    switch (srcFormat) {
+        case HAL_PIXEL_FORMAT_YCRCB_420_SP: {   // 420SP == NV21
+            const unsigned strideLum = align<16>(srcWidth);
+            const uint8_t* rowY  = src + row*strideLum;
+            const uint8_t* rowUV = src + strideLum*srcHeight + (row/2)*strideLum;
+            convertRowNV21(srcWidth, rowY, rowUV, rowBuffer);
+            return rowBuffer;
+        }
+        case HAL_PIXEL_FORMAT_YV12: {           // YUV_420P == YV12
+            const unsigned strideLum = align<16>(srcWidth);
+            const unsigned strideColor = align<16>(strideLum/2);
+            const uint8_t* rowY = src + row*strideLum;
+            const uint8_t* rowU = src + strideLum*srcHeight + (row/2)*strideColor;
+            const uint8_t* rowV = rowU + strideColor*srcHeight/2;
+            convertRowYV12(srcWidth, rowY, rowU, rowV, rowBuffer);
+            return rowBuffer;
+        }
+        case HAL_PIXEL_FORMAT_YCBCR_422_I:      // YUYV
+            convertRowYUYV(srcWidth, src + row*srcStridePixels*2, rowBuffer);
+            return rowBuffer;
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            return reinterpret_cast<const uint32_t*>(src) + row*srcStridePixels;
+        default:
+            return nullptr;
+    }
+}
+
+
+bool scaleToRGB32(uint32_t srcFormat, unsigned srcWidth, unsigned srcHeight,
+                  const uint8_t* src, unsigned srcStridePixels,
+                  uint32_t* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstStridePixels,
+                  unsigned firstRow, unsigned endRow,
+                  uint32_t* rowBuffer) {
+    if (srcWidth == 0 || srcHeight == 0 || dstWidth == 0 || dstHeight == 0) {
+        return true;
+    }
+
+    // Steps through the source in 16.16 fixed point, sampling at the center of each pixel
+    const uint32_t stepX = (uint64_t(srcWidth)  << 16) / dstWidth;
+    const uint32_t stepY = (uint64_t(srcHeight) << 16) / dstHeight;
+
+    const uint32_t* srcRow = nullptr;
+    unsigned srcRowIndex = ~0u;
+    for (unsigned r = firstRow; r < endRow && r < dstHeight; r++) {
+        // When scaling up, neighboring rows come from the same source row, which we only convert
+        // the first time
+        const unsigned sr = std::min((r*stepY + stepY/2) >> 16, srcHeight - 1);
+        if (sr != srcRowIndex) {
+            srcRow = sourceRow(srcFormat, srcWidth, srcHeight, src, srcStridePixels,
+                               sr, rowBuffer);
+            if (!srcRow) {
+                return false;
+            }
+            srcRowIndex = sr;
+        }
+
+        uint32_t* rowDest = dst + r*dstStridePixels;
+        if (dstWidth == srcWidth) {
+            memcpy(rowDest, srcRow, dstWidth * sizeof(uint32_t));
+        } else {
+            uint32_t x = stepX/2;
+            for (unsigned c = 0; c < dstWidth; c++) {
+                rowDest[c] = srcRow[x >> 16];
+                x += stepX;
+            }
+        }
+    }
+
+    return true;
+}
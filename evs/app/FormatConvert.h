@@ -57,4 +57,17 @@ void copyMatchedInterleavedFormats(unsigned width, unsigned height,
                                    void* dst, unsigned dstStridePixels,
                                    unsigned pixelSize);
 
+
+// Fills rows firstRow up to endRow of a dstWidth x dstHeight 32bit RGBx image by scaling a whole
+// source image in the given HAL_PIXEL_FORMAT_* to fit, so the image can be built in bands on
+// several threads.  Scaling picks the nearest source pixel, and each source row involved is
+// converted only once, using fixed point math and NEON where we have it.  NV21 and YV12 sources
+// are laid out as described above, and rowBuffer must hold srcWidth pixels.  Returns false if
+// the source format isn't one we handle.
+bool scaleToRGB32(uint32_t srcFormat, unsigned srcWidth, unsigned srcHeight,
+                  const uint8_t* src, unsigned srcStridePixels,
+                  uint32_t* dst, unsigned dstWidth, unsigned dstHeight, unsigned dstStridePixels,
+                  unsigned firstRow, unsigned endRow,
+                  uint32_t* rowBuffer);
+
 #endif // EVS_VTS_FORMATCONVERT_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FrameSynchronizer.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include <log/log.h>
+
+
+// How often we report the skew between cameras
+static const std::chrono::seconds kSkewStatsInterval(10);
+
+// How far a camera's newest frame may be behind the newest of all before we stop lining the
+// others up with it, as a multiple of our tolerance.  Cameras may run at different rates, so
+// we always allow at least a few frame periods.
+static const int64_t kStaleTolerances = 4;
+static const int64_t kMinStaleNs = 100 * 1000 * 1000;
+
+
+// The time in the list nearest the given one
+static int64_t closestTime(const std::vector<int64_t>& timesNs, int64_t targetNs) {
+    int64_t best = timesNs.front();
+    for (auto&& t: timesNs) {
+        if (llabs(t - targetNs) < llabs(best - targetNs)) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+
+FrameSynchronizer::FrameSynchronizer(float toleranceMs) :
+    mToleranceNs(static_cast<int64_t>(toleranceMs * 1000000.0f)) {
+}
+
+
+void FrameSynchronizer::refresh(const std::vector<VideoTex*>& textures) {
+    // Gather the times of the frames each texture could show, starting with the one it has
+    mFrameTimes.resize(textures.size());
+    mLive.assign(textures.size(), false);
+    int64_t newestNs = INT64_MIN;
+    for (unsigned i = 0; i < textures.size(); i++) {
+        std::vector<int64_t>& times = mFrameTimes[i];
+        times.clear();
+        if (textures[i]) {
+            textures[i]->getNewFrameTimes(&times);
+            if (textures[i]->imageTimeNs() >= 0) {
+                times.insert(times.begin(), textures[i]->imageTimeNs());
+            }
+        }
+        if (!times.empty()) {
+            newestNs = std::max(newestNs, times.back());
+        }
+    }
+
+    // A camera whose newest frame is well behind the others' has stalled or is running slowly.
+    // Lining the others up with it would hold them all back, so it just shows what it has.
+    const int64_t staleNs = std::max(kStaleTolerances * mToleranceNs, kMinStaleNs);
+    unsigned liveCameras = 0;
+    for (unsigned i = 0; i < textures.size(); i++) {
+        const std::vector<int64_t>& times = mFrameTimes[i];
+        if (!times.empty() && newestNs - times.back() <= staleNs) {
+            mLive[i] = true;
+            liveCameras++;
+        }
+    }
+
+    // With fewer than two cameras there's nothing to line up
+    if (liveCameras < 2) {
+        for (auto&& tex: textures) {
+            if (tex) {
+                tex->refresh();
+            }
+        }
+        return;
+    }
+
+    // Try lining up the live cameras with each one's newest frame, measuring the skew as the
+    // spread of the frames nearest that one
+    auto skewAround = [this](int64_t targetNs) {
+        int64_t earliest = INT64_MAX;
+        int64_t latest = INT64_MIN;
+        for (unsigned i = 0; i < mFrameTimes.size(); i++) {
+            if (mLive[i]) {
+                const int64_t t = closestTime(mFrameTimes[i], targetNs);
+                earliest = std::min(earliest, t);
+                latest = std::max(latest, t);
+            }
+        }
+        return latest - earliest;
+    };
+
+    int64_t bestTargetNs = -1;
+    int64_t bestSkewNs = INT64_MAX;
+    for (unsigned i = 0; i < mFrameTimes.size(); i++) {
+        if (!mLive[i]) {
+            continue;
+        }
+        const int64_t t = mFrameTimes[i].back();
+        const int64_t skew = skewAround(t);
+        const bool fits = (skew <= mToleranceNs);
+        const bool bestFits = (bestSkewNs <= mToleranceNs);
+        if (fits ? (!bestFits || t > bestTargetNs) : (!bestFits && skew < bestSkewNs)) {
+            bestTargetNs = t;
+            bestSkewNs = skew;
+        }
+    }
+
+    // Move each live texture to its chosen frame, unless that's the one it already shows
+    int64_t earliestNewest = INT64_MAX;
+    int64_t latestNewest = INT64_MIN;
+    for (unsigned i = 0; i < textures.size(); i++) {
+        if (!mLive[i]) {
+            if (textures[i]) {
+                textures[i]->refresh();
+            }
+            continue;
+        }
+
+        const std::vector<int64_t>& times = mFrameTimes[i];
+        earliestNewest = std::min(earliestNewest, times.back());
+        latestNewest = std::max(latestNewest, times.back());
+
+        const int64_t chosen = closestTime(times, bestTargetNs);
+        if (chosen != textures[i]->imageTimeNs()) {
+            textures[i]->refresh(chosen);
+        }
+    }
+
+    recordSkew(bestSkewNs, latestNewest - earliestNewest, liveCameras < textures.size());
+}
+
+
+void FrameSynchronizer::recordSkew(int64_t skewNs, int64_t newestSkewNs, bool anyStale) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (mStats.frames == 0) {
+        mStats.start = now;
+    }
+    mStats.frames++;
+    mStats.totalSkewNs += skewNs;
+    mStats.maxSkewNs = std::max(mStats.maxSkewNs, skewNs);
+    mStats.totalNewestSkewNs += newestSkewNs;
+    mStats.maxNewestSkewNs = std::max(mStats.maxNewestSkewNs, newestSkewNs);
+    if (skewNs > mToleranceNs) {
+        mStats.beyondTolerance++;
+    }
+    if (anyStale) {
+        mStats.withStaleCameras++;
+    }
+
+    if (now - mStats.start >= kSkewStatsInterval) {
+        const double frames = mStats.frames;
+        ALOGI("Camera skew over %u frames: avg %.1f ms, max %.1f ms, %u beyond tolerance, "
+              "%u leaving out stale cameras (newest frames would give avg %.1f ms, max %.1f ms)",
+              mStats.frames, mStats.totalSkewNs / 1e6 / frames, mStats.maxSkewNs / 1e6,
+              mStats.beyondTolerance, mStats.withStaleCameras,
+              mStats.totalNewestSkewNs / 1e6 / frames, mStats.maxNewestSkewNs / 1e6);
+        mStats = {};
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAR_EVS_APP_FRAMESYNCHRONIZER_H
+#define CAR_EVS_APP_FRAMESYNCHRONIZER_H
+
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "VideoTex.h"
+
+
+/*
+ * Picks the frame each of several video textures shows so that, together, they were captured
+ * as close together in time as possible.  Each camera's newest frame is a candidate to line the
+ * others up with.  Among sets of frames within our tolerance of each other we take the newest,
+ * to add no more latency than we must, and otherwise the set with the least skew.  A camera
+ * whose newest frame is far behind the others' is left out and simply shows its newest, so a
+ * stalled or slow camera only holds itself back.  The skew we achieve is logged periodically
+ * next to what simply showing the newest frame from every camera would have given.
+ */
+class FrameSynchronizer {
+public:
+    explicit FrameSynchronizer(float toleranceMs);
+
+    // Refreshes each texture, skipping any null entries
+    void refresh(const std::vector<VideoTex*>& textures);
+
+private:
+    void recordSkew(int64_t skewNs, int64_t newestSkewNs, bool anyStale);
+
+    int64_t                             mToleranceNs;
+    std::vector<std::vector<int64_t>>   mFrameTimes;    // Per texture, kept to save allocations
+    std::vector<bool>                   mLive;          // Per texture, not stale
+
+    struct {
+        std::chrono::steady_clock::time_point start;
+        unsigned    frames = 0;
+        unsigned    beyondTolerance = 0;
+        unsigned    withStaleCameras = 0;
+        int64_t     totalSkewNs = 0;
+        int64_t     maxSkewNs = 0;
+        int64_t     totalNewestSkewNs = 0;
+        int64_t     maxNewestSkewNs = 0;
+    } mStats;
+};
+
+
+#endif // CAR_EVS_APP_FRAMESYNCHRONIZER_H
@@ -17,6 +17,9 @@
 #include "RenderBase.h"
 #include "glError.h"
 
+#include <string.h>
+#include <chrono>
+
 #include <log/log.h>
 #include <ui/GraphicBuffer.h>
 
@@ -34,6 +37,12 @@ GLuint       RenderBase::sFrameBuffer = -1;
 GLuint       RenderBase::sColorBuffer = -1;
 GLuint       RenderBase::sDepthBuffer = -1;
 EGLImageKHR  RenderBase::sKHRimage = EGL_NO_IMAGE_KHR;
+EGLSyncKHR   RenderBase::sFrameFence = EGL_NO_SYNC_KHR;
+GLuint       RenderBase::sTimerQuery = 0;
+bool         RenderBase::sTimerQueryActive = false;
+bool         RenderBase::sTimerQueryPending = false;
+std::map<std::string, std::shared_ptr<VideoTex>> RenderBase::sVideoTextures;
+std::map<std::string, std::shared_ptr<TexWrapper>> RenderBase::sTextureAssets;
 unsigned     RenderBase::sWidth  = 0;
 unsigned     RenderBase::sHeight = 0;
 float        RenderBase::sAspectRatio = 0.0f;
@@ -120,6 +129,11 @@ bool RenderBase::prepareGL() {
     const char* gl_extensions = (const char*) glGetString(GL_EXTENSIONS);
     ALOGI("GL EXTENSIONS:\n  %s", gl_extensions);
 
+    // If we can, we'll time how long the GPU spends on each frame
+    if (gl_extensions && strstr(gl_extensions, "GL_EXT_disjoint_timer_query")) {
+        glGenQueries(1, &sTimerQuery);
+    }
+
 
     // Reserve handles for the color and depth targets we'll be setting up
     glGenRenderbuffers(1, &sColorBuffer);
@@ -197,6 +211,15 @@ bool RenderBase::attachRenderTarget(const BufferDesc& tgtBuffer) {
     // Set the viewport
     glViewport(0, 0, sWidth, sHeight);
 
+    // Start timing the GPU work for this frame
+    if (sTimerQuery && !sTimerQueryActive && !sTimerQueryPending) {
+        // Reading the disjoint flag clears it, so we'll know if anything upsets this measurement
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        glBeginQuery(GL_TIME_ELAPSED_EXT, sTimerQuery);
+        sTimerQueryActive = true;
+    }
+
 #if 1   // We don't actually need the clear if we're going to cover the whole screen anyway
     // Clear the color buffer
     glClearColor(0.8f, 0.1f, 0.2f, 1.0f);
@@ -209,9 +232,135 @@ bool RenderBase::attachRenderTarget(const BufferDesc& tgtBuffer) {
 
 
 void RenderBase::detachRenderTarget() {
-    // Drop our external render target
+    if (sTimerQueryActive) {
+        glEndQuery(GL_TIME_ELAPSED_EXT);
+        sTimerQueryActive = false;
+        sTimerQueryPending = true;
+    }
+
+    // Mark the end of this frame's work and get the GPU started on it
+    if (sFrameFence == EGL_NO_SYNC_KHR) {
+        sFrameFence = eglCreateSyncKHR(sDisplay, EGL_SYNC_FENCE_KHR, nullptr);
+        if (sFrameFence == EGL_NO_SYNC_KHR) {
+            ALOGE("Failed to create frame fence (%s), so waiting for the GPU now", getEGLError());
+            glFinish();
+        }
+    }
+    glFlush();
+
+    // Drop our external render target.  EGL keeps the image alive for as long as the work
+    // we've already submitted needs it.
     if (sKHRimage != EGL_NO_IMAGE_KHR) {
         eglDestroyImageKHR(sDisplay, sKHRimage);
         sKHRimage = EGL_NO_IMAGE_KHR;
     }
-}
\ No newline at end of file
+}
+
+
+void RenderBase::waitForFrame(uint64_t* pGpuTimeNs) {
+    // Longest we'll wait on the GPU before giving up on the fence
+    static const EGLTimeKHR kFrameTimeoutNs = 500 * 1000 * 1000;
+
+    *pGpuTimeNs = 0;
+    if (sFrameFence == EGL_NO_SYNC_KHR) {
+        releaseRetiredFrames();
+        return;
+    }
+
+    EGLint result = eglClientWaitSyncKHR(sDisplay, sFrameFence, 0, kFrameTimeoutNs);
+    eglDestroySyncKHR(sDisplay, sFrameFence);
+    sFrameFence = EGL_NO_SYNC_KHR;
+    if (result != EGL_CONDITION_SATISFIED_KHR) {
+        ALOGE("Frame fence wait failed (0x%X), so waiting for the GPU the hard way", result);
+        glFinish();
+    }
+
+    // The frame is done, so its timer result should be ready without stalling
+    if (sTimerQueryPending) {
+        sTimerQueryPending = false;
+
+        GLuint available = 0;
+        GLint disjoint = 0;
+        glGetQueryObjectuiv(sTimerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        if (available && !disjoint) {
+            GLuint elapsedNs = 0;
+            glGetQueryObjectuiv(sTimerQuery, GL_QUERY_RESULT, &elapsedNs);
+            *pGpuTimeNs = elapsedNs;
+        }
+    }
+
+    releaseRetiredFrames();
+}
+
+
+void RenderBase::releaseRetiredFrames() {
+    // Nothing in flight can be reading the frames our video textures have moved on from
+    for (auto&& entry: sVideoTextures) {
+        entry.second->releaseRetiredFrames();
+    }
+}
+
+
+std::shared_ptr<VideoTex> RenderBase::getVideoTexture(sp<IEvsEnumerator> pEnum,
+                                                      const ConfigManager::CameraInfo& info) {
+    auto it = sVideoTextures.find(info.cameraId);
+    if (it != sVideoTextures.end()) {
+        if (it->second->isStreaming()) {
+            ALOGD("Reusing the running video texture for %s", info.cameraId.c_str());
+            return it->second;
+        }
+
+        // Its stream ended, so start over with a new one.  Renderers still holding the old
+        // texture close its camera as they let go of it.
+        ALOGI("Video texture for %s stopped streaming, so replacing it", info.cameraId.c_str());
+        sVideoTextures.erase(it);
+    }
+
+    std::shared_ptr<VideoTex> tex(createVideoTexture(pEnum, info.cameraId.c_str(), sDisplay,
+                                                     info.outputFormat));
+    if (tex) {
+        sVideoTextures[info.cameraId] = tex;
+    }
+    return tex;
+}
+
+
+void RenderBase::releaseUnusedVideoTextures() {
+    for (auto it = sVideoTextures.begin(); it != sVideoTextures.end();) {
+        if (it->second.use_count() == 1) {
+            // We hold the only reference, so nobody is showing this camera anymore
+            ALOGD("Closing the video texture for %s", it->first.c_str());
+            it = sVideoTextures.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+std::shared_ptr<TexWrapper> RenderBase::getTextureAsset(const char* name) {
+    auto it = sTextureAssets.find(name);
+    if (it != sTextureAssets.end()) {
+        return it->second;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::string basePath = std::string("/system/etc/automotive/evs/") + name;
+    std::string path = basePath + ".tex";
+    std::shared_ptr<TexWrapper> tex(createTextureFromBakedFile(path.c_str()));
+    if (!tex) {
+        path = basePath + ".png";
+        tex.reset(createTextureFromPng(path.c_str()));
+    }
+    if (!tex) {
+        ALOGE("Failed to load the %s texture", name);
+        return nullptr;
+    }
+
+    ALOGI("Loaded %s in %.1f ms", path.c_str(),
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                  .count());
+    sTextureAssets[name] = tex;
+    return tex;
+}
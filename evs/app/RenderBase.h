@@ -26,6 +26,13 @@
 
 #include <android/hardware/automotive/evs/1.0/IEvsEnumerator.h>
 
+#include <map>
+#include <memory>
+#include <string>
+
+#include "ConfigManager.h"
+#include "VideoTex.h"
+
 using namespace ::android::hardware::automotive::evs::V1_0;
 using ::android::sp;
 
@@ -41,10 +48,40 @@ public:
     virtual bool activate() = 0;
     virtual void deactivate() = 0;
 
-    virtual bool drawFrame(const BufferDesc& tgtBuffer) = 0;
+    // Drawing a frame takes two steps.  prepareFrame does the CPU work of picking up new camera
+    // frames and deciding what to draw, and is called while the GPU may still be drawing the
+    // previous frame.  submitFrame then hands the drawing to the GPU once we have the target.
+    virtual bool prepareFrame() { return true; };
+    virtual bool submitFrame(const BufferDesc& tgtBuffer) = 0;
+
+    // submitFrame only submits its work to the GPU.  This blocks until that work is done, so the
+    // target buffer may be handed back for display, and reports how long the GPU spent on the
+    // frame (zero if the GL implementation can't tell us).  The camera frames our video
+    // textures moved away from go back to their cameras here too.  Returns immediately if no GL
+    // frame is in flight.
+    static void waitForFrame(uint64_t* pGpuTimeNs);
+
+    // Closes the cameras whose video textures aren't held by any renderer anymore
+    static void releaseUnusedVideoTextures();
+
+    // False until every camera this renderer shows has delivered a frame arriving at or after
+    // the given time on the steady clock
+    virtual bool isShowingVideoSince(int64_t /*timeNs*/) { return true; };
 
 protected:
     static bool prepareGL();
+    static void releaseRetiredFrames();
+
+    // Video textures are shared by all renderers and outlive them, so a camera shown in
+    // consecutive states keeps streaming across the switch.  One whose stream has ended is
+    // replaced with a new one.
+    static std::shared_ptr<VideoTex> getVideoTexture(sp<IEvsEnumerator> pEnum,
+                                                     const ConfigManager::CameraInfo& info);
+
+    // Image assets are loaded once and kept for as long as we run.  We look for a pre-baked
+    // texture file first, which maps straight into GL, and fall back to decoding the PNG.
+    // The name is the file's, without its directory or extension.
+    static std::shared_ptr<TexWrapper> getTextureAsset(const char* name);
 
     static bool attachRenderTarget(const BufferDesc& tgtBuffer);
     static void detachRenderTarget();
@@ -59,6 +96,16 @@ protected:
 
     static EGLImageKHR  sKHRimage;
 
+    static EGLSyncKHR   sFrameFence;        // Signaled when the last submitted frame is done
+    static GLuint       sTimerQuery;        // Zero if GPU timer queries aren't supported
+    static bool         sTimerQueryActive;  // Timing the frame being drawn
+    static bool         sTimerQueryPending; // Result not yet collected
+
+    static std::map<std::string, std::shared_ptr<VideoTex>>
+                        sVideoTextures;     // Keyed by camera id
+    static std::map<std::string, std::shared_ptr<TexWrapper>>
+                        sTextureAssets;     // Keyed by asset name
+
     static unsigned     sWidth;
     static unsigned     sHeight;
     static float        sAspectRatio;
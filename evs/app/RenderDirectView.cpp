@@ -50,12 +50,21 @@ bool RenderDirectView::activate() {
     }
 
     // Construct our video texture
-    mTexture.reset(createVideoTexture(mEnumerator, mCameraInfo.cameraId.c_str(), sDisplay));
+    mTexture = getVideoTexture(mEnumerator, mCameraInfo);
     if (!mTexture) {
         ALOGE("Failed to set up video texture for %s (%s)",
               mCameraInfo.cameraId.c_str(), mCameraInfo.function.c_str());
 // TODO:  For production use, we may actually want to fail in this case, but not yet...
 //       return false;
+    } else if (mTexture->glTarget() == GL_TEXTURE_EXTERNAL_OES && !mExternalShaderProgram) {
+        // The camera is giving us YUV buffers, so we need the external sampler to read them
+        mExternalShaderProgram = buildShaderProgram(vtxShader_simpleTexture,
+                                                    pixShader_simpleTextureExternal,
+                                                    "simpleTextureExternal");
+        if (!mExternalShaderProgram) {
+            ALOGE("Error buliding external texture shader program");
+            return false;
+        }
     }
 
     return true;
@@ -63,26 +72,38 @@ bool RenderDirectView::activate() {
 
 
 void RenderDirectView::deactivate() {
-    // Release our video texture
-    // We can't hold onto it because some other Render object might need the same camera
-    // TODO(b/131492626):  investigate whether sharing video textures can save
-    // the time.
-  mTexture = nullptr;
+    // Let go of our video texture.  The camera keeps streaming if the next state shows it too.
+    mTexture = nullptr;
 }
 
 
-bool RenderDirectView::drawFrame(const BufferDesc& tgtBuffer) {
+bool RenderDirectView::isShowingVideoSince(int64_t timeNs) {
+    return mTexture && mTexture->hasImageSince(timeNs);
+}
+
+
+bool RenderDirectView::prepareFrame() {
+    // Pick up the newest frame from our camera
+    mTexture->refresh();
+    return true;
+}
+
+
+bool RenderDirectView::submitFrame(const BufferDesc& tgtBuffer) {
     // Tell GL to render to the given buffer
     if (!attachRenderTarget(tgtBuffer)) {
         ALOGE("Failed to attached render target");
         return false;
     }
 
-    // Select our screen space simple texture shader
-    glUseProgram(mShaderProgram);
+    // Select our screen space simple texture shader, in the variant that can read our texture
+    const GLenum target = mTexture->glTarget();
+    const GLuint program = (target == GL_TEXTURE_EXTERNAL_OES) ? mExternalShaderProgram
+                                                                : mShaderProgram;
+    glUseProgram(program);
 
     // Set up the model to clip space transform (identity matrix if we're modeling in screen space)
-    GLint loc = glGetUniformLocation(mShaderProgram, "cameraMat");
+    GLint loc = glGetUniformLocation(program, "cameraMat");
     if (loc < 0) {
         ALOGE("Couldn't set shader parameter 'cameraMat'");
         return false;
@@ -93,12 +114,11 @@ bool RenderDirectView::drawFrame(const BufferDesc& tgtBuffer) {
 
 
     // Bind the texture and assign it to the shader's sampler
-    mTexture->refresh();
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, mTexture->glId());
+    glBindTexture(target, mTexture->glId());
 
 
-    GLint sampler = glGetUniformLocation(mShaderProgram, "tex");
+    GLint sampler = glGetUniformLocation(program, "tex");
     if (sampler < 0) {
         ALOGE("Couldn't set shader parameter 'tex'");
         return false;
@@ -134,11 +154,8 @@ bool RenderDirectView::drawFrame(const BufferDesc& tgtBuffer) {
     glDisableVertexAttribArray(1);
 
 
-    // Now that everything is submitted, release our hold on the texture resource
-    detachRenderTarget();
-
-    // Wait for the rendering to finish
-    glFinish();
+    // Now that everything is submitted, release our hold on the texture resource.
+    // We don't wait for the GPU here; our caller does that just before it returns the buffer.
     detachRenderTarget();
     return true;
 }
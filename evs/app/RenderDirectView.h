@@ -38,15 +38,19 @@ public:
     virtual bool activate() override;
     virtual void deactivate() override;
 
-    virtual bool drawFrame(const BufferDesc& tgtBuffer);
+    virtual bool prepareFrame();
+    virtual bool submitFrame(const BufferDesc& tgtBuffer);
+
+    virtual bool isShowingVideoSince(int64_t timeNs) override;
 
 protected:
     sp<IEvsEnumerator>              mEnumerator;
     ConfigManager::CameraInfo       mCameraInfo;
 
-    std::unique_ptr<VideoTex>       mTexture;
+    std::shared_ptr<VideoTex>       mTexture;
 
     GLuint                          mShaderProgram = 0;
+    GLuint                          mExternalShaderProgram = 0;     // For YUV camera buffers
 };
 
 
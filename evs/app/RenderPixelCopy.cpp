@@ -17,9 +17,15 @@
 #include "RenderPixelCopy.h"
 #include "FormatConvert.h"
 
+#include <algorithm>
+
 #include <log/log.h>
 
 
+// Most threads, counting the render thread, we'll split a frame's conversion between
+static const unsigned kMaxConversionThreads = 4;
+
+
 RenderPixelCopy::RenderPixelCopy(sp<IEvsEnumerator> enumerator,
                                    const ConfigManager::CameraInfo& cam) {
     mEnumerator = enumerator;
@@ -50,16 +56,19 @@ bool RenderPixelCopy::activate() {
 
     mStreamHandler = pStreamHandler;
 
+    startWorkers();
+
     return true;
 }
 
 
 void RenderPixelCopy::deactivate() {
+    stopWorkers();
     mStreamHandler = nullptr;
 }
 
 
-bool RenderPixelCopy::drawFrame(const BufferDesc& tgtBuffer) {
+bool RenderPixelCopy::submitFrame(const BufferDesc& tgtBuffer) {
     bool success = true;
 
     sp<android::GraphicBuffer> tgt = new android::GraphicBuffer(
@@ -90,31 +99,22 @@ bool RenderPixelCopy::drawFrame(const BufferDesc& tgtBuffer) {
                 src->lock(GRALLOC_USAGE_SW_READ_OFTEN, (void**)&srcPixels);
                 if (!srcPixels) {
                     ALOGE("Failed to get pointer into src image data");
-                }
-
-                // Make sure we don't run off the end of either buffer
-                const unsigned width     = std::min(tgtBuffer.width,
-                                                    srcBuffer.width);
-                const unsigned height    = std::min(tgtBuffer.height,
-                                                    srcBuffer.height);
-
-                if (srcBuffer.format == HAL_PIXEL_FORMAT_YCRCB_420_SP) {   // 420SP == NV21
-                    copyNV21toRGB32(width, height,
-                                    srcPixels,
-                                    tgtPixels, tgtBuffer.stride);
-                } else if (srcBuffer.format == HAL_PIXEL_FORMAT_YV12) { // YUV_420P == YV12
-                    copyYV12toRGB32(width, height,
-                                    srcPixels,
-                                    tgtPixels, tgtBuffer.stride);
-                } else if (srcBuffer.format == HAL_PIXEL_FORMAT_YCBCR_422_I) { // YUYV
-                    copyYUYVtoRGB32(width, height,
-                                    srcPixels, srcBuffer.stride,
-                                    tgtPixels, tgtBuffer.stride);
-                } else if (srcBuffer.format == tgtBuffer.format) {  // 32bit RGBA
-                    copyMatchedInterleavedFormats(width, height,
-                                                  srcPixels, srcBuffer.stride,
-                                                  tgtPixels, tgtBuffer.stride,
-                                                  tgtBuffer.pixelSize);
+                } else {
+                    // Scale the camera image to fill the display
+                    Job job;
+                    job.srcFormat = srcBuffer.format;
+                    job.srcWidth  = srcBuffer.width;
+                    job.srcHeight = srcBuffer.height;
+                    job.src       = srcPixels;
+                    job.srcStride = srcBuffer.stride;
+                    job.dst       = tgtPixels;
+                    job.dstWidth  = tgtBuffer.width;
+                    job.dstHeight = tgtBuffer.height;
+                    job.dstStride = tgtBuffer.stride;
+                    if (!convertFrame(job)) {
+                        ALOGE("Unsupported camera buffer format 0x%X", srcBuffer.format);
+                    }
+                    src->unlock();
                 }
 
                 mStreamHandler->doneWithFrame(srcBuffer);
@@ -131,3 +131,94 @@ bool RenderPixelCopy::drawFrame(const BufferDesc& tgtBuffer) {
 
     return success;
 }
+
+
+bool RenderPixelCopy::convertFrame(const Job& job) {
+    // Hand the other bands to our workers while we do the first
+    {
+        std::lock_guard<std::mutex> lock(mWorkLock);
+        mJob = job;
+        mJobNumber++;
+        mBandsPending = mWorkers.size();
+        mJobFailed = false;
+    }
+    mWorkSignal.notify_all();
+
+    bool ok = convertBand(0);
+
+    std::unique_lock<std::mutex> lock(mWorkLock);
+    mDoneSignal.wait(lock, [this]() { return mBandsPending == 0; });
+    return ok && !mJobFailed;
+}
+
+
+bool RenderPixelCopy::convertBand(unsigned band) {
+    const unsigned bandCount = mRowBuffers.size();
+    const unsigned firstRow = mJob.dstHeight * band / bandCount;
+    const unsigned endRow = mJob.dstHeight * (band + 1) / bandCount;
+
+    std::vector<uint32_t>& rowBuffer = mRowBuffers[band];
+    if (rowBuffer.size() < mJob.srcWidth) {
+        rowBuffer.resize(mJob.srcWidth);
+    }
+
+    return scaleToRGB32(mJob.srcFormat, mJob.srcWidth, mJob.srcHeight,
+                        mJob.src, mJob.srcStride,
+                        mJob.dst, mJob.dstWidth, mJob.dstHeight, mJob.dstStride,
+                        firstRow, endRow,
+                        rowBuffer.data());
+}
+
+
+void RenderPixelCopy::startWorkers() {
+    if (!mRowBuffers.empty()) {
+        // Already running
+        return;
+    }
+
+    const unsigned threads = std::max(1u, std::min(std::thread::hardware_concurrency(),
+                                                   kMaxConversionThreads));
+    mRowBuffers.resize(threads);
+    mStopping = false;
+    const uint64_t lastJob = mJobNumber;
+    for (unsigned band = 1; band < threads; band++) {
+        mWorkers.emplace_back([this, band, lastJob]() { runWorker(band, lastJob); });
+    }
+}
+
+
+void RenderPixelCopy::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(mWorkLock);
+        mStopping = true;
+    }
+    mWorkSignal.notify_all();
+
+    for (auto&& worker: mWorkers) {
+        worker.join();
+    }
+    mWorkers.clear();
+    mRowBuffers.clear();
+}
+
+
+// Waits for each new frame and converts its band, until we're stopped
+void RenderPixelCopy::runWorker(unsigned band, uint64_t lastJob) {
+    std::unique_lock<std::mutex> lock(mWorkLock);
+    while (true) {
+        mWorkSignal.wait(lock, [this, lastJob]() { return mStopping || mJobNumber != lastJob; });
+        if (mStopping) {
+            break;
+        }
+        lastJob = mJobNumber;
+
+        lock.unlock();
+        const bool ok = convertBand(band);
+        lock.lock();
+
+        mJobFailed |= !ok;
+        if (--mBandsPending == 0) {
+            mDoneSignal.notify_one();
+        }
+    }
+}
@@ -24,27 +24,68 @@
 #include "ConfigManager.h"
 #include "VideoTex.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 
 using namespace ::android::hardware::automotive::evs::V1_0;
 
 
 /*
  * Renders the view from a single specified camera directly to the full display.
+ * The image is converted and scaled on the CPU, split into bands of rows that a few worker
+ * threads fill in alongside the render thread.
  */
 class RenderPixelCopy: public RenderBase {
 public:
     RenderPixelCopy(sp<IEvsEnumerator> enumerator, const ConfigManager::CameraInfo& cam);
+    virtual ~RenderPixelCopy() { stopWorkers(); };
 
     virtual bool activate() override;
     virtual void deactivate() override;
 
-    virtual bool drawFrame(const BufferDesc& tgtBuffer);
+    virtual bool submitFrame(const BufferDesc& tgtBuffer);
 
 protected:
     sp<IEvsEnumerator>              mEnumerator;
     ConfigManager::CameraInfo       mCameraInfo;
 
     sp<StreamHandler>               mStreamHandler;
+
+private:
+    // Describes the frame being converted
+    struct Job {
+        uint32_t        srcFormat;
+        unsigned        srcWidth;
+        unsigned        srcHeight;
+        const uint8_t*  src;
+        unsigned        srcStride;
+        uint32_t*       dst;
+        unsigned        dstWidth;
+        unsigned        dstHeight;
+        unsigned        dstStride;
+    };
+
+    bool convertFrame(const Job& job);
+    bool convertBand(unsigned band);
+    void startWorkers();
+    void stopWorkers();
+    void runWorker(unsigned band, uint64_t lastJob);
+
+    std::vector<std::thread>        mWorkers;       // Band 0 is done by the render thread
+    std::vector<std::vector<uint32_t>>
+                                    mRowBuffers;    // One per band
+    Job                             mJob;
+
+    std::mutex                      mWorkLock;
+    std::condition_variable         mWorkSignal;
+    std::condition_variable         mDoneSignal;
+    uint64_t                        mJobNumber = 0;
+    unsigned                        mBandsPending = 0;
+    bool                            mJobFailed = false;
+    bool                            mStopping = false;
 };
 
 
@@ -16,11 +16,18 @@
 
 #include "RenderTopView.h"
 #include "VideoTex.h"
+#include "WarpMesh.h"
 #include "glError.h"
 #include "shader.h"
 #include "shader_simpleTex.h"
 #include "shader_projectedTex.h"
 
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+
 #include <log/log.h>
 #include <math/mat4.h>
 #include <math/vec3.h>
@@ -32,16 +39,24 @@ static const unsigned Y = 1;
 static const unsigned Z = 2;
 //static const unsigned W = 3;
 
+// Most cameras we'll project in a single pass.  Each needs a varying and a texture unit, and
+// this stays well within the minimums GLES 3 guarantees for both.
+static const unsigned kMaxCompositeCameras = 8;
+
+// The widest field of view a perspective projection can express.  Fisheye cameras may see
+// further than that, and only the warp mesh shows them properly; projecting them is a fallback
+// that shows the middle of their view.
+static const float kMaxProjectedFov = 179.0f * M_PI / 180.0f;
+
 
-// Since we assume no roll in these views, we can simplify the required math
-static android::vec3 unitVectorFromPitchAndYaw(float pitch, float yaw) {
-    float sinPitch, cosPitch;
-    sincosf(pitch, &sinPitch, &cosPitch);
-    float sinYaw, cosYaw;
-    sincosf(yaw, &sinYaw, &cosYaw);
-    return android::vec3(cosPitch * -sinYaw,
-                         cosPitch * cosYaw,
-                         sinPitch);
+// Appends printf style formatted text to a string
+template <typename... Args>
+static void appendf(std::string& str, const char* format, Args... args) {
+    const size_t start = str.size();
+    const int length = snprintf(nullptr, 0, format, args...);
+    str.resize(start + length + 1);
+    snprintf(&str[start], length + 1, format, args...);
+    str.resize(start + length);
 }
 
 
@@ -61,41 +76,12 @@ static android::mat4 perspective(float hfov, float vfov, float near, float far)
 }
 
 
-// Helper function to set up a view matrix for a camera given it's yaw & pitch & location
-// Yes, with a bit of work, we could use lookAt, but it does a lot of extra work
-// internally that we can short cut.
-static android::mat4 cameraLookMatrix(const ConfigManager::CameraInfo& cam) {
-    float sinYaw, cosYaw;
-    sincosf(cam.yaw, &sinYaw, &cosYaw);
-
-    // Construct principal unit vectors
-    android::vec3 vAt = unitVectorFromPitchAndYaw(cam.pitch, cam.yaw);
-    android::vec3 vRt = android::vec3(cosYaw, sinYaw, 0.0f);
-    android::vec3 vUp = -cross(vAt, vRt);
-    android::vec3 eye = android::vec3(cam.position[X], cam.position[Y], cam.position[Z]);
-
-    android::mat4 Result(1.0f);
-    Result[0][0] = vRt.x;
-    Result[1][0] = vRt.y;
-    Result[2][0] = vRt.z;
-    Result[0][1] = vUp.x;
-    Result[1][1] = vUp.y;
-    Result[2][1] = vUp.z;
-    Result[0][2] =-vAt.x;
-    Result[1][2] =-vAt.y;
-    Result[2][2] =-vAt.z;
-    Result[3][0] =-dot(vRt, eye);
-    Result[3][1] =-dot(vUp, eye);
-    Result[3][2] = dot(vAt, eye);
-    return Result;
-}
-
-
 RenderTopView::RenderTopView(sp<IEvsEnumerator> enumerator,
                              const std::vector<ConfigManager::CameraInfo>& camList,
                              const ConfigManager& mConfig) :
     mEnumerator(enumerator),
-    mConfig(mConfig) {
+    mConfig(mConfig),
+    mFrameSync(mConfig.getSyncToleranceMs()) {
 
     // Copy the list of cameras we're to employ into our local storage.  We'll create and
     // associate a streaming video texture when we are activated.
@@ -113,73 +99,302 @@ bool RenderTopView::activate() {
         return false;
     }
 
-    // Load our shader programs
-    mPgmAssets.simpleTexture = buildShaderProgram(vtxShader_simpleTexture,
-                                                 pixShader_simpleTexture,
-                                                 "simpleTexture");
+    // Load our shader programs, unless we're being activated again and already have them
+    bool programsBuilt = false;
     if (!mPgmAssets.simpleTexture) {
-        ALOGE("Failed to build shader program");
-        return false;
+        mPgmAssets.simpleTexture = buildShaderProgram(vtxShader_simpleTexture,
+                                                     pixShader_simpleTexture,
+                                                     "simpleTexture");
+        if (!mPgmAssets.simpleTexture) {
+            ALOGE("Failed to build shader program");
+            return false;
+        }
     }
-    mPgmAssets.projectedTexture = buildShaderProgram(vtxShader_projectedTexture,
-                                                    pixShader_projectedTexture,
-                                                    "projectedTexture");
     if (!mPgmAssets.projectedTexture) {
-        ALOGE("Failed to build shader program");
-        return false;
+        mPgmAssets.projectedTexture = buildShaderProgram(vtxShader_projectedTexture,
+                                                        pixShader_projectedTexture,
+                                                        "projectedTexture");
+        if (!mPgmAssets.projectedTexture) {
+            ALOGE("Failed to build shader program");
+            return false;
+        }
     }
 
 
-    // Load the checkerboard text image
-    mTexAssets.checkerBoard.reset(createTextureFromPng(
-                                  "/system/etc/automotive/evs/LabeledChecker.png"));
+    // Get the checkerboard text image
     if (!mTexAssets.checkerBoard) {
-        ALOGE("Failed to load checkerboard texture");
-        return false;
+        mTexAssets.checkerBoard = getTextureAsset("LabeledChecker");
+        if (!mTexAssets.checkerBoard) {
+            ALOGE("Failed to load checkerboard texture");
+            return false;
+        }
     }
 
-    // Load the car image
-    mTexAssets.carTopView.reset(createTextureFromPng(
-                                "/system/etc/automotive/evs/CarFromTop.png"));
+    // Get the car image
     if (!mTexAssets.carTopView) {
-        ALOGE("Failed to load carTopView texture");
-        return false;
+        mTexAssets.carTopView = getTextureAsset("CarFromTop");
+        if (!mTexAssets.carTopView) {
+            ALOGE("Failed to load carTopView texture");
+            return false;
+        }
     }
 
 
     // Set up streaming video textures for our associated cameras
     for (auto&& cam: mActiveCameras) {
-        cam.tex.reset(createVideoTexture(mEnumerator, cam.info.cameraId.c_str(), sDisplay));
+        cam.tex = getVideoTexture(mEnumerator, cam.info);
         if (!cam.tex) {
             ALOGE("Failed to set up video texture for %s (%s)",
                   cam.info.cameraId.c_str(), cam.info.function.c_str());
 // TODO:  For production use, we may actually want to fail in this case, but not yet...
 //            return false;
+        } else if (cam.tex->glTarget() == GL_TEXTURE_EXTERNAL_OES &&
+                   !mPgmAssets.projectedTextureExternal) {
+            mPgmAssets.projectedTextureExternal =
+                    buildShaderProgram(vtxShader_projectedTexture,
+                                       pixShader_projectedTextureExternal,
+                                       "projectedTextureExternal");
+            if (!mPgmAssets.projectedTextureExternal) {
+                ALOGE("Failed to build shader program");
+                return false;
+            }
+            programsBuilt = true;
         }
     }
 
+    // Build the program that projects all our cameras at once, unless we already have one
+    // for the same set of textures.  If we can't, we'll draw them one at a time.
+    if (!buildCompositeProgram(&programsBuilt)) {
+        ALOGW("Drawing each camera in a separate pass");
+    }
+
+    // Set up our vertex arrays, which we'll fill in once we know our display's aspect ratio.
+    // Any programs we just built need their uniforms set then too, and a new warp mesh program
+    // needs its mesh, but when we're activated again with the programs we had, what we set up
+    // last time still stands.
+    if (!mGeometry.carVertexArray) {
+        glGenVertexArrays(1, &mGeometry.carVertexArray);
+        glGenBuffers(1, &mGeometry.carBuffer);
+        glGenVertexArrays(1, &mGeometry.groundVertexArray);
+        glGenBuffers(1, &mGeometry.groundBuffer);
+        glGenVertexArrays(1, &mGeometry.meshVertexArray);
+        glGenBuffers(1, &mGeometry.meshBuffer);
+        glGenBuffers(1, &mGeometry.meshIndexBuffer);
+        programsBuilt = true;
+    }
+    if (programsBuilt) {
+        lookUpUniforms();
+        mGeometry.aspectRatio = 0.0f;
+    }
+
     return true;
 }
 
 
 void RenderTopView::deactivate() {
-    // Release our video textures
-    // We can't hold onto it because some other Render object might need the same camera
-    // TODO(b/131492626):  investigate whether sharing video textures can save
-    // the time.
+    // Let go of our video textures.  Cameras keep streaming if the next state shows them too.
     for (auto&& cam: mActiveCameras) {
         cam.tex = nullptr;
     }
 }
 
 
-bool RenderTopView::drawFrame(const BufferDesc& tgtBuffer) {
+bool RenderTopView::isShowingVideoSince(int64_t timeNs) {
+    for (auto&& cam: mActiveCameras) {
+        if (cam.tex && !cam.tex->hasImageSince(timeNs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool RenderTopView::prepareFrame() {
+    // Refresh our video texture contents, picking the frames that best line up in time
+    mFrameSyncTextures.clear();
+    for (auto&& cam: mActiveCameras) {
+        mFrameSyncTextures.push_back(cam.tex.get());
+    }
+    mFrameSync.refresh(mFrameSyncTextures);
+    return true;
+}
+
+
+bool RenderTopView::submitFrame(const BufferDesc& tgtBuffer) {
     // Tell GL to render to the given buffer
     if (!attachRenderTarget(tgtBuffer)) {
         ALOGE("Failed to attached render target");
         return false;
     }
 
+    // Our geometry and matrices only need rebuilding if the display's shape has changed
+    if (mGeometry.aspectRatio != sAspectRatio) {
+        updateGeometry();
+    }
+
+    // Project the camera images onto the ground plane
+    renderCamerasOntoGroundPlane();
+
+    // Draw the car image
+    renderCarTopView();
+
+    // Now that everythign is submitted, release our hold on the texture resource.
+    // We don't wait for the GPU here; our caller does that just before it returns the buffer.
+    detachRenderTarget();
+    return true;
+}
+
+
+void RenderTopView::lookUpUniforms() {
+    mUniforms.simpleCameraMat = glGetUniformLocation(mPgmAssets.simpleTexture, "cameraMat");
+    mUniforms.projectedCameraMat = glGetUniformLocation(mPgmAssets.projectedTexture,
+                                                        "cameraMat");
+    mUniforms.projectedProjectionMat = glGetUniformLocation(mPgmAssets.projectedTexture,
+                                                            "projectionMat");
+    if (mPgmAssets.projectedTextureExternal) {
+        mUniforms.externalCameraMat =
+                glGetUniformLocation(mPgmAssets.projectedTextureExternal, "cameraMat");
+        mUniforms.externalProjectionMat =
+                glGetUniformLocation(mPgmAssets.projectedTextureExternal, "projectionMat");
+    }
+
+    mUniforms.compositeProjectionMats.clear();
+    if (mPgmAssets.composite) {
+        mUniforms.compositeCameraMat = glGetUniformLocation(mPgmAssets.composite, "cameraMat");
+
+        // Each camera samples from the texture unit matching its index
+        glUseProgram(mPgmAssets.composite);
+        char name[32];
+        for (unsigned i = 0; i < mCompositeTargets.size(); i++) {
+            snprintf(name, sizeof(name), "projectionMat%u", i);
+            mUniforms.compositeProjectionMats.push_back(
+                    glGetUniformLocation(mPgmAssets.composite, name));
+            snprintf(name, sizeof(name), "tex%u", i);
+            glUniform1i(glGetUniformLocation(mPgmAssets.composite, name), i);
+        }
+    }
+
+    if (mPgmAssets.warpMesh) {
+        mUniforms.warpMeshCameraMat = glGetUniformLocation(mPgmAssets.warpMesh, "cameraMat");
+
+        glUseProgram(mPgmAssets.warpMesh);
+        char name[32];
+        for (unsigned i = 0; i < mCompositeTargets.size(); i++) {
+            snprintf(name, sizeof(name), "tex%u", i);
+            glUniform1i(glGetUniformLocation(mPgmAssets.warpMesh, name), i);
+        }
+    }
+}
+
+
+bool RenderTopView::buildCompositeProgram(bool* pBuilt) {
+    if (mActiveCameras.empty() || mActiveCameras.size() > kMaxCompositeCameras) {
+        return false;
+    }
+
+    // Which kind of sampler does each camera need?  Cameras without video show our checkerboard.
+    std::vector<GLenum> targets;
+    bool anyExternal = false;
+    for (auto&& cam: mActiveCameras) {
+        targets.push_back(cam.tex ? cam.tex->glTarget() : GL_TEXTURE_2D);
+        anyExternal |= (targets.back() == GL_TEXTURE_EXTERNAL_OES);
+    }
+    if (mPgmAssets.composite && targets == mCompositeTargets) {
+        // What we have already will do
+        return true;
+    }
+
+    // Whatever happens from here, the programs we had are gone
+    *pBuilt = true;
+    if (mPgmAssets.composite) {
+        glDeleteProgram(mPgmAssets.composite);
+        mPgmAssets.composite = 0;
+    }
+    if (mPgmAssets.warpMesh) {
+        glDeleteProgram(mPgmAssets.warpMesh);
+        mPgmAssets.warpMesh = 0;
+    }
+
+    // Assemble the shaders for this set of cameras
+    std::string vtxSrc = vtxShader_compositeHeader;
+    std::string pixSrc;
+    appendf(pixSrc, pixShader_compositeHeader, anyExternal ? pixShader_compositeExtension : "");
+    for (unsigned i = 0; i < targets.size(); i++) {
+        appendf(vtxSrc, vtxShader_compositeCamera, i, i);
+        appendf(pixSrc, pixShader_compositeCamera,
+                (targets[i] == GL_TEXTURE_EXTERNAL_OES) ? "samplerExternalOES" : "sampler2D",
+                i, i);
+    }
+    vtxSrc += vtxShader_compositeMainStart;
+    pixSrc += pixShader_compositeMainStart;
+    for (unsigned i = 0; i < targets.size(); i++) {
+        appendf(vtxSrc, vtxShader_compositeMainCamera, i, i);
+        appendf(pixSrc, pixShader_compositeMainCamera, i, i);
+    }
+    vtxSrc += vtxShader_compositeMainEnd;
+    pixSrc += pixShader_compositeMainEnd;
+
+    mPgmAssets.composite = buildShaderProgram(vtxSrc.c_str(), pixSrc.c_str(), "composite");
+    if (!mPgmAssets.composite) {
+        ALOGE("Failed to build shader program");
+        mCompositeTargets.clear();
+        return false;
+    }
+
+    mCompositeTargets = targets;
+
+    // Drawing through a warp mesh needs the same samplers, so we build that program here too
+    if (!buildWarpMeshProgram()) {
+        ALOGW("Projecting cameras without a warp mesh");
+    }
+    return true;
+}
+
+
+bool RenderTopView::buildWarpMeshProgram() {
+    if (mCompositeTargets.size() > WarpMesh::kMaxCameras) {
+        return false;
+    }
+
+    bool anyExternal = false;
+    for (auto&& target: mCompositeTargets) {
+        anyExternal |= (target == GL_TEXTURE_EXTERNAL_OES);
+    }
+
+    // Assemble the shaders for this set of cameras, whose mesh attributes follow the position
+    std::string vtxSrc = vtxShader_warpMeshHeader;
+    std::string pixSrc;
+    appendf(pixSrc, pixShader_warpMeshHeader, anyExternal ? pixShader_compositeExtension : "");
+    for (unsigned i = 0; i < mCompositeTargets.size(); i++) {
+        appendf(vtxSrc, vtxShader_warpMeshCamera, i + 1, i, i);
+        appendf(pixSrc, pixShader_warpMeshCamera,
+                (mCompositeTargets[i] == GL_TEXTURE_EXTERNAL_OES) ? "samplerExternalOES"
+                                                                  : "sampler2D",
+                i, i);
+    }
+    vtxSrc += vtxShader_compositeMainStart;
+    pixSrc += pixShader_warpMeshMainStart;
+    for (unsigned i = 0; i < mCompositeTargets.size(); i++) {
+        appendf(vtxSrc, vtxShader_warpMeshMainCamera, i, i);
+        appendf(pixSrc, pixShader_warpMeshMainCamera, i, i, i);
+    }
+    vtxSrc += vtxShader_compositeMainEnd;
+    pixSrc += pixShader_compositeMainEnd;
+
+    mPgmAssets.warpMesh = buildShaderProgram(vtxSrc.c_str(), pixSrc.c_str(), "warpMesh");
+    return mPgmAssets.warpMesh != 0;
+}
+
+
+//
+// Builds everything that depends only on our configuration and the shape of the display, so
+// that drawing a frame is just a matter of binding and drawing.
+// Our car image is drawn in car model space (units of meters with origin at center of rear axel)
+// and the ground plane in the same space.
+//
+void RenderTopView::updateGeometry() {
+    mGeometry.aspectRatio = sAspectRatio;
+
     // Set up our top down projection matrix from car space (world units, Xfwd, Yright, Zup)
     // to view space (-1 to 1)
     const float top    = mConfig.getDisplayTopLocation();
@@ -196,40 +411,26 @@ bool RenderTopView::drawFrame(const BufferDesc& tgtBuffer) {
 //    orthoMatrix = android::mat4::ortho(left, right, bottom, top, near, far);
     orthoMatrix = android::mat4::ortho(left, right, top, bottom, near, far);
 
-
-    // Refresh our video texture contents.  We do it all at once in hopes of getting
-    // better coherence among images.  This does not guarantee synchronization, of course...
-    for (auto&& cam: mActiveCameras) {
-        if (cam.tex) {
-            cam.tex->refresh();
-        }
+    // The view matrix is the same for every draw, so it can live in the programs' uniforms
+    glUseProgram(mPgmAssets.simpleTexture);
+    glUniformMatrix4fv(mUniforms.simpleCameraMat, 1, false, orthoMatrix.asArray());
+    glUseProgram(mPgmAssets.projectedTexture);
+    glUniformMatrix4fv(mUniforms.projectedCameraMat, 1, false, orthoMatrix.asArray());
+    if (mPgmAssets.projectedTextureExternal) {
+        glUseProgram(mPgmAssets.projectedTextureExternal);
+        glUniformMatrix4fv(mUniforms.externalCameraMat, 1, false, orthoMatrix.asArray());
     }
-
-    // Iterate over all the cameras and project their images onto the ground plane
-    for (auto&& cam: mActiveCameras) {
-        renderCameraOntoGroundPlane(cam);
+    if (mPgmAssets.composite) {
+        glUseProgram(mPgmAssets.composite);
+        glUniformMatrix4fv(mUniforms.compositeCameraMat, 1, false, orthoMatrix.asArray());
+    }
+    if (mPgmAssets.warpMesh) {
+        glUseProgram(mPgmAssets.warpMesh);
+        glUniformMatrix4fv(mUniforms.warpMeshCameraMat, 1, false, orthoMatrix.asArray());
     }
-
-    // Draw the car image
-    renderCarTopView();
-
-    // Now that everythign is submitted, release our hold on the texture resource
-    detachRenderTarget();
-
-    // Wait for the rendering to finish
-    glFinish();
-    detachRenderTarget();
-    return true;
-}
 
 
-//
-// Responsible for drawing the car's self image in the top down view.
-// Draws in car model space (units of meters with origin at center of rear axel)
-// NOTE:  We probably want to eventually switch to using a VertexArray based model system.
-//
-void RenderTopView::renderCarTopView() {
-    // Compute the corners of our image footprint in car space
+    // Compute the corners of our car image footprint in car space
     const float carLengthInTexels = mConfig.carGraphicRearPixel() - mConfig.carGraphicFrontPixel();
     const float carSpaceUnitsPerTexel = mConfig.getCarLength() / carLengthInTexels;
     const float textureHeightInCarSpace = mTexAssets.carTopView->height() * carSpaceUnitsPerTexel;
@@ -244,38 +445,179 @@ void RenderTopView::renderCarTopView() {
     const float ltCS = 0.5f * textureHeightInCarSpace * textureAspectRatio;
     const float rtCS = -ltCS;
 
-    GLfloat vertsCarPos[] = { ltCS, tpCS, 0.0f,   // left top in car space
-                              rtCS, tpCS, 0.0f,   // right top
-                              ltCS, btCS, 0.0f,   // left bottom
-                              rtCS, btCS, 0.0f    // right bottom
-    };
+    // Positions followed by texture coordinates
     // NOTE:  We didn't flip the image in the texture, so V=0 is actually the top of the image
-    GLfloat vertsCarTex[] = { 0.0f, 0.0f,   // left top
-                              1.0f, 0.0f,   // right top
-                              0.0f, 1.0f,   // left bottom
-                              1.0f, 1.0f    // right bottom
+    const GLfloat carVerts[] = { ltCS, tpCS, 0.0f,   // left top in car space
+                                 rtCS, tpCS, 0.0f,   // right top
+                                 ltCS, btCS, 0.0f,   // left bottom
+                                 rtCS, btCS, 0.0f,   // right bottom
+                                 0.0f, 0.0f,         // left top
+                                 1.0f, 0.0f,         // right top
+                                 0.0f, 1.0f,         // left bottom
+                                 1.0f, 1.0f          // right bottom
     };
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, vertsCarPos);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, vertsCarTex);
+    glBindVertexArray(mGeometry.carVertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, mGeometry.carBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(carVerts), carVerts, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0,
+                          reinterpret_cast<const void*>(12 * sizeof(GLfloat)));
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
 
 
+    // The ground plane covers the whole window.  With the composite program we fill it once
+    // for all cameras, each fragment weighing only the cameras whose view it falls inside.
+    const float wsHeight = top - bottom;
+    const float wsWidth = wsHeight * sAspectRatio;
+    const float wsRight =  wsWidth * 0.5f;
+    const float wsLeft = -wsRight;
+
+    const GLfloat groundVerts[] = { wsLeft,  top,    0.0f,
+                                    wsRight, top,    0.0f,
+                                    wsLeft,  bottom, 0.0f,
+                                    wsRight, bottom, 0.0f,
+    };
+    glBindVertexArray(mGeometry.groundVertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, mGeometry.groundBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(groundVerts), groundVerts, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glEnableVertexAttribArray(0);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+
+    // How far is the farthest any camera should even consider projecting it's image?
+    const float visibleSizeV = wsHeight;
+    const float visibleSizeH = visibleSizeV * sAspectRatio;
+    const float maxRange = (visibleSizeH > visibleSizeV) ? visibleSizeH : visibleSizeV;
+
+    // Construct the projection matrix (View + Projection) associated with each sensor
+    // TODO:  Consider just hard coding the far plane distance as it likely doesn't matter
+    for (auto&& cam: mActiveCameras) {
+        const android::mat4 V = cameraLookMatrix(cam.info);
+        const android::mat4 P = perspective(std::min(cam.info.hfov, kMaxProjectedFov),
+                                            std::min(cam.info.vfov, kMaxProjectedFov),
+                                            cam.info.position[Z], maxRange);
+        cam.projectionMatrix = P*V;
+    }
+
+    // Which don't change either, so the composite program can keep them all
+    if (mPgmAssets.composite) {
+        glUseProgram(mPgmAssets.composite);
+        for (unsigned i = 0; i < mActiveCameras.size(); i++) {
+            glUniformMatrix4fv(mUniforms.compositeProjectionMats[i], 1, false,
+                               mActiveCameras[i].projectionMatrix.asArray());
+        }
+    }
+
+    updateWarpMesh();
+}
+
+
+//
+// Loads or builds the mesh that maps the ground we show into each camera's image, and hands it
+// to the GPU.  Without one we fall back to projecting the cameras.
+//
+void RenderTopView::updateWarpMesh() {
+    mGeometry.meshIndexCount = 0;
+    if (!mPgmAssets.warpMesh) {
+        return;
+    }
+
+    std::vector<const ConfigManager::CameraInfo*> cameras;
+    for (auto&& cam: mActiveCameras) {
+        cameras.push_back(&cam.info);
+    }
+    WarpMesh mesh;
+    if (!mesh.initialize(mConfig, cameras, sAspectRatio,
+                         mConfig.getWarpMeshCachePath().c_str())) {
+        return;
+    }
+
+    // Each camera's image coordinates and weight follow the position, normalized from 16 bits
+    const GLsizei stride = sizeof(WarpMesh::Vertex);
+    glBindVertexArray(mGeometry.meshVertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, mGeometry.meshBuffer);
+    glBufferData(GL_ARRAY_BUFFER, mesh.vertices().size() * stride, mesh.vertices().data(),
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mGeometry.meshIndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices().size() * sizeof(uint16_t),
+                 mesh.indices().data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+                          reinterpret_cast<const void*>(offsetof(WarpMesh::Vertex, x)));
+    glEnableVertexAttribArray(0);
+    for (unsigned i = 0; i < mesh.cameraCount(); i++) {
+        glVertexAttribPointer(i + 1, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride,
+                              reinterpret_cast<const void*>(offsetof(WarpMesh::Vertex, camera) +
+                                                            i * sizeof(uint16_t) *
+                                                            WarpMesh::kCameraComponents));
+        glEnableVertexAttribArray(i + 1);
+    }
+
+    // Our vertex array keeps hold of the index buffer binding
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    mGeometry.meshIndexCount = mesh.indices().size();
+}
+
+
+//
+// Responsible for drawing the car's self image in the top down view.
+//
+void RenderTopView::renderCarTopView() {
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     glUseProgram(mPgmAssets.simpleTexture);
-    GLint loc = glGetUniformLocation(mPgmAssets.simpleTexture, "cameraMat");
-    glUniformMatrix4fv(loc, 1, false, orthoMatrix.asArray());
     glBindTexture(GL_TEXTURE_2D, mTexAssets.carTopView->glId());
 
+    glBindVertexArray(mGeometry.carVertexArray);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
 
+    glDisable(GL_BLEND);
+}
+
+
+//
+// Projects every camera onto the ground plane.  When we can, we do them all in one pass which
+// touches each pixel once and blends where cameras overlap, rather than filling the whole ground
+// plane again for every camera.  Best of all is drawing through our warp mesh, which leaves
+// nothing to compute per pixel but the blend.
+//
+void RenderTopView::renderCamerasOntoGroundPlane() {
+    if (!mPgmAssets.composite) {
+        for (auto&& cam: mActiveCameras) {
+            renderCameraOntoGroundPlane(cam);
+        }
+        return;
+    }
 
+    const bool useMesh = (mGeometry.meshIndexCount > 0);
     glDisable(GL_BLEND);
+    glUseProgram(useMesh ? mPgmAssets.warpMesh : mPgmAssets.composite);
+
+    // Every camera gets its own texture unit
+    for (unsigned i = 0; i < mActiveCameras.size(); i++) {
+        const ActiveCamera& cam = mActiveCameras[i];
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(mCompositeTargets[i],
+                      cam.tex ? cam.tex->glId() : mTexAssets.checkerBoard->glId());
+    }
+    glActiveTexture(GL_TEXTURE0);
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
+    if (useMesh) {
+        glBindVertexArray(mGeometry.meshVertexArray);
+        glDrawElements(GL_TRIANGLES, mGeometry.meshIndexCount, GL_UNSIGNED_SHORT, nullptr);
+    } else {
+        glBindVertexArray(mGeometry.groundVertexArray);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+    glBindVertexArray(0);
 }
 
 
@@ -284,60 +626,31 @@ void RenderTopView::renderCarTopView() {
 // to see if that simplifies the math, although we'll still want to compute the actual ground
 // interception points taking into account the pitchLimit as below.
 void RenderTopView::renderCameraOntoGroundPlane(const ActiveCamera& cam) {
-    // How far is the farthest any camera should even consider projecting it's image?
-    const float visibleSizeV = mConfig.getDisplayTopLocation() - mConfig.getDisplayBottomLocation();
-    const float visibleSizeH = visibleSizeV * sAspectRatio;
-    const float maxRange = (visibleSizeH > visibleSizeV) ? visibleSizeH : visibleSizeV;
-
-    // Construct the projection matrix (View + Projection) associated with this sensor
-    // TODO:  Consider just hard coding the far plane distance as it likely doesn't matter
-    const android::mat4 V = cameraLookMatrix(cam.info);
-    const android::mat4 P = perspective(cam.info.hfov, cam.info.vfov, cam.info.position[Z], maxRange);
-    const android::mat4 projectionMatix = P*V;
-
-    // Just draw the whole darn ground plane for now -- we're wasting fill rate, but so what?
-    // A 2x optimization would be to draw only the 1/2 space of the window in the direction
-    // the sensor is facing.  A more complex solution would be to construct the intersection
-    // of the sensor volume with the ground plane and render only that geometry.
-    const float top = mConfig.getDisplayTopLocation();
-    const float bottom = mConfig.getDisplayBottomLocation();
-    const float wsHeight = top - bottom;
-    const float wsWidth = wsHeight * sAspectRatio;
-    const float right =  wsWidth * 0.5f;
-    const float left = -right;
-
-    const android::vec3 topLeft(left, top, 0.0f);
-    const android::vec3 topRight(right, top, 0.0f);
-    const android::vec3 botLeft(left, bottom, 0.0f);
-    const android::vec3 botRight(right, bottom, 0.0f);
-
-    GLfloat vertsPos[] = { topLeft[X],  topLeft[Y],  topLeft[Z],
-                           topRight[X], topRight[Y], topRight[Z],
-                           botLeft[X],  botLeft[Y],  botLeft[Z],
-                           botRight[X], botRight[Y], botRight[Z],
-    };
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, vertsPos);
-    glEnableVertexAttribArray(0);
-
-
     glDisable(GL_BLEND);
 
-    glUseProgram(mPgmAssets.projectedTexture);
-    GLint locCam = glGetUniformLocation(mPgmAssets.projectedTexture, "cameraMat");
-    glUniformMatrix4fv(locCam, 1, false, orthoMatrix.asArray());
-    GLint locProj = glGetUniformLocation(mPgmAssets.projectedTexture, "projectionMat");
-    glUniformMatrix4fv(locProj, 1, false, projectionMatix.asArray());
-
+    // YUV camera buffers need the external sampler variant of our projection shader
     GLuint texId;
+    GLenum target;
     if (cam.tex) {
         texId = cam.tex->glId();
+        target = cam.tex->glTarget();
     } else {
         texId = mTexAssets.checkerBoard->glId();
+        target = GL_TEXTURE_2D;
+    }
+    if (target == GL_TEXTURE_EXTERNAL_OES) {
+        glUseProgram(mPgmAssets.projectedTextureExternal);
+        glUniformMatrix4fv(mUniforms.externalProjectionMat, 1, false,
+                           cam.projectionMatrix.asArray());
+    } else {
+        glUseProgram(mPgmAssets.projectedTexture);
+        glUniformMatrix4fv(mUniforms.projectedProjectionMat, 1, false,
+                           cam.projectionMatrix.asArray());
     }
-    glBindTexture(GL_TEXTURE_2D, texId);
-
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
+    glBindTexture(target, texId);
 
-    glDisableVertexAttribArray(0);
+    glBindVertexArray(mGeometry.groundVertexArray);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
 }
@@ -23,6 +23,7 @@
 
 #include <android/hardware/automotive/evs/1.0/IEvsEnumerator.h>
 #include "ConfigManager.h"
+#include "FrameSynchronizer.h"
 #include "VideoTex.h"
 #include <math/mat4.h>
 
@@ -42,33 +43,77 @@ public:
     virtual bool activate() override;
     virtual void deactivate() override;
 
-    virtual bool drawFrame(const BufferDesc& tgtBuffer);
+    virtual bool prepareFrame();
+    virtual bool submitFrame(const BufferDesc& tgtBuffer);
+
+    virtual bool isShowingVideoSince(int64_t timeNs) override;
 
 protected:
     struct ActiveCamera {
         const ConfigManager::CameraInfo&    info;
-        std::unique_ptr<VideoTex>           tex;
+        std::shared_ptr<VideoTex>           tex;
+        android::mat4                       projectionMatrix;   // Car space to sensor image
 
         ActiveCamera(const ConfigManager::CameraInfo& c) : info(c) {};
     };
 
+    void lookUpUniforms();
+    bool buildCompositeProgram(bool* pBuilt);    // Sets *pBuilt if it changed our programs
+    bool buildWarpMeshProgram();
+    void updateWarpMesh();
+    void updateGeometry();
     void renderCarTopView();
+    void renderCamerasOntoGroundPlane();
     void renderCameraOntoGroundPlane(const ActiveCamera& cam);
 
     sp<IEvsEnumerator>              mEnumerator;
     const ConfigManager&            mConfig;
     std::vector<ActiveCamera>       mActiveCameras;
+    FrameSynchronizer               mFrameSync;
+    std::vector<VideoTex*>          mFrameSyncTextures;     // Kept to save allocations
 
     struct {
-        std::unique_ptr<TexWrapper> checkerBoard;
-        std::unique_ptr<TexWrapper> carTopView;
+        std::shared_ptr<TexWrapper> checkerBoard;
+        std::shared_ptr<TexWrapper> carTopView;
     } mTexAssets;
 
     struct {
-        GLuint simpleTexture;
-        GLuint projectedTexture;
+        GLuint simpleTexture = 0;
+        GLuint projectedTexture = 0;
+        GLuint projectedTextureExternal = 0;    // Only built once a camera gives us YUV
+        GLuint composite = 0;                   // All our cameras at once, if we can
+        GLuint warpMesh = 0;                    // All our cameras through our warp mesh
     } mPgmAssets;
 
+    // The texture target for each camera our composite and warp mesh programs sample
+    std::vector<GLenum>             mCompositeTargets;
+
+    // Uniform locations in the programs above, looked up once they're built
+    struct {
+        GLint simpleCameraMat = -1;
+        GLint projectedCameraMat = -1;
+        GLint projectedProjectionMat = -1;
+        GLint externalCameraMat = -1;
+        GLint externalProjectionMat = -1;
+        GLint compositeCameraMat = -1;
+        std::vector<GLint> compositeProjectionMats;     // One per camera
+        GLint warpMeshCameraMat = -1;
+    } mUniforms;
+
+    // Our geometry lives on the GPU, and along with our matrices depends only on the config
+    // and the display's aspect ratio, so we only rebuild it if that changes
+    struct {
+        GLuint carVertexArray = 0;
+        GLuint carBuffer = 0;
+        GLuint groundVertexArray = 0;
+        GLuint groundBuffer = 0;
+        GLuint meshVertexArray = 0;
+        GLuint meshBuffer = 0;
+        GLuint meshIndexBuffer = 0;
+        GLsizei meshIndexCount = 0; // Zero if we have no warp mesh to draw
+        float  aspectRatio = 0.0f;  // What the geometry was built for, or zero if not yet
+    } mGeometry;
+
     android::mat4   orthoMatrix;
 };
 
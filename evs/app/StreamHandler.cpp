@@ -17,28 +17,58 @@
 #include "StreamHandler.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <chrono>
 
 #include <log/log.h>
 #include <cutils/native_handle.h>
 
 
+unsigned StreamHandler::sHoldBack = 1;
+
+
 StreamHandler::StreamHandler(android::sp <IEvsCamera> pCamera) :
-    mCamera(pCamera)
+    mCamera(pCamera),
+    mSlots(new std::atomic<Frame*>[sHoldBack]),
+    mSlotCount(sHoldBack),
+    mWriteIndex(0),
+    mFramesReceived(0),
+    mFramesRendered(0),
+    mFramesDropped(0)
 {
-    // We rely on the camera having at least two buffers available since we'll hold one and
-    // expect the camera to be able to capture a new image in the background.
-    pCamera->setMaxFramesInFlight(2);
+    for (unsigned i = 0; i < mSlotCount; i++) {
+        mSlots[i] = nullptr;
+    }
+
+    // At worst we have a full set of frames waiting in our slots, another set our client hasn't
+    // picked from yet, the one it holds, and the one it retired while the GPU finishes with it.
+    // We rely on the camera having a buffer for each of those, since we expect it to be able to
+    // capture a new image in the background.
+    pCamera->setMaxFramesInFlight(2 * mSlotCount + 2);
 }
 
 
 void StreamHandler::shutdown()
 {
+    // Nothing will be drawn from our frames anymore
+    releaseRetiredFrames();
+
     // Make sure we're not still streaming
     blockingStopStream();
 
     // At this point, the receiver thread is no longer running, so we can safely drop
     // our remote object references so they can be freed
+    for (unsigned i = 0; i < mSlotCount; i++) {
+        delete mSlots[i].exchange(nullptr);
+    }
+    mReadyFrames.clear();
+    if (mCamera != nullptr) {
+        Stats stats = getStats();
+        ALOGI("Stream ended after %llu frames received, %llu rendered, %llu dropped as stale",
+              (unsigned long long)stats.received, (unsigned long long)stats.rendered,
+              (unsigned long long)stats.dropped);
+    }
     mCamera = nullptr;
 }
 
@@ -86,80 +116,160 @@ bool StreamHandler::isRunning() {
 }
 
 
+StreamHandler::Stats StreamHandler::getStats() {
+    Stats stats;
+    stats.received = mFramesReceived;
+    stats.rendered = mFramesRendered;
+    stats.dropped  = mFramesDropped;
+    return stats;
+}
+
+
+// Moves any frames waiting in our slots into mReadyFrames, keeping only as many of the newest
+// as we hold back and returning the rest.  Only called on our client's thread.
+void StreamHandler::claimFrames() {
+    const uint64_t written = mWriteIndex.load(std::memory_order_acquire);
+    const uint64_t first = (written - mReadIndex > mSlotCount) ? written - mSlotCount
+                                                                : mReadIndex;
+    for (uint64_t i = first; i < written; i++) {
+        // The delivering thread may have lapped us and put a newer frame here, so we keep our
+        // list in arrival order as we go
+        std::unique_ptr<Frame> frame(mSlots[i % mSlotCount].exchange(nullptr,
+                                                                     std::memory_order_acq_rel));
+        if (frame) {
+            auto pos = mReadyFrames.end();
+            while (pos != mReadyFrames.begin() && (pos - 1)->timeNs > frame->timeNs) {
+                --pos;
+            }
+            mReadyFrames.insert(pos, std::move(*frame));
+        }
+    }
+    mReadIndex = written;
+
+    while (mReadyFrames.size() > mSlotCount) {
+        mCamera->doneWithFrame(mReadyFrames.front().buffer);
+        mReadyFrames.pop_front();
+        mFramesDropped++;
+    }
+}
+
+
 bool StreamHandler::newFrameAvailable() {
-    std::unique_lock<std::mutex> lock(mLock);
-    return (mReadyBuffer >= 0);
+    claimFrames();
+    return !mReadyFrames.empty();
 }
 
 
-const BufferDesc& StreamHandler::getNewFrame() {
-    std::unique_lock<std::mutex> lock(mLock);
+void StreamHandler::getNewFrameTimes(std::vector<int64_t>* pTimesNs) {
+    claimFrames();
+    pTimesNs->clear();
+    for (auto&& frame: mReadyFrames) {
+        pTimesNs->push_back(frame.timeNs);
+    }
+}
 
-    if (mHeldBuffer >= 0) {
+
+const BufferDesc& StreamHandler::getNewFrame(int64_t preferredTimeNs, int64_t* pTimeNs) {
+    claimFrames();
+
+    if (mHolding) {
         ALOGE("Ignored call for new frame while still holding the old one.");
+    } else if (mReadyFrames.empty()) {
+        ALOGE("Returning invalid buffer because we don't have any.  Call newFrameAvailable first?");
     } else {
-        if (mReadyBuffer < 0) {
-            ALOGE("Returning invalid buffer because we don't have any.  Call newFrameAvailable first?");
-            mReadyBuffer = 0;   // This is a lie!
+        // Find the frame we want, which is the newest unless we're asked for another
+        size_t chosen = mReadyFrames.size() - 1;
+        if (preferredTimeNs >= 0) {
+            for (size_t i = 0; i < mReadyFrames.size(); i++) {
+                if (llabs(mReadyFrames[i].timeNs - preferredTimeNs) <
+                    llabs(mReadyFrames[chosen].timeNs - preferredTimeNs)) {
+                    chosen = i;
+                }
+            }
         }
 
-        // Move the ready buffer into the held position, and clear the ready position
-        mHeldBuffer = mReadyBuffer;
-        mReadyBuffer = -1;
+        // Anything older than that won't be wanted anymore
+        for (size_t i = 0; i < chosen; i++) {
+            mCamera->doneWithFrame(mReadyFrames.front().buffer);
+            mReadyFrames.pop_front();
+            mFramesDropped++;
+        }
+
+        // Move the chosen frame into the held position
+        mHeldBuffer = mReadyFrames.front().buffer;
+        if (pTimeNs) {
+            *pTimeNs = mReadyFrames.front().timeNs;
+        }
+        mReadyFrames.pop_front();
+        mHolding = true;
+        mFramesRendered++;
     }
 
-    return mBuffers[mHeldBuffer];
+    return mHeldBuffer;
 }
 
 
 void StreamHandler::doneWithFrame(const BufferDesc& buffer) {
-    std::unique_lock<std::mutex> lock(mLock);
-
     // We better be getting back the buffer we original delivered!
-    if ((mHeldBuffer < 0) || (buffer.bufferId != mBuffers[mHeldBuffer].bufferId)) {
+    if (!mHolding || (buffer.bufferId != mHeldBuffer.bufferId)) {
         ALOGE("StreamHandler::doneWithFrame got an unexpected buffer!");
     }
 
     // Send the buffer back to the underlying camera
-    mCamera->doneWithFrame(mBuffers[mHeldBuffer]);
+    mCamera->doneWithFrame(mHeldBuffer);
 
     // Clear the held position
-    mHeldBuffer = -1;
+    mHolding = false;
+}
+
+
+void StreamHandler::retireFrame(const BufferDesc& buffer) {
+    // We better be getting back the buffer we original delivered!
+    if (!mHolding || (buffer.bufferId != mHeldBuffer.bufferId)) {
+        ALOGE("StreamHandler::retireFrame got an unexpected buffer!");
+    }
+
+    mRetiredBuffers.push_back(mHeldBuffer);
+    mHolding = false;
+}
+
+
+void StreamHandler::releaseRetiredFrames() {
+    for (auto&& buffer: mRetiredBuffers) {
+        mCamera->doneWithFrame(buffer);
+    }
+    mRetiredBuffers.clear();
 }
 
 
 Return<void> StreamHandler::deliverFrame(const BufferDesc& buffer) {
     ALOGD("Received a frame from the camera (%p)", buffer.memHandle.getNativeHandle());
 
-    // Take the lock to protect our frame slots and running state variable
-    {
-        std::unique_lock <std::mutex> lock(mLock);
+    // HAL 1.0 buffers don't carry their capture time, so we note when each one reaches us
+    const int64_t arrivalNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 
-        if (buffer.memHandle.getNativeHandle() == nullptr) {
-            // Signal that the last frame has been received and the stream is stopped
+    if (buffer.memHandle.getNativeHandle() == nullptr) {
+        // Signal that the last frame has been received and the stream is stopped
+        {
+            std::unique_lock <std::mutex> lock(mLock);
             mRunning = false;
-        } else {
-            // Do we already have a "ready" frame?
-            if (mReadyBuffer >= 0) {
-                // Send the previously saved buffer back to the camera unused
-                mCamera->doneWithFrame(mBuffers[mReadyBuffer]);
-
-                // We'll reuse the same ready buffer index
-            } else if (mHeldBuffer >= 0) {
-                // The client is holding a buffer, so use the other slot for "on deck"
-                mReadyBuffer = 1 - mHeldBuffer;
-            } else {
-                // This is our first buffer, so just pick a slot
-                mReadyBuffer = 0;
-            }
-
-            // Save this frame until our client is interested in it
-            mBuffers[mReadyBuffer] = buffer;
         }
+        mSignal.notify_all();
+        return Void();
     }
 
-    // Notify anybody who cares that things have changed
-    mSignal.notify_all();
+    // Save this frame until our client is interested in it.  If our client hasn't yet claimed
+    // the frame we're replacing, nobody will want it now, so send it back to the camera unused.
+    mFramesReceived++;
+    const uint64_t index = mWriteIndex.load(std::memory_order_relaxed);
+    std::unique_ptr<Frame> stale(mSlots[index % mSlotCount].exchange(new Frame{buffer, arrivalNs},
+                                                                     std::memory_order_acq_rel));
+    mWriteIndex.store(index + 1, std::memory_order_release);
+    if (stale) {
+        mCamera->doneWithFrame(stale->buffer);
+        mFramesDropped++;
+    }
 
     return Void();
 }
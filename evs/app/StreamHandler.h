@@ -17,7 +17,11 @@
 #ifndef EVS_VTS_STREAMHANDLER_H
 #define EVS_VTS_STREAMHANDLER_H
 
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <queue>
+#include <vector>
 
 #include "ui/GraphicBuffer.h"
 
@@ -36,12 +40,19 @@ using ::android::sp;
 /*
  * StreamHandler:
  * This class can be used to receive camera imagery from an IEvsCamera implementation.  It will
- * hold onto the most recent image buffer, returning older ones.
+ * hold onto the most recent image buffers, up to its hold back depth, returning older ones.
+ * Each frame is stamped with the time it arrived so frames from several cameras can be matched.
  * Note that the video frames are delivered on a background thread, while the control interface
- * is actuated from the applications foreground thread.
+ * is actuated from the applications foreground thread.  Frames pass between the two without
+ * locking: the delivering thread drops each one into a small ring of slots, and the client's
+ * thread claims them from there, so neither ever waits on the other.  The frame accessors must
+ * all be called from the same client thread.
  */
 class StreamHandler : public IEvsCameraStream {
 public:
+    // Set once at start up; applies to streams created after
+    static void setHoldBack(unsigned frames)    { sHoldBack = frames; };
+
     virtual ~StreamHandler() { shutdown(); };
 
     StreamHandler(android::sp <IEvsCamera> pCamera);
@@ -53,10 +64,30 @@ public:
 
     bool isRunning();
 
+    // Counts of frames delivered by the camera, handed to our client, and returned unused
+    // because newer ones replaced them
+    struct Stats {
+        uint64_t    received;
+        uint64_t    rendered;
+        uint64_t    dropped;
+    };
+    Stats getStats();
+
     bool newFrameAvailable();
-    const BufferDesc& getNewFrame();
+
+    // Arrival times on the steady clock of the frames we could hand out, oldest first
+    void getNewFrameTimes(std::vector<int64_t>* pTimesNs);
+
+    // Hands out the waiting frame arriving closest to the given time, or the newest if none is
+    // given, and returns any older ones to the camera
+    const BufferDesc& getNewFrame(int64_t preferredTimeNs = -1, int64_t* pTimeNs = nullptr);
     void doneWithFrame(const BufferDesc& buffer);
 
+    // Like doneWithFrame, but keeps the buffer from the camera until releaseRetiredFrames,
+    // since the GPU may still be reading it while our client moves on to the next frame
+    void retireFrame(const BufferDesc& buffer);
+    void releaseRetiredFrames();
+
 private:
     // Implementation for ::android::hardware::automotive::evs::V1_0::ICarCameraStream
     Return<void> deliverFrame(const BufferDesc& buffer)  override;
@@ -64,17 +95,38 @@ private:
     // Values initialized as startup
     android::sp <IEvsCamera>    mCamera;
 
-    // Since we get frames delivered to us asnchronously via the ICarCameraStream interface,
-    // we need to protect all member variables that may be modified while we're streaming
-    // (ie: those below)
+    // Only our running state needs the lock; frames go through the slots below instead
     std::mutex                  mLock;
     std::condition_variable     mSignal;
 
     bool                        mRunning = false;
 
-    BufferDesc                  mBuffers[2];
-    int                         mHeldBuffer = -1;   // Index of the one currently held by the client
-    int                         mReadyBuffer = -1;  // Index of the newest available buffer
+    struct Frame {
+        BufferDesc  buffer;
+        int64_t     timeNs;
+    };
+
+    // Written round robin by the delivering thread, which returns whatever frame it finds still
+    // in a slot as stale.  The client's thread empties them into mReadyFrames.  Exchanging the
+    // slots' contents means exactly one thread ends up with each frame.
+    std::unique_ptr<std::atomic<Frame*>[]>
+                                mSlots;
+    unsigned                    mSlotCount;
+    std::atomic<uint64_t>       mWriteIndex;        // Slots filled so far
+    uint64_t                    mReadIndex = 0;     // Slots the client has looked at so far
+
+    // Owned by the client's thread
+    void claimFrames();
+    BufferDesc                  mHeldBuffer;        // The one currently held by the client
+    bool                        mHolding = false;
+    std::vector<BufferDesc>     mRetiredBuffers;    // Done with, but maybe not by the GPU yet
+    std::deque<Frame>           mReadyFrames;       // Newest at the back
+
+    std::atomic<uint64_t>       mFramesReceived;
+    std::atomic<uint64_t>       mFramesRendered;
+    std::atomic<uint64_t>       mFramesDropped;
+
+    static unsigned             sHoldBack;
 };
 
 
@@ -21,6 +21,13 @@
 #include <fcntl.h>
 #include <malloc.h>
 #include <png.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <GLES3/gl3.h>
+
+#include "TextureFile.h"
 
 
 /* Create an new empty GL texture that will be filled later */
@@ -196,3 +203,74 @@ TexWrapper* createTextureFromPng(const char * filename)
     // Return the texture
     return new TexWrapper(textureId, width, height);
 }
+
+
+/* Factory to build TexWrapper objects from a pre-baked texture file */
+TexWrapper* createTextureFromBakedFile(const char* filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    // Map the whole file so GL reads the image directly out of it
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(TextureFileHeader)) {
+        ALOGE("%s is too small to be a texture file", filename);
+        close(fd);
+        return nullptr;
+    }
+    const size_t fileSize = info.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        ALOGE("Failed to map %s", filename);
+        return nullptr;
+    }
+
+    const TextureFileHeader* header = static_cast<const TextureFileHeader*>(mapping);
+    const uint8_t* data = static_cast<const uint8_t*>(mapping) + header->dataOffset;
+    if (header->magic != kTextureFileMagic || header->version != kTextureFileVersion ||
+        header->dataOffset > fileSize || header->dataSize > fileSize - header->dataOffset ||
+        (header->format == kTextureFormatRGBA8 &&
+         header->dataSize < (uint64_t)header->width * header->height * 4) ||
+        (header->format == kTextureFormatETC2RGB8 &&
+         header->dataSize < etcDataSize(header->width, header->height))) {
+        ALOGE("%s is not a texture file we understand", filename);
+        munmap(mapping, fileSize);
+        return nullptr;
+    }
+
+    // Set up the OpenGL texture to contain this image
+    GLuint textureId;
+    glGenTextures(1, &textureId);
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    glGetError();   // Clear any earlier error so we can tell if the image was accepted
+
+    if (header->format == kTextureFormatRGBA8) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, header->width, header->height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, data);
+    } else {
+        glCompressedTexImage2D(GL_TEXTURE_2D, 0, header->format, header->width, header->height,
+                               0, header->dataSize, data);
+    }
+    const GLenum error = glGetError();
+
+    // The same sampling setup as our PNG textures
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    const unsigned width = header->width;
+    const unsigned height = header->height;
+    const unsigned format = header->format;
+    munmap(mapping, fileSize);
+
+    if (error != GL_NO_ERROR) {
+        ALOGE("GL couldn't take the format 0x%X image in %s (0x%X)", format, filename, error);
+        glDeleteTextures(1, &textureId);
+        return nullptr;
+    }
+
+    return new TexWrapper(textureId, width, height);
+}
@@ -39,4 +39,8 @@ protected:
 
 TexWrapper* createTextureFromPng(const char* filename);
 
+// Maps a pre-baked texture file, laid out as described in TextureFile.h, and hands its image
+// straight to GL.  Returns null if the file is missing or unusable.
+TexWrapper* createTextureFromBakedFile(const char* filename);
+
 #endif // TEXWRAPPER_H
\ No newline at end of file
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAR_EVS_APP_TEXTUREFILE_H
+#define CAR_EVS_APP_TEXTUREFILE_H
+
+#include <stdint.h>
+
+
+// The layout of our pre-baked texture files, which hold an image ready to hand straight to GL
+// so the app can map it rather than decode a PNG.  The build makes them from our PNGs with
+// evs_bake_texture.  Shared with that host tool, so this mustn't depend on GL headers.
+static const uint32_t kTextureFileMagic   = 0x54535645;     // "EVST"
+static const uint32_t kTextureFileVersion = 1;
+
+// The GL internal format of the image data.  We bake uncompressed RGBA, or for large opaque
+// images, ETC1 blocks labelled as ETC2, which GLES 3 always takes and which reads ETC1 data
+// unchanged.  Any other compressed format the GPU takes, such as ASTC, may be stored instead.
+static const uint32_t kTextureFormatRGBA8     = 0x8058;     // GL_RGBA8
+static const uint32_t kTextureFormatETC2RGB8  = 0x9274;     // GL_COMPRESSED_RGB8_ETC2
+
+// ETC blocks hold 4x4 pixels in 8 bytes, padded out at the right and bottom edges
+static inline uint32_t etcDataSize(uint32_t width, uint32_t height) {
+    return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+struct TextureFileHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    format;         // GL internal format
+    uint32_t    dataOffset;     // From the start of the file, 16 byte aligned
+    uint32_t    dataSize;
+    uint32_t    reserved;
+};
+
+#endif // CAR_EVS_APP_TEXTUREFILE_H
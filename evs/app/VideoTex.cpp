@@ -24,6 +24,7 @@
 
 #include "VideoTex.h"
 #include "glError.h"
+#include "ExtendedInfo.h"
 
 #include <ui/GraphicBuffer.h>
 
@@ -36,12 +37,15 @@ using ::android::GraphicBuffer;
 VideoTex::VideoTex(sp<IEvsEnumerator> pEnum,
                    sp<IEvsCamera> pCamera,
                    sp<StreamHandler> pStreamHandler,
-                   EGLDisplay glDisplay)
+                   EGLDisplay glDisplay,
+                   GLenum target)
     : TexWrapper()
     , mEnumerator(pEnum)
     , mCamera(pCamera)
     , mStreamHandler(pStreamHandler)
-    , mDisplay(glDisplay) {
+    , mDisplay(glDisplay)
+    , mTarget(target)
+    , mEmptyTexture(id) {
     // Nothing but initialization here...
 }
 
@@ -52,84 +56,134 @@ VideoTex::~VideoTex() {
     // Close the camera
     mEnumerator->closeCamera(mCamera);
 
-    // Drop our device texture image
-    if (mKHRimage != EGL_NO_IMAGE_KHR) {
-        eglDestroyImageKHR(mDisplay, mKHRimage);
-        mKHRimage = EGL_NO_IMAGE_KHR;
+    // Drop our device texture images, leaving our own texture for TexWrapper to delete
+    dropCachedBuffers();
+}
+
+
+VideoTex::CachedBuffer* VideoTex::cacheBuffer(const BufferDesc& buffer) {
+    // create a GraphicBuffer from the existing handle
+    CachedBuffer cached;
+    cached.graphicBuffer = new GraphicBuffer(buffer.memHandle,
+                                             GraphicBuffer::CLONE_HANDLE,
+                                             buffer.width, buffer.height,
+                                             buffer.format, 1, // layer count
+                                             GRALLOC_USAGE_HW_TEXTURE,
+                                             buffer.stride);
+    if (cached.graphicBuffer.get() == nullptr) {
+        ALOGE("Failed to allocate GraphicBuffer to wrap image handle");
+        return nullptr;
+    }
+
+    // Get a GL compatible reference to the graphics buffer we've been given
+    EGLint eglImageAttributes[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
+    EGLClientBuffer clientBuf =
+            static_cast<EGLClientBuffer>(cached.graphicBuffer->getNativeBuffer());
+    cached.image = eglCreateImageKHR(mDisplay, EGL_NO_CONTEXT,
+                                     EGL_NATIVE_BUFFER_ANDROID, clientBuf,
+                                     eglImageAttributes);
+    if (cached.image == EGL_NO_IMAGE_KHR) {
+        const char *msg = getEGLError();
+        ALOGE("error creating EGLImage: %s", msg);
+        return nullptr;
+    }
+
+    // Give the buffer a texture of its own to refer to it
+    glGenTextures(1, &cached.texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(mTarget, cached.texture);
+    glEGLImageTargetTexture2DOES(mTarget, static_cast<GLeglImageOES>(cached.image));
+
+    // Initialize the sampling properties (it seems the sample may not work if this isn't done)
+    // The user of this texture may very well want to set their own filtering, but we're going
+    // to pay the (minor) price of setting this up for them to avoid the dreaded "black image"
+    // if they forget.
+    glTexParameteri(mTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(mTarget, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(mTarget, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(mTarget, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    ALOGD("Wrapped camera buffer %u as texture %u", buffer.bufferId, cached.texture);
+    CachedBuffer& entry = mCachedBuffers[buffer.bufferId];
+    entry = cached;
+    return &entry;
+}
+
+
+void VideoTex::dropCachedBuffer(CachedBuffer& cached) {
+    glDeleteTextures(1, &cached.texture);
+    eglDestroyImageKHR(mDisplay, cached.image);
+}
+
+
+void VideoTex::dropCachedBuffers() {
+    for (auto&& entry: mCachedBuffers) {
+        dropCachedBuffer(entry.second);
+    }
+    mCachedBuffers.clear();
+    id = mEmptyTexture;
+}
+
+
+void VideoTex::evictCachedBuffers() {
+    // A camera hands its buffers out in turn, so a live one comes back within a pool's worth of
+    // frames.  We don't know the pool's size, but it can't be more than we have cached, and we
+    // give it twice that to allow for buffers held up by the other clients.
+    const uint64_t maxAge = 2 * mCachedBuffers.size();
+    for (auto it = mCachedBuffers.begin(); it != mCachedBuffers.end();) {
+        if (mFrameCount - it->second.lastFrame > maxAge) {
+            ALOGD("Dropping texture %u for camera buffer %u, which hasn't come back",
+                  it->second.texture, it->first);
+            dropCachedBuffer(it->second);
+            it = mCachedBuffers.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
 
 // Return true if the texture contents are changed
-bool VideoTex::refresh() {
+bool VideoTex::refresh(int64_t preferredTimeNs) {
     if (!mStreamHandler->newFrameAvailable()) {
         // No new image has been delivered, so there's nothing to do here
         return false;
     }
 
-    // If we already have an image backing us, then it's time to return it
+    // If we already have an image backing us, then it's time to give it up, though the GPU may
+    // still be drawing from it
     if (mImageBuffer.memHandle.getNativeHandle() != nullptr) {
-        // Drop our device texture image
-        if (mKHRimage != EGL_NO_IMAGE_KHR) {
-            eglDestroyImageKHR(mDisplay, mKHRimage);
-            mKHRimage = EGL_NO_IMAGE_KHR;
-        }
-
-        // Return it since we're done with it
-        mStreamHandler->doneWithFrame(mImageBuffer);
+        mStreamHandler->retireFrame(mImageBuffer);
     }
 
     // Get the new image we want to use as our contents
-    mImageBuffer = mStreamHandler->getNewFrame();
-
-
-    // create a GraphicBuffer from the existing handle
-    sp<GraphicBuffer> pGfxBuffer = new GraphicBuffer(mImageBuffer.memHandle,
-                                                     GraphicBuffer::CLONE_HANDLE,
-                                                     mImageBuffer.width, mImageBuffer.height,
-                                                     mImageBuffer.format, 1, // layer count
-                                                     GRALLOC_USAGE_HW_TEXTURE,
-                                                     mImageBuffer.stride);
-    if (pGfxBuffer.get() == nullptr) {
-        ALOGE("Failed to allocate GraphicBuffer to wrap image handle");
+    mImageBuffer = mStreamHandler->getNewFrame(preferredTimeNs, &mImageTimeNs);
+
+    // Switch to the texture we made for this buffer the last time we saw it
+    mFrameCount++;
+    auto it = mCachedBuffers.find(mImageBuffer.bufferId);
+    CachedBuffer* pCached = (it != mCachedBuffers.end()) ? &it->second
+                                                         : cacheBuffer(mImageBuffer);
+    if (pCached == nullptr) {
         // Returning "true" in this error condition because we already released the
         // previous image (if any) and so the texture may change in unpredictable ways now!
+        id = mEmptyTexture;
         return true;
     }
 
-    // Get a GL compatible reference to the graphics buffer we've been given
-    EGLint eglImageAttributes[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
-    EGLClientBuffer clientBuf = static_cast<EGLClientBuffer>(pGfxBuffer->getNativeBuffer());
-    mKHRimage = eglCreateImageKHR(mDisplay, EGL_NO_CONTEXT,
-                                  EGL_NATIVE_BUFFER_ANDROID, clientBuf,
-                                  eglImageAttributes);
-    if (mKHRimage == EGL_NO_IMAGE_KHR) {
-        const char *msg = getEGLError();
-        ALOGE("error creating EGLImage: %s", msg);
-    } else {
-        // Update the texture handle we already created to refer to this gralloc buffer
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, glId());
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, static_cast<GLeglImageOES>(mKHRimage));
-
-        // Initialize the sampling properties (it seems the sample may not work if this isn't done)
-        // The user of this texture may very well want to set their own filtering, but we're going
-        // to pay the (minor) price of setting this up for them to avoid the dreaded "black image"
-        // if they forget.
-        // TODO:  Can we do this once for the texture ID rather than ever refresh?
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    }
+    id = pCached->texture;
+    pCached->lastFrame = mFrameCount;
 
+    // Let go of the buffers the camera has freed
+    evictCachedBuffers();
     return true;
 }
 
 
 VideoTex* createVideoTexture(sp<IEvsEnumerator> pEnum,
                              const char* evsCameraId,
-                             EGLDisplay glDisplay) {
+                             EGLDisplay glDisplay,
+                             uint32_t outputFormat) {
     // Set up the camera to feed this texture
     sp<IEvsCamera> pCamera = pEnum->openCamera(evsCameraId);
     if (pCamera.get() == nullptr) {
@@ -137,6 +191,18 @@ VideoTex* createVideoTexture(sp<IEvsEnumerator> pEnum,
         return nullptr;
     }
 
+    // Ask for frames in the format we want before the stream gets its buffers.  YUV buffers are
+    // sampled through an external texture, which converts to RGB as the shader reads it.
+    GLenum target = GL_TEXTURE_2D;
+    if (outputFormat != 0) {
+        Return<EvsResult> result = pCamera->setExtendedInfo(kExtInfoOutputFormat, outputFormat);
+        if (!result.isOk() || result != EvsResult::OK) {
+            ALOGW("%s can't provide format 0x%X, using its default", evsCameraId, outputFormat);
+        } else if (outputFormat != HAL_PIXEL_FORMAT_RGBA_8888) {
+            target = GL_TEXTURE_EXTERNAL_OES;
+        }
+    }
+
     // Initialize the stream that will help us update this texture's contents
     sp<StreamHandler> pStreamHandler = new StreamHandler(pCamera);
     if (pStreamHandler.get() == nullptr) {
@@ -151,5 +217,5 @@ VideoTex* createVideoTexture(sp<IEvsEnumerator> pEnum,
         return nullptr;
     }
 
-    return new VideoTex(pEnum, pCamera, pStreamHandler, glDisplay);
+    return new VideoTex(pEnum, pCamera, pStreamHandler, glDisplay, target);
 }
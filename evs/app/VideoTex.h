@@ -23,6 +23,8 @@
 #include <GLES3/gl3.h>
 #include <GLES3/gl3ext.h>
 
+#include <unordered_map>
+
 #include <android/hardware/automotive/evs/1.0/IEvsEnumerator.h>
 
 #include "TexWrapper.h"
@@ -35,32 +37,75 @@ using namespace ::android::hardware::automotive::evs::V1_0;
 class VideoTex: public TexWrapper {
     friend VideoTex* createVideoTexture(sp<IEvsEnumerator> pEnum,
                                         const char * evsCameraId,
-                                        EGLDisplay glDisplay);
+                                        EGLDisplay glDisplay,
+                                        uint32_t outputFormat);
 
 public:
     VideoTex() = delete;
     virtual ~VideoTex();
 
-    bool refresh();     // returns true if the texture contents were updated
+    // Moves to the newest frame, or the one that arrived nearest the given time.  Returns true
+    // if the texture contents were updated.  The frame we move away from isn't returned to the
+    // camera until releaseRetiredFrames, called once the GPU is done drawing from it.
+    bool refresh(int64_t preferredTimeNs = -1);
+    void releaseRetiredFrames()     { mStreamHandler->releaseRetiredFrames(); };
+    bool hasImage()     { return mImageBuffer.memHandle.getNativeHandle() != nullptr; };
+
+    // True while the camera is still sending us frames.  A stream that ended won't start again.
+    bool isStreaming()  { return mStreamHandler->isRunning(); };
+
+    // When the frame we're showing arrived, and when those we could move to did, on the steady
+    // clock.  These let several textures pick frames that line up in time.
+    int64_t imageTimeNs()   { return mImageTimeNs; };
+    bool hasImageSince(int64_t timeNs)  { return hasImage() && mImageTimeNs >= timeNs; };
+    void getNewFrameTimes(std::vector<int64_t>* pTimesNs) {
+        mStreamHandler->getNewFrameTimes(pTimesNs);
+    };
+
+    // GL_TEXTURE_EXTERNAL_OES when we're sampling YUV camera buffers directly, which needs a
+    // samplerExternalOES in the shader, otherwise GL_TEXTURE_2D
+    GLenum glTarget()   { return mTarget; };
 
 private:
     VideoTex(sp<IEvsEnumerator> pEnum,
              sp<IEvsCamera> pCamera,
              sp<StreamHandler> pStreamHandler,
-             EGLDisplay glDisplay);
+             EGLDisplay glDisplay,
+             GLenum target);
+
+    // The camera cycles through a small set of buffers, so we wrap each one in its own texture
+    // the first time we see it and just switch textures after that.  Cameras give each buffer
+    // they allocate a bufferId of its own, so one we haven't seen in a while has been freed.
+    struct CachedBuffer {
+        sp<android::GraphicBuffer>  graphicBuffer;
+        EGLImageKHR                 image = EGL_NO_IMAGE_KHR;
+        GLuint                      texture = 0;
+        uint64_t                    lastFrame = 0;  // When we last showed it
+    };
+    CachedBuffer* cacheBuffer(const BufferDesc& buffer);
+    void dropCachedBuffer(CachedBuffer& cached);
+    void dropCachedBuffers();
+    void evictCachedBuffers();
 
     sp<IEvsEnumerator>  mEnumerator;
     sp<IEvsCamera>      mCamera;
     sp<StreamHandler>   mStreamHandler;
     BufferDesc          mImageBuffer;
+    int64_t             mImageTimeNs = -1;
 
     EGLDisplay          mDisplay;
-    EGLImageKHR mKHRimage = EGL_NO_IMAGE_KHR;
+    GLenum              mTarget;
+    GLuint              mEmptyTexture;      // Our own texture, shown if a buffer can't be wrapped
+
+    std::unordered_map<uint32_t, CachedBuffer>  mCachedBuffers;     // Keyed by bufferId
+    uint64_t            mFrameCount = 0;    // Frames we've shown
 };
 
 
+// A non-zero output format asks the camera for frames in that Android pixel format
 VideoTex* createVideoTexture(sp<IEvsEnumerator> pEnum,
                              const char * deviceName,
-                             EGLDisplay glDisplay);
+                             EGLDisplay glDisplay,
+                             uint32_t outputFormat = 0);
 
 #endif // VIDEOTEX_H
\ No newline at end of file
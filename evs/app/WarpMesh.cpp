@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "WarpMesh.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+
+#include <log/log.h>
+#include <math/vec3.h>
+#include <math/vec4.h>
+
+
+// Simple aliases to make geometric math using vectors more readable
+static const unsigned X = 0;
+static const unsigned Y = 1;
+static const unsigned Z = 2;
+
+// Cells along each side of our grid.  Plenty to follow even strong lens distortion, while the
+// vertex count stays within reach of 16 bit indices.
+static const unsigned kGridCells = 64;
+
+// Identifies our cache files, and changes whenever their layout or our math does
+static const uint32_t kFileMagic   = 0x4D575645;    // "EVWM"
+static const uint32_t kFileVersion = 1;
+
+// How far in from its image edges a camera's weight ramps up to full, in texture units
+static const float kEdgeFeather = 0.05f;
+
+
+struct FileHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    key;
+    uint32_t    cameraCount;
+    uint32_t    vertexCount;
+};
+
+
+// Since we assume no roll in these views, we can simplify the required math
+static android::vec3 unitVectorFromPitchAndYaw(float pitch, float yaw) {
+    float sinPitch, cosPitch;
+    sincosf(pitch, &sinPitch, &cosPitch);
+    float sinYaw, cosYaw;
+    sincosf(yaw, &sinYaw, &cosYaw);
+    return android::vec3(cosPitch * -sinYaw,
+                         cosPitch * cosYaw,
+                         sinPitch);
+}
+
+
+// Helper function to set up a view matrix for a camera given it's yaw & pitch & location
+// Yes, with a bit of work, we could use lookAt, but it does a lot of extra work
+// internally that we can short cut.
+android::mat4 cameraLookMatrix(const ConfigManager::CameraInfo& cam) {
+    float sinYaw, cosYaw;
+    sincosf(cam.yaw, &sinYaw, &cosYaw);
+
+    // Construct principal unit vectors
+    android::vec3 vAt = unitVectorFromPitchAndYaw(cam.pitch, cam.yaw);
+    android::vec3 vRt = android::vec3(cosYaw, sinYaw, 0.0f);
+    android::vec3 vUp = -cross(vAt, vRt);
+    android::vec3 eye = android::vec3(cam.position[X], cam.position[Y], cam.position[Z]);
+
+    android::mat4 Result(1.0f);
+    Result[0][0] = vRt.x;
+    Result[1][0] = vRt.y;
+    Result[2][0] = vRt.z;
+    Result[0][1] = vUp.x;
+    Result[1][1] = vUp.y;
+    Result[2][1] = vUp.z;
+    Result[0][2] =-vAt.x;
+    Result[1][2] =-vAt.y;
+    Result[2][2] =-vAt.z;
+    Result[3][0] =-dot(vRt, eye);
+    Result[3][1] =-dot(vUp, eye);
+    Result[3][2] = dot(vAt, eye);
+    return Result;
+}
+
+
+
+// Hashes everything the mesh depends on, so we can tell if a saved mesh is still good
+static uint64_t computeKey(const ConfigManager& config,
+                           const std::vector<const ConfigManager::CameraInfo*>& cameras,
+                           float aspectRatio) {
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a
+    auto mix = [&hash](const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
+
+    const float display[] = {
+        config.getDisplayTopLocation(),
+        config.getDisplayBottomLocation(),
+        aspectRatio,
+    };
+    mix(&kFileVersion, sizeof(kFileVersion));
+    mix(&kGridCells, sizeof(kGridCells));
+    mix(display, sizeof(display));
+    for (auto&& cam: cameras) {
+        mix(cam->cameraId.c_str(), cam->cameraId.size() + 1);
+        mix(cam->position, sizeof(cam->position));
+        mix(&cam->yaw, sizeof(cam->yaw));
+        mix(&cam->pitch, sizeof(cam->pitch));
+        mix(&cam->hfov, sizeof(cam->hfov));
+        mix(&cam->vfov, sizeof(cam->vfov));
+        mix(cam->fisheye, sizeof(cam->fisheye));
+    }
+    return hash;
+}
+
+
+// The angle off the optical axis at which a fisheye lens images a ray arriving at theta
+static float fisheyeAngle(const float k[4], float theta) {
+    const float t2 = theta * theta;
+    return theta * (1.0f + t2 * (k[0] + t2 * (k[1] + t2 * (k[2] + t2 * k[3]))));
+}
+
+
+// Works out where a point in car space appears in a camera's image, in texture coordinates
+// with V=0 at the top of the image.  Returns false if the camera can't see the point.
+static bool projectToImage(const ConfigManager::CameraInfo& cam,
+                           const android::mat4& view,
+                           const android::vec4& point,
+                           float* pU, float* pV) {
+    const android::vec4 eye = view * point;
+    const float depth = -eye.z;     // Eye space looks down -Z
+
+    float nx;
+    float ny;
+    const bool isFisheye = cam.fisheye[0] != 0.0f || cam.fisheye[1] != 0.0f ||
+                           cam.fisheye[2] != 0.0f || cam.fisheye[3] != 0.0f;
+    if (isFisheye) {
+        // The distance from the image center grows with the distorted angle off the optical
+        // axis, scaled so the edges of the image are at the configured fields of view
+        const float r = sqrtf(eye.x * eye.x + eye.y * eye.y);
+        const float theta = atan2f(r, depth);
+        if (r <= 0.0f) {
+            nx = ny = 0.0f;
+            if (depth <= 0.0f) {
+                return false;
+            }
+        } else {
+            const float thetaD = fisheyeAngle(cam.fisheye, theta);
+            nx = (eye.x / r) * thetaD / fisheyeAngle(cam.fisheye, cam.hfov * 0.5f);
+            ny = (eye.y / r) * thetaD / fisheyeAngle(cam.fisheye, cam.vfov * 0.5f);
+        }
+    } else {
+        // A rectilinear lens, matching the projection the renderer uses without a mesh
+        if (depth <= 0.0f) {
+            return false;
+        }
+        nx = (eye.x / depth) / tanf(cam.hfov * 0.5f);
+        ny = (eye.y / depth) / tanf(cam.vfov * 0.5f);
+    }
+
+    // Flip the image and scale from -1/1 to 0/1 texture space
+    *pU = (nx + 1.0f) * 0.5f;
+    *pV = (1.0f - ny) * 0.5f;
+    return (*pU >= 0.0f && *pU <= 1.0f && *pV >= 0.0f && *pV <= 1.0f);
+}
+
+
+static uint16_t toUnorm16(float value) {
+    if (value <= 0.0f) {
+        return 0;
+    }
+    if (value >= 1.0f) {
+        return 65535;
+    }
+    return static_cast<uint16_t>(value * 65535.0f + 0.5f);
+}
+
+
+bool WarpMesh::initialize(const ConfigManager& config,
+                          const std::vector<const ConfigManager::CameraInfo*>& cameras,
+                          float aspectRatio,
+                          const char* cachePath) {
+    if (cameras.size() > kMaxCameras) {
+        ALOGE("Warp mesh supports at most %u cameras, not %zu", kMaxCameras, cameras.size());
+        return false;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    mKey = computeKey(config, cameras, aspectRatio);
+    mCameraCount = cameras.size();
+    bool loaded = (cachePath != nullptr && cachePath[0] != '\0' && load(cachePath));
+    if (!loaded) {
+        build(config, cameras, aspectRatio);
+        if (cachePath != nullptr && cachePath[0] != '\0') {
+            save(cachePath);
+        }
+    }
+    buildIndices();
+
+    ALOGI("Warp mesh for %u cameras %s in %.1f ms", mCameraCount, loaded ? "loaded" : "built",
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                  .count());
+    return true;
+}
+
+
+void WarpMesh::build(const ConfigManager& config,
+                     const std::vector<const ConfigManager::CameraInfo*>& cameras,
+                     float aspectRatio) {
+    // We cover the ground plane shown in the window
+    const float top    = config.getDisplayTopLocation();
+    const float bottom = config.getDisplayBottomLocation();
+    const float right  = config.getDisplayRightLocation(aspectRatio);
+    const float left   = config.getDisplayLeftLocation(aspectRatio);
+
+    std::vector<android::mat4> views;
+    for (auto&& cam: cameras) {
+        views.push_back(cameraLookMatrix(*cam));
+    }
+
+    mVertices.resize((kGridCells + 1) * (kGridCells + 1));
+    Vertex* pVertex = mVertices.data();
+    for (unsigned row = 0; row <= kGridCells; row++) {
+        const float y = top + (bottom - top) * row / kGridCells;
+        for (unsigned col = 0; col <= kGridCells; col++) {
+            const float x = left + (right - left) * col / kGridCells;
+            memset(pVertex, 0, sizeof(*pVertex));
+            pVertex->x = x;
+            pVertex->y = y;
+
+            const android::vec4 point(x, y, 0.0f, 1.0f);
+            for (unsigned i = 0; i < cameras.size(); i++) {
+                float u = 0.0f;
+                float v = 0.0f;
+                float weight = 0.0f;
+                if (projectToImage(*cameras[i], views[i], point, &u, &v)) {
+                    // Fade out toward the image edges so overlapping cameras blend smoothly
+                    const float edge = fminf(fminf(u, 1.0f - u), fminf(v, 1.0f - v));
+                    weight = fminf(edge / kEdgeFeather, 1.0f);
+                }
+                pVertex->camera[i][0] = toUnorm16(u);
+                pVertex->camera[i][1] = toUnorm16(v);
+                pVertex->camera[i][2] = toUnorm16(weight);
+            }
+            pVertex++;
+        }
+    }
+}
+
+
+void WarpMesh::buildIndices() {
+    // Two triangles per grid cell
+    mIndices.clear();
+    mIndices.reserve(kGridCells * kGridCells * 6);
+    const unsigned stride = kGridCells + 1;
+    for (unsigned row = 0; row < kGridCells; row++) {
+        for (unsigned col = 0; col < kGridCells; col++) {
+            const uint16_t topLeft = row * stride + col;
+            const uint16_t botLeft = topLeft + stride;
+            mIndices.push_back(topLeft);
+            mIndices.push_back(botLeft);
+            mIndices.push_back(topLeft + 1);
+            mIndices.push_back(topLeft + 1);
+            mIndices.push_back(botLeft);
+            mIndices.push_back(botLeft + 1);
+        }
+    }
+}
+
+
+bool WarpMesh::load(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    FileHeader header = {};
+    bool ok = (fread(&header, sizeof(header), 1, fp) == 1) &&
+              header.magic == kFileMagic &&
+              header.version == kFileVersion &&
+              header.key == mKey &&
+              header.cameraCount == mCameraCount &&
+              header.vertexCount == (kGridCells + 1) * (kGridCells + 1);
+    if (ok) {
+        mVertices.resize(header.vertexCount);
+        ok = (fread(mVertices.data(), sizeof(Vertex), mVertices.size(), fp) == mVertices.size());
+    }
+    fclose(fp);
+
+    if (!ok) {
+        ALOGI("Saved warp mesh in %s is out of date", path);
+        mVertices.clear();
+    }
+    return ok;
+}
+
+
+bool WarpMesh::save(const char* path) const {
+    // Write to a temporary file first so a reader never sees a partial mesh
+    std::string tempPath = std::string(path) + ".tmp";
+    FILE* fp = fopen(tempPath.c_str(), "wb");
+    if (fp == nullptr) {
+        ALOGW("Can't save warp mesh to %s (%s)", path, strerror(errno));
+        return false;
+    }
+
+    FileHeader header = {};
+    header.magic       = kFileMagic;
+    header.version     = kFileVersion;
+    header.key         = mKey;
+    header.cameraCount = mCameraCount;
+    header.vertexCount = mVertices.size();
+    bool ok = (fwrite(&header, sizeof(header), 1, fp) == 1) &&
+              (fwrite(mVertices.data(), sizeof(Vertex), mVertices.size(), fp) ==
+               mVertices.size());
+    ok &= (fclose(fp) == 0);
+
+    if (!ok || rename(tempPath.c_str(), path) != 0) {
+        ALOGW("Failed to save warp mesh to %s (%s)", path, strerror(errno));
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAR_EVS_APP_WARPMESH_H
+#define CAR_EVS_APP_WARPMESH_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <math/mat4.h>
+
+#include "ConfigManager.h"
+
+
+// The view transform for a camera, from car space to the camera's eye space
+android::mat4 cameraLookMatrix(const ConfigManager::CameraInfo& cam);
+
+
+/*
+ * A grid over the ground plane shown by the top view, recording where each vertex lands in
+ * every camera's image and how much that camera should contribute there.  Working this out
+ * per vertex rather than per pixel leaves the renderer only texture lookups to do, and lets
+ * us model lens distortion the GPU's projection can't express, such as a fisheye's.
+ *
+ * Building the mesh takes a moment, so it may be saved to a file and loaded on later runs
+ * for as long as the calibration it was built from stays the same.
+ */
+class WarpMesh {
+public:
+    // Each camera's image coordinates and weight, normalized to 0-65535, and a pad
+    static const unsigned kCameraComponents = 4;
+    static const unsigned kMaxCameras = 8;
+
+    struct Vertex {
+        float       x;              // Car space ground position
+        float       y;
+        uint16_t    camera[kMaxCameras][kCameraComponents];
+    };
+
+    // Uses the file, if given, when it was built for the same calibration, and otherwise
+    // builds the mesh and tries to save it there for next time
+    bool initialize(const ConfigManager& config,
+                    const std::vector<const ConfigManager::CameraInfo*>& cameras,
+                    float aspectRatio,
+                    const char* cachePath);
+
+    unsigned cameraCount() const                    { return mCameraCount; };
+    const std::vector<Vertex>& vertices() const     { return mVertices; };
+    const std::vector<uint16_t>& indices() const    { return mIndices; };
+
+private:
+    void build(const ConfigManager& config,
+               const std::vector<const ConfigManager::CameraInfo*>& cameras,
+               float aspectRatio);
+    bool load(const char* path);
+    bool save(const char* path) const;
+    void buildIndices();
+
+    uint64_t                mKey = 0;           // Identifies what the mesh was built from
+    unsigned                mCameraCount = 0;
+    std::vector<Vertex>     mVertices;
+    std::vector<uint16_t>   mIndices;
+};
+
+
+#endif // CAR_EVS_APP_WARPMESH_H
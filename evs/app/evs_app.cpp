@@ -31,6 +31,7 @@
 #include "EvsStateControl.h"
 #include "EvsVehicleListener.h"
 #include "ConfigManager.h"
+#include "StreamHandler.h"
 
 
 // libhidl:
@@ -102,6 +103,9 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // Keep enough frames from each camera to find ones that line up for the top view
+    StreamHandler::setHoldBack(config.getSyncHoldBack());
+
     // Set thread pool size to one to avoid concurrent events from the HAL.
     // This pool will handle the EvsCameraStream callbacks.
     // Note:  This _will_ run in parallel with the EvsListener run() loop below which
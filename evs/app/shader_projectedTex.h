@@ -62,4 +62,145 @@ const char pixShader_projectedTexture[] =
         "    color = texture(tex, uv);                          \n"
         "}                                                      \n";
 
+// The same projection sampling a YUV camera buffer bound as GL_TEXTURE_EXTERNAL_OES
+const char pixShader_projectedTextureExternal[] =
+        "#version 300 es                                        \n"
+        "#extension GL_OES_EGL_image_external_essl3 : require   \n"
+        "precision mediump float;                               \n"
+        "uniform samplerExternalOES tex;                        \n"
+        "in vec4 projectionSpace;                               \n"
+        "out vec4 color;                                        \n"
+        "void main()                                            \n"
+        "{                                                      \n"
+        "    const vec2 zero = vec2(0.0f, 0.0f);                \n"
+        "    const vec2 one  = vec2(1.0f, 1.0f);                \n"
+        "                                                       \n"
+        "    // Compute perspective correct texture coordinates \n"
+        "    // in the sensor map                               \n"
+        "    vec2 cs = projectionSpace.xy / projectionSpace.w;  \n"
+        "                                                       \n"
+        "    // flip the texture!                               \n"
+        "    cs.y = -cs.y;                                      \n"
+        "                                                       \n"
+        "    // scale from -1/1 clip space to 0/1 uv space      \n"
+        "    vec2 uv = (cs + 1.0f) * 0.5f;                      \n"
+        "                                                       \n"
+        "    // Bail if we don't have a valid projection        \n"
+        "    if ((projectionSpace.w <= 0.0f) ||                 \n"
+        "        any(greaterThan(uv, one)) ||                   \n"
+        "        any(lessThan(uv, zero))) {                     \n"
+        "        discard;                                       \n"
+        "    }                                                  \n"
+        "    color = texture(tex, uv);                          \n"
+        "}                                                      \n";
+
+// Pieces of the shaders that project every camera onto the ground in a single pass.
+// RenderTopView assembles them with a projection, a varying and a sampler per camera, each
+// camera's sampler being a sampler2D or samplerExternalOES to match its texture.  Projecting
+// at the vertices is exact since the perspective divide is left to each fragment.
+const char vtxShader_compositeHeader[] =
+        "#version 300 es                            \n"
+        "layout(location = 0) in vec4 pos;          \n"
+        "uniform mat4 cameraMat;                    \n";
+
+const char vtxShader_compositeCamera[] =            // Given the camera index twice
+        "uniform mat4 projectionMat%u;              \n"
+        "out vec4 projectionSpace%u;                \n";
+
+const char vtxShader_compositeMainStart[] =
+        "void main()                                \n"
+        "{                                          \n"
+        "   gl_Position = cameraMat * pos;          \n";
+
+const char vtxShader_compositeMainCamera[] =        // Given the camera index twice
+        "   projectionSpace%u = projectionMat%u * pos;  \n";
+
+const char vtxShader_compositeMainEnd[] =
+        "}                                          \n";
+
+const char pixShader_compositeHeader[] =
+        "#version 300 es                                        \n"
+        "%s"                                                    // extension directive, if any
+        "precision mediump float;                               \n"
+        "out vec4 color;                                        \n"
+        "                                                       \n"
+        "// How much a camera contributes to this fragment, which  \n"
+        "// falls off near the edges of its image so overlapping   \n"
+        "// cameras blend into each other                          \n"
+        "float weigh(vec4 projectionSpace, out vec2 uv)         \n"
+        "{                                                      \n"
+        "    // Compute perspective correct texture coordinates \n"
+        "    // in the sensor map, flipped and scaled from -1/1 \n"
+        "    // clip space to 0/1 uv space                      \n"
+        "    vec2 cs = projectionSpace.xy / projectionSpace.w;  \n"
+        "    cs.y = -cs.y;                                      \n"
+        "    uv = (cs + 1.0f) * 0.5f;                           \n"
+        "                                                       \n"
+        "    // Nothing if we don't have a valid projection     \n"
+        "    if (projectionSpace.w <= 0.0f) {                   \n"
+        "        return 0.0f;                                   \n"
+        "    }                                                  \n"
+        "    vec2 edge = min(uv, 1.0f - uv);                    \n"
+        "    return clamp(min(edge.x, edge.y) * 20.0f, 0.0f, 1.0f);  \n"
+        "}                                                      \n";
+
+const char pixShader_compositeExtension[] =
+        "#extension GL_OES_EGL_image_external_essl3 : require   \n";
+
+const char pixShader_compositeCamera[] =            // Given the sampler type and index, then index
+        "uniform %s tex%u;                                      \n"
+        "in vec4 projectionSpace%u;                             \n";
+
+const char pixShader_compositeMainStart[] =
+        "void main()                                            \n"
+        "{                                                      \n"
+        "    vec4 sum = vec4(0.0f);                             \n"
+        "    vec2 uv;                                           \n"
+        "    float w;                                           \n";
+
+const char pixShader_compositeMainCamera[] =        // Given the camera index twice
+        "    w = weigh(projectionSpace%u, uv);                  \n"
+        "    sum += w * vec4(texture(tex%u, uv).rgb, 1.0f);     \n";
+
+const char pixShader_compositeMainEnd[] =
+        "    // Bail if no camera sees this part of the ground  \n"
+        "    if (sum.a <= 0.0f) {                               \n"
+        "        discard;                                       \n"
+        "    }                                                  \n"
+        "    color = vec4(sum.rgb / sum.a, 1.0f);               \n"
+        "}                                                      \n";
+
+// Pieces of the shaders that draw the ground through a WarpMesh, assembled like those above.
+// The mesh already holds where each vertex lands in every camera's image and how much that
+// camera counts there, so all that's left is to look up and blend the images.
+const char vtxShader_warpMeshHeader[] =
+        "#version 300 es                            \n"
+        "layout(location = 0) in vec4 pos;          \n"
+        "uniform mat4 cameraMat;                    \n";
+
+const char vtxShader_warpMeshCamera[] =             // Given the attribute location, then index twice
+        "layout(location = %u) in vec3 warp%u;      \n"
+        "out vec3 camera%u;                         \n";
+
+const char vtxShader_warpMeshMainCamera[] =         // Given the camera index twice
+        "   camera%u = warp%u;                      \n";
+
+const char pixShader_warpMeshHeader[] =
+        "#version 300 es                                        \n"
+        "%s"                                                    // extension directive, if any
+        "precision mediump float;                               \n"
+        "out vec4 color;                                        \n";
+
+const char pixShader_warpMeshCamera[] =             // Given the sampler type and index, then index
+        "uniform %s tex%u;                                      \n"
+        "in vec3 camera%u;                                      \n";
+
+const char pixShader_warpMeshMainStart[] =
+        "void main()                                            \n"
+        "{                                                      \n"
+        "    vec4 sum = vec4(0.0f);                             \n";
+
+const char pixShader_warpMeshMainCamera[] =         // Given the camera index three times
+        "    sum += camera%u.z * vec4(texture(tex%u, camera%u.xy).rgb, 1.0f);  \n";
+
 #endif // SHADER_PROJECTED_TEX_H
\ No newline at end of file
@@ -41,4 +41,18 @@ const char pixShader_simpleTexture[] =
         "    color = texel;                         \n"
         "}                                          \n";
 
+// Samples a YUV camera buffer bound as GL_TEXTURE_EXTERNAL_OES, which converts to RGB for us
+const char pixShader_simpleTextureExternal[] =
+        "#version 300 es                                        \n"
+        "#extension GL_OES_EGL_image_external_essl3 : require   \n"
+        "precision mediump float;                               \n"
+        "uniform samplerExternalOES tex;                        \n"
+        "in vec2 uv;                                            \n"
+        "out vec4 color;                                        \n"
+        "void main()                                            \n"
+        "{                                                      \n"
+        "    vec4 texel = texture(tex, uv);                     \n"
+        "    color = texel;                                     \n"
+        "}                                                      \n";
+
 #endif // SHADER_SIMPLE_TEX_H
\ No newline at end of file
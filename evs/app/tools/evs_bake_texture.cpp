@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool run by the build to turn the app's PNG images into pre-baked texture files the app
+// can map and hand straight to GL.
+//
+// Usage:  evs_bake_texture [--etc] <input.png> <output.tex>
+//
+// With --etc, the image is compressed to ETC1 at an eighth of its RGBA size, dropping its alpha,
+// so that's only for opaque images.
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <ETC1/etc1.h>
+#include <png.h>
+
+#include "../TextureFile.h"
+
+
+// Reads any PNG as 8 bit RGBA
+static bool readPng(const char* filename, unsigned* pWidth, unsigned* pHeight,
+                    std::vector<png_byte>* pPixels) {
+    FILE* inputFile = fopen(filename, "rb");
+    if (inputFile == nullptr) {
+        perror(filename);
+        return false;
+    }
+
+    png_structp pngControl = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop pngInfo = pngControl ? png_create_info_struct(pngControl) : nullptr;
+    if (!pngInfo) {
+        fprintf(stderr, "Failed to set up libpng\n");
+        png_destroy_read_struct(&pngControl, nullptr, nullptr);
+        fclose(inputFile);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(pngControl))) {
+        fprintf(stderr, "libpng reported an error reading %s\n", filename);
+        png_destroy_read_struct(&pngControl, &pngInfo, nullptr);
+        fclose(inputFile);
+        return false;
+    }
+
+    png_init_io(pngControl, inputFile);
+    png_read_info(pngControl, pngInfo);
+
+    // Have libpng expand whatever it finds into RGBA with 8 bits per channel
+    png_set_expand(pngControl);
+    png_set_strip_16(pngControl);
+    png_set_gray_to_rgb(pngControl);
+    png_set_filler(pngControl, 0xFF, PNG_FILLER_AFTER);
+    png_read_update_info(pngControl, pngInfo);
+
+    const unsigned width = png_get_image_width(pngControl, pngInfo);
+    const unsigned height = png_get_image_height(pngControl, pngInfo);
+    const size_t stride = width * 4;
+    if (png_get_rowbytes(pngControl, pngInfo) != stride) {
+        fprintf(stderr, "%s didn't expand to RGBA\n", filename);
+        png_destroy_read_struct(&pngControl, &pngInfo, nullptr);
+        fclose(inputFile);
+        return false;
+    }
+
+    pPixels->resize(stride * height);
+    std::vector<png_bytep> rowPointers(height);
+    for (unsigned r = 0; r < height; r++) {
+        rowPointers[r] = pPixels->data() + r * stride;
+    }
+    png_read_image(pngControl, rowPointers.data());
+    png_read_end(pngControl, nullptr);
+
+    png_destroy_read_struct(&pngControl, &pngInfo, nullptr);
+    fclose(inputFile);
+
+    *pWidth = width;
+    *pHeight = height;
+    return true;
+}
+
+
+// Compresses RGBA pixels to ETC1, refusing images that aren't opaque
+static bool encodeEtc(const char* filename, unsigned width, unsigned height,
+                      std::vector<png_byte>* pPixels) {
+    std::vector<etc1_byte> rgb;
+    rgb.reserve(width * height * 3);
+    for (size_t i = 0; i < pPixels->size(); i += 4) {
+        if ((*pPixels)[i + 3] != 0xFF) {
+            fprintf(stderr, "%s isn't opaque, so it can't be baked to ETC\n", filename);
+            return false;
+        }
+        rgb.insert(rgb.end(), pPixels->begin() + i, pPixels->begin() + i + 3);
+    }
+
+    std::vector<etc1_byte> encoded(etc1_get_encoded_data_size(width, height));
+    if (encoded.size() != etcDataSize(width, height) ||
+        etc1_encode_image(rgb.data(), width, height, 3, width * 3, encoded.data()) != 0) {
+        fprintf(stderr, "Failed to compress %s\n", filename);
+        return false;
+    }
+
+    pPixels->assign(encoded.begin(), encoded.end());
+    return true;
+}
+
+
+int main(int argc, char** argv) {
+    const bool etc = (argc == 4 && strcmp(argv[1], "--etc") == 0);
+    if (argc != (etc ? 4 : 3)) {
+        fprintf(stderr, "Usage: %s [--etc] <input.png> <output.tex>\n", argv[0]);
+        return 1;
+    }
+    const char* inputName = argv[argc - 2];
+    const char* outputName = argv[argc - 1];
+
+    unsigned width;
+    unsigned height;
+    std::vector<png_byte> pixels;
+    if (!readPng(inputName, &width, &height, &pixels)) {
+        return 1;
+    }
+    if (etc && !encodeEtc(inputName, width, height, &pixels)) {
+        return 1;
+    }
+
+    // Our header keeps the image data that follows it 16 byte aligned
+    static_assert(sizeof(TextureFileHeader) % 16 == 0, "texture data must stay aligned");
+    TextureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic      = kTextureFileMagic;
+    header.version    = kTextureFileVersion;
+    header.width      = width;
+    header.height     = height;
+    header.format     = etc ? kTextureFormatETC2RGB8 : kTextureFormatRGBA8;
+    header.dataOffset = sizeof(header);
+    header.dataSize   = pixels.size();
+
+    FILE* outputFile = fopen(outputName, "wb");
+    if (outputFile == nullptr) {
+        perror(outputName);
+        return 1;
+    }
+    bool ok = (fwrite(&header, sizeof(header), 1, outputFile) == 1) &&
+              (fwrite(pixels.data(), pixels.size(), 1, outputFile) == 1);
+    ok &= (fclose(outputFile) == 0);
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s\n", outputName);
+        remove(outputName);
+        return 1;
+    }
+
+    return 0;
+}
@@ -8,6 +8,7 @@ LOCAL_SRC_FILES := \
     Enumerator.cpp \
     HalCamera.cpp \
     VirtualCamera.cpp \
+    StreamVariant.cpp \
     HalDisplay.cpp
 
 
@@ -20,6 +20,17 @@
 #include "Enumerator.h"
 #include "HalDisplay.h"
 
+#include <cutils/uevent.h>
+
+#include <algorithm>
+#include <memory>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 namespace android {
 namespace automotive {
 namespace evs {
@@ -27,6 +38,52 @@ namespace V1_0 {
 namespace implementation {
 
 
+// While the hardware has no camera, it waits for one to show up before answering us.  This
+// keeps us from asking too often if it doesn't.
+static const std::chrono::milliseconds kEmptyCameraListRetryInterval(250);
+
+// After the kernel reports a video device coming or going, the driver may take a moment to
+// notice it too, so we look at its list after each of these delays until we see the change.
+static const std::chrono::milliseconds kHotplugSettleDelays[] = {
+    std::chrono::milliseconds(50),
+    std::chrono::milliseconds(250),
+    std::chrono::milliseconds(1000),
+};
+
+static const int kUeventSocketBufferSize = 64 * 1024;
+static const size_t kUeventMessageSize = 4096;
+
+
+Enumerator::~Enumerator() {
+    {
+        // Our subscribers refer to us, so they must not hear of any change after this
+        std::lock_guard<std::mutex> lock(mCameraListLock);
+        mCameraListRunning = false;
+        mCameraListSubscribers.clear();
+    }
+    mCameraListSignal.notify_all();
+
+    if (mCameraListWakeFd >= 0) {
+        const uint64_t wake = 1;
+        if (write(mCameraListWakeFd, &wake, sizeof(wake)) != sizeof(wake)) {
+            ALOGE("Failed to wake the camera list watcher");
+        }
+    }
+
+    if (mCameraListThread.joinable()) {
+        mCameraListThread.join();
+    }
+    if (mCameraListWakeFd >= 0) {
+        close(mCameraListWakeFd);
+    }
+
+    std::lock_guard<std::mutex> lock(mCameraLock);
+    for (auto&& cam : mCameras) {
+        cam->shutdown();
+    }
+}
+
+
 bool Enumerator::init(const char* hardwareServiceName) {
     ALOGD("init");
 
@@ -34,10 +91,215 @@ bool Enumerator::init(const char* hardwareServiceName) {
     mHwEnumerator = IEvsEnumerator::getService(hardwareServiceName);
     bool result = (mHwEnumerator.get() != nullptr);
 
+    // Start keeping track of the cameras it offers
+    if (result) {
+        mCameraListWakeFd = eventfd(0, EFD_CLOEXEC);
+        if (mCameraListWakeFd < 0) {
+            ALOGE("Failed to create the camera list watcher's wake up event");
+        }
+        mCameraListRunning = true;
+        mCameraListThread = std::thread([this](){ watchCameraList(); });
+    }
+
     return result;
 }
 
 
+void Enumerator::watchCameraList() {
+    // The kernel announces video devices coming and going, which is also how the driver keeps its
+    // own list current, so once we have a list we only ask the driver again when it does
+    const int ueventFd = (mCameraListWakeFd < 0) ? -1 :
+                         uevent_open_socket(kUeventSocketBufferSize, true);
+    if (ueventFd < 0) {
+        ALOGE("Failed to listen for video device hotplug; the camera list won't change");
+    }
+
+    std::unique_lock<std::mutex> lock(mCameraListLock);
+    while (mCameraListRunning) {
+        if (!mCameraListValid || mCameraList.size() == 0) {
+            // The driver waits on its own camera signal for a camera before it answers, so
+            // asking again is how we wait for the first one
+            if (mCameraListValid &&
+                mCameraListSignal.wait_for(lock, kEmptyCameraListRetryInterval,
+                                           [this]() { return !mCameraListRunning; })) {
+                break;
+            }
+            lock.unlock();
+            refreshCameraList();
+            lock.lock();
+            continue;
+        }
+
+        // Sleep until a video device comes or goes, or we're told to stop
+        lock.unlock();
+        const bool hotplug = waitForVideoHotplug(ueventFd);
+        lock.lock();
+        if (!hotplug) {
+            // We're stopping, or can't watch for hotplug any more, so keep the list we have
+            mCameraListSignal.wait(lock, [this]() { return !mCameraListRunning; });
+            continue;
+        }
+
+        for (auto&& delay : kHotplugSettleDelays) {
+            if (mCameraListSignal.wait_for(lock, delay, [this]() { return !mCameraListRunning; })) {
+                break;
+            }
+            lock.unlock();
+            const bool changed = refreshCameraList();
+            lock.lock();
+            if (changed) {
+                break;
+            }
+        }
+    }
+    lock.unlock();
+
+    if (ueventFd >= 0) {
+        close(ueventFd);
+    }
+}
+
+
+// Blocks until the kernel reports a video device coming or going, returning false instead if
+// we're woken up to stop or can't wait
+bool Enumerator::waitForVideoHotplug(int ueventFd) {
+    if (ueventFd < 0) {
+        return false;
+    }
+
+    struct pollfd fds[2] = {
+        { mCameraListWakeFd, POLLIN, 0 },
+        { ueventFd,          POLLIN, 0 },
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ALOGE("Failed waiting for video device hotplug: %s", strerror(errno));
+            return false;
+        }
+        if (fds[0].revents != 0) {
+            return false;
+        }
+        if ((fds[1].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        // The event is a series of nul terminated KEY=value fields
+        char event[kUeventMessageSize];
+        const ssize_t length = uevent_kernel_multicast_recv(ueventFd, event, sizeof(event) - 2);
+        if (length <= 0) {
+            continue;
+        }
+        event[length] = event[length + 1] = '\0';
+        for (const char* field = event; field < event + length; field += strlen(field) + 1) {
+            if (strcmp(field, "SUBSYSTEM=video4linux") == 0) {
+                return true;
+            }
+        }
+    }
+}
+
+
+// Fetches the hardware's camera list, telling our subscribers if it differs from the one we had.
+// Returns true if it did.
+bool Enumerator::refreshCameraList() {
+    hidl_vec<CameraDesc> cameraList;
+    mHwEnumerator->getCameraList([&cameraList](const hidl_vec<CameraDesc>& list) {
+        cameraList = list;
+    });
+
+    // Did anything come or go since we last looked?
+    std::unique_lock<std::mutex> lock(mCameraListLock);
+    bool changed = false;
+    if (!mCameraListValid || cameraList.size() != mCameraList.size()) {
+        changed = true;
+    } else {
+        for (auto&& cam : cameraList) {
+            if (std::none_of(mCameraList.begin(), mCameraList.end(),
+                             [&cam](const CameraDesc& known) {
+                                 return known.cameraId == cam.cameraId;
+                             })) {
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (!changed) {
+        return false;
+    }
+
+    ALOGI("Camera list changed: %zu cameras available", cameraList.size());
+    mCameraList = cameraList;
+    mCameraListValid = true;
+
+    // Tell our subscribers without holding our lock, so they can call back into us
+    std::vector<CameraListCallback> subscribers = mCameraListSubscribers;
+    lock.unlock();
+    for (auto&& callback : subscribers) {
+        callback(cameraList);
+    }
+
+    return true;
+}
+
+
+void Enumerator::subscribeCameraListChanges(CameraListCallback callback) {
+    std::unique_lock<std::mutex> lock(mCameraListLock);
+    mCameraListSubscribers.push_back(callback);
+
+    if (mCameraListValid) {
+        hidl_vec<CameraDesc> cameraList = mCameraList;
+        lock.unlock();
+        callback(cameraList);
+    }
+}
+
+
+bool Enumerator::startPreroll(const char* cameraId, unsigned depth, unsigned maxRate,
+                              std::chrono::seconds idleTimeout) {
+    ALOGI("Pre-rolling camera %s with %u frames", cameraId, depth);
+
+    sp<IEvsCamera> device = mHwEnumerator->openCamera(cameraId);
+    if (device == nullptr) {
+        // It may just not have shown up yet, so try again the moment it does.  Our destructor
+        // drops this subscription, and waits out any call to it, before we go away.
+        ALOGW("Hardware camera %s not available for pre-roll yet", cameraId);
+        std::string id(cameraId);
+        auto started = std::make_shared<bool>(false);
+        subscribeCameraListChanges([this, id, depth, maxRate, idleTimeout, started]
+                                   (const hidl_vec<CameraDesc>& cameraList) {
+            if (*started) {
+                return;
+            }
+            for (auto&& cam : cameraList) {
+                if (cam.cameraId == id) {
+                    sp<IEvsCamera> device = mHwEnumerator->openCamera(id);
+                    if (device != nullptr) {
+                        *started = true;
+                        sp<HalCamera> hwCamera = new HalCamera(device);
+                        hwCamera->startPreroll(depth, maxRate, idleTimeout);
+                        std::lock_guard<std::mutex> lock(mCameraLock);
+                        mCameras.push_back(hwCamera);
+                    }
+                    break;
+                }
+            }
+        });
+        return false;
+    }
+
+    // This camera stays in our list with or without clients for as long as we run
+    sp<HalCamera> hwCamera = new HalCamera(device);
+    hwCamera->startPreroll(depth, maxRate, idleTimeout);
+    std::lock_guard<std::mutex> lock(mCameraLock);
+    mCameras.push_back(hwCamera);
+
+    return true;
+}
+
+
 bool Enumerator::checkPermission() {
     hardware::IPCThreadState *ipc = hardware::IPCThreadState::self();
     if (AID_AUTOMOTIVE_EVS != ipc->getCallingUid()) {
@@ -56,8 +318,16 @@ Return<void> Enumerator::getCameraList(getCameraList_cb list_cb)  {
         return Void();
     }
 
-    // Simply pass through to hardware layer
-    return mHwEnumerator->getCameraList(list_cb);
+    // Answer from our copy of the hardware's list, which may be empty if no camera has shown
+    // up yet.  Callers wanting a camera that isn't there should simply ask again later.
+    hidl_vec<CameraDesc> cameraList;
+    {
+        std::lock_guard<std::mutex> lock(mCameraListLock);
+        cameraList = mCameraList;
+    }
+    list_cb(cameraList);
+
+    return Void();
 }
 
 
@@ -67,6 +337,8 @@ Return<sp<IEvsCamera>> Enumerator::openCamera(const hidl_string& cameraId) {
         return nullptr;
     }
 
+    std::lock_guard<std::mutex> lock(mCameraLock);
+
     // Is the underlying hardware camera already open?
     sp<HalCamera> hwCamera;
     for (auto &&cam : mCameras) {
@@ -83,6 +355,11 @@ Return<sp<IEvsCamera>> Enumerator::openCamera(const hidl_string& cameraId) {
         }
     }
 
+    // Opening a camera is a good hint its stream is about to be wanted
+    if (hwCamera != nullptr) {
+        hwCamera->hintStreamWanted();
+    }
+
     // Do we need to open a new hardware camera?
     if (hwCamera == nullptr) {
         // Is the hardware camera available?
@@ -106,7 +383,9 @@ Return<sp<IEvsCamera>> Enumerator::openCamera(const hidl_string& cameraId) {
 
     // Add the hardware camera to our list, which will keep it alive via ref count
     if (clientCamera != nullptr) {
-        mCameras.push_back(hwCamera);
+        if (std::find(mCameras.begin(), mCameras.end(), hwCamera) == mCameras.end()) {
+            mCameras.push_back(hwCamera);
+        }
     } else {
         ALOGE("Requested camera %s not found or not available", cameraId.c_str());
     }
@@ -124,6 +403,8 @@ Return<void> Enumerator::closeCamera(const ::android::sp<IEvsCamera>& clientCame
         return Void();
     }
 
+    std::lock_guard<std::mutex> lock(mCameraLock);
+
     // All our client cameras are actually VirtualCamera objects
     sp<VirtualCamera> virtualCamera = reinterpret_cast<VirtualCamera*>(clientCamera.get());
 
@@ -135,11 +416,13 @@ Return<void> Enumerator::closeCamera(const ::android::sp<IEvsCamera>& clientCame
     //        zero, so it is important to break all cyclic references.
     halCamera->disownVirtualCamera(virtualCamera);
 
-    // Did we just remove the last client of this camera?
-    if (halCamera->getClientCount() == 0) {
-        // Take this now unused camera out of our list
+    // Did we just remove the last client of this camera?  (Pre-rolled cameras stay open.)
+    if (halCamera->getClientCount() == 0 && !halCamera->isPrerolling()) {
+        // Take this now unused camera out of our list, stopping its threads first so that
+        // they can't be the ones to let it go
         // NOTE:  This should drop our last reference to the camera, resulting in its
         //        destruction.
+        halCamera->shutdown();
         mCameras.remove(halCamera);
     }
 
@@ -217,6 +500,26 @@ Return<DisplayState> Enumerator::getDisplayState()  {
 }
 
 
+// Methods from ::android::hidl::base::V1_0::IBase follow.
+Return<void> Enumerator::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /*options*/) {
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        ALOGE("Ignoring debug request without a file descriptor");
+        return Void();
+    }
+    const int outFd = fd->data[0];
+
+    std::lock_guard<std::mutex> lock(mCameraLock);
+
+    dprintf(outFd, "EVS manager: %zu open cameras, display %s\n",
+            mCameras.size(), (mActiveDisplay.promote() != nullptr) ? "open" : "closed");
+    for (auto&& cam : mCameras) {
+        cam->dump(outFd);
+    }
+
+    return Void();
+}
+
+
 } // namespace implementation
 } // namespace V1_0
 } // namespace evs
@@ -18,6 +18,11 @@
 #define ANDROID_AUTOMOTIVE_EVS_V1_0_EVSCAMERAENUMERATOR_H
 
 #include <list>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
 
 #include "HalCamera.h"
 #include "VirtualCamera.h"
@@ -28,6 +33,8 @@
 using namespace ::android::hardware::automotive::evs::V1_0;
 using ::android::hardware::Return;
 using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::hidl_handle;
 
 namespace android {
 namespace automotive {
@@ -45,15 +52,45 @@ public:
     Return<void>            closeDisplay(const ::android::sp<IEvsDisplay>& display)  override;
     Return<DisplayState>    getDisplayState()  override;
 
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void>            debug(const hidl_handle& fd,
+                                  const hidl_vec<hidl_string>& options)  override;
+
     // Implementation details
+    virtual ~Enumerator();
     bool init(const char* hardwareServiceName);
+    bool startPreroll(const char* cameraId, unsigned depth, unsigned maxRate,
+                      std::chrono::seconds idleTimeout);
+
+    // Camera list changes are reported to subscribers within this process, on our camera list
+    // watcher thread, as soon as we see them.  The callback is also called right away with the
+    // current list if we have one.
+    using CameraListCallback = std::function<void(const hidl_vec<CameraDesc>&)>;
+    void subscribeCameraListChanges(CameraListCallback callback);
 
 private:
     bool checkPermission();
+    void watchCameraList();
+    bool waitForVideoHotplug(int ueventFd);
+    bool refreshCameraList();
 
     sp<IEvsEnumerator>          mHwEnumerator;  // Hardware enumerator
     wp<IEvsDisplay>             mActiveDisplay; // Display proxy object warpping hw display
     std::list<sp<HalCamera>>    mCameras;       // Camera proxy objects wrapping hw cameras
+    std::mutex                  mCameraLock;    // Protects mCameras
+
+    // We keep our own copy of the hardware camera list, refreshed by a watcher thread whenever
+    // the kernel reports a video device coming or going, so getCameraList never blocks our
+    // binder thread waiting on the hardware to find a camera.
+    hidl_vec<CameraDesc>        mCameraList;
+    bool                        mCameraListValid = false;
+    std::vector<CameraListCallback>
+                                mCameraListSubscribers;
+    std::thread                 mCameraListThread;
+    bool                        mCameraListRunning = false;
+    int                         mCameraListWakeFd = -1;     // Signaled to stop the watcher
+    std::condition_variable     mCameraListSignal;
+    std::mutex                  mCameraListLock;    // Protects the camera list state above
 };
 
 } // namespace implementation
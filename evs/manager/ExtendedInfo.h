@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUTOMOTIVE_EVS_V1_0_EXTENDEDINFO_H
+#define ANDROID_AUTOMOTIVE_EVS_V1_0_EXTENDEDINFO_H
+
+#include <stdint.h>
+
+
+// Opaque identifiers reserved by the EVS manager for IEvsCamera::setExtendedInfo() and
+// IEvsCamera::getExtendedInfo().  Requests using these identifiers apply only to the calling
+// client's camera and are never passed through to the hardware camera.
+
+// Upper bound, in frames per second, on how often frames are delivered to this client.
+// Zero (the default) delivers every frame the client has quota for.
+const static uint32_t kExtInfoMaxFrameRate      = 0x45564D01;
+
+// Relative priority of this client when hardware buffers are scarce.  When only one buffer
+// remains, it goes to the highest priority clients only.  Defaults to zero.
+const static uint32_t kExtInfoClientPriority    = 0x45564D02;
+
+// Pixel format, width and height of the frames delivered to this client.  Zero (the default)
+// means the hardware camera's native value.  When these differ from the native stream, the
+// manager converts each frame once and shares the result among all clients asking for the same
+// variant.  These may only be changed while the client's stream is stopped.  When the asking
+// client is the camera's only one, and the hardware camera reports a nonzero current format for
+// this same identifier, the format is also passed to it, and if it accepts, frames arrive in
+// that format with no conversion at all.  Hardware reporting zero is never sent this identifier.
+const static uint32_t kExtInfoOutputFormat      = 0x45564D03;
+const static uint32_t kExtInfoOutputWidth       = 0x45564D04;
+const static uint32_t kExtInfoOutputHeight      = 0x45564D05;
+
+// Read only.  The number of times the manager has restarted this camera's hardware stream
+// after frames stopped arriving, and how long, in milliseconds, the most recent of those
+// stalls took to recover.  Clients may poll these to learn that a gap in frames was a stall.
+const static uint32_t kExtInfoStreamRestarts    = 0x45564D06;
+const static uint32_t kExtInfoStreamRecoveryMs  = 0x45564D07;
+
+#endif  // ANDROID_AUTOMOTIVE_EVS_V1_0_EXTENDEDINFO_H
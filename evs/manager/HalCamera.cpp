@@ -17,10 +17,17 @@
 #include "HalCamera.h"
 #include "VirtualCamera.h"
 #include "Enumerator.h"
+#include "StreamVariant.h"
+#include "ExtendedInfo.h"
 
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
 
 namespace android {
 namespace automotive {
@@ -29,7 +36,50 @@ namespace V1_0 {
 namespace implementation {
 
 
-// TODO:  We need to hook up death monitoring to detect stream death so we can attempt a reconnect
+// How long the hardware stream may go without delivering a frame before we restart it.
+// This may be overridden from the command line.
+std::chrono::milliseconds HalCamera::sStallTimeout(2000);
+
+// Extra hardware buffers we reserve beyond what our clients need when we grow the pool, and how
+// long a surplus beyond that has to go unused before we give it back.
+static const unsigned kBufferHeadroom = 1;
+static const std::chrono::seconds kShrinkDelay(5);
+
+// A pre-rolled frame older than this is too stale to show a client that just started streaming
+static const std::chrono::milliseconds kMaxPrimingFrameAge(200);
+
+// How many buffer pool changes we remember for reporting
+static const unsigned kAllocationHistory = 8;
+
+
+HalCamera::HalCamera(sp<IEvsCamera> hwCamera) :
+    mHwCamera(hwCamera) {
+}
+
+
+HalCamera::~HalCamera() {
+    // Out of line so that our StreamVariant list can be destroyed where that type is complete
+    shutdown();
+    releasePrerollRing();
+}
+
+
+void HalCamera::shutdown() {
+    // Our threads only hold a reference to us while they're working, and that must never be our
+    // last, so our owner stops them here before letting go of us
+    LOG_ALWAYS_FATAL_IF(mWatchdogThread.get_id() == std::this_thread::get_id() ||
+                        mVariantThread.get_id() == std::this_thread::get_id(),
+                        "HalCamera shut down from one of its own threads");
+
+    mShutdown = true;
+    stopWatchdog();
+    stopVariantThread();
+}
+
+
+void HalCamera::setStallTimeout(std::chrono::milliseconds timeout) {
+    sStallTimeout = timeout;
+}
 
 
 sp<VirtualCamera> HalCamera::makeVirtualCamera() {
@@ -49,8 +99,14 @@ sp<VirtualCamera> HalCamera::makeVirtualCamera() {
         return nullptr;
     }
 
+    // Our hardware may be producing a format just for the client we had until now
+    restoreHwFormat();
+
     // Add this client to our ownership list via weak pointer
-    mClients.push_back(client);
+    {
+        std::lock_guard<std::mutex> lock(mClientLock);
+        mClients.push_back(client);
+    }
 
     // Return the strong pointer to the client
     return client;
@@ -68,70 +124,164 @@ void HalCamera::disownVirtualCamera(sp<VirtualCamera> virtualCamera) {
     virtualCamera->stopVideoStream();
 
     // Remove the virtual camera from our client list
-    unsigned clientCount = mClients.size();
-    mClients.remove(virtualCamera);
-    if (clientCount != mClients.size() + 1) {
-        ALOGE("Couldn't find camera in our client list to remove it");
+    bool lastClient = false;
+    {
+        std::lock_guard<std::mutex> lock(mClientLock);
+        unsigned clientCount = mClients.size();
+        mClients.remove(virtualCamera);
+        if (clientCount != mClients.size() + 1) {
+            ALOGE("Couldn't find camera in our client list to remove it");
+        }
+        lastClient = mClients.empty();
     }
     virtualCamera->shutdown();
 
+    // The next client shouldn't inherit a format this one asked for
+    if (lastClient) {
+        restoreHwFormat();
+    }
+
     // Recompute the number of buffers required with the target camera removed from the list
     if (!changeFramesInFlight(0)) {
         ALOGE("Error when trying to reduce the in flight buffer count");
     }
+
+    // Let go of any stream variant nobody is asking for any more
+    pruneVariants();
 }
 
 
-bool HalCamera::changeFramesInFlight(int delta) {
-    // Walk all our clients and count their currently required frames
-    unsigned bufferCount = 0;
-    for (auto&& client :  mClients) {
+unsigned HalCamera::getClientCount() {
+    std::lock_guard<std::mutex> lock(mClientLock);
+    return mClients.size();
+}
+
+
+// Our client list is changed on the binder thread, but read from the hardware's delivery thread
+// and our watchdog too, so everyone else works from a snapshot of the clients still alive.
+std::vector<sp<VirtualCamera>> HalCamera::getClients() {
+    std::lock_guard<std::mutex> lock(mClientLock);
+    std::vector<sp<VirtualCamera>> clients;
+    for (auto&& client : mClients) {
         sp<VirtualCamera> virtCam = client.promote();
         if (virtCam != nullptr) {
-            bufferCount += virtCam->getAllowedBuffers();
+            clients.push_back(virtCam);
         }
     }
+    return clients;
+}
+
 
-    // Add the requested delta
+bool HalCamera::changeFramesInFlight(int delta) {
+    // Walk all our clients and count their currently required frames
+    unsigned bufferCount = 0;
+    for (auto&& virtCam : getClients()) {
+        bufferCount += virtCam->getAllowedBuffers();
+    }
+
+    // Add the requested delta, and whatever our pre-roll ring holds on to
     bufferCount += delta;
+    bufferCount += mPrerollDepth;
 
     // Never drop below 1 buffer -- even if all client cameras get closed
     if (bufferCount < 1) {
         bufferCount = 1;
     }
 
+    std::unique_lock<std::mutex> lock(mBufferLock);
+    mBuffersRequired = bufferCount;
+    if (bufferCount <= mHwBufferCount) {
+        // We already have enough; any surplus is given back later by trimBuffers()
+        mAllocationStats.absorbedChanges++;
+        lock.unlock();
+        trimBuffers();
+        return true;
+    }
+
+    // Grow with headroom so the next client to arrive likely won't need a reallocation,
+    // but settle for exactly what we need if the hardware can't give us that much.
+    bool success = setHwBufferCount(bufferCount + kBufferHeadroom) ||
+                   setHwBufferCount(bufferCount);
+    if (success) {
+        mSurplusSince = std::chrono::steady_clock::now();
+    }
+
+    return success;
+}
+
+
+bool HalCamera::setHwBufferCount(unsigned bufferCount) {
     // Ask the hardware for the resulting buffer count
     Return<EvsResult> result = mHwCamera->setMaxFramesInFlight(bufferCount);
     bool success = (result.isOk() && result == EvsResult::OK);
+    if (!success) {
+        return false;
+    }
 
-    // Update the size of our array of outstanding frame records
-    if (success) {
-        std::vector<FrameRecord> newRecords;
-        newRecords.reserve(bufferCount);
+    ALOGI("Hardware buffer pool changed from %u to %u buffers", mHwBufferCount.load(),
+          bufferCount);
+    if (bufferCount > mHwBufferCount) {
+        mAllocationStats.grows++;
+    } else {
+        mAllocationStats.shrinks++;
+    }
+    mAllocationStats.recentEvents.push_back({std::chrono::steady_clock::now(),
+                                             mHwBufferCount.load(), bufferCount});
+    if (mAllocationStats.recentEvents.size() > kAllocationHistory) {
+        mAllocationStats.recentEvents.pop_front();
+    }
+    mHwBufferCount = bufferCount;
 
-        // Copy and compact the old records that are still active
-        for (const auto& rec : mFrames) {
-            if (rec.refCount > 0) {
-                newRecords.emplace_back(rec);
-            }
-        }
-        if (newRecords.size() > (unsigned)bufferCount) {
-            ALOGW("We found more frames in use than requested.");
-        }
+    return true;
+}
+
+
+// Gives surplus hardware buffers back once we've gone a while without needing them.
+// This is checked whenever our clients' needs change, when a stream stops, and periodically
+// from the watchdog while streaming.
+void HalCamera::trimBuffers() {
+    std::lock_guard<std::mutex> lock(mBufferLock);
+
+    const auto now = std::chrono::steady_clock::now();
+    const unsigned target = mBuffersRequired + kBufferHeadroom;
+    if (mBuffersRequired == 0 || mHwBufferCount <= target) {
+        // No surplus, so restart the idle clock
+        mSurplusSince = now;
+        return;
+    }
 
-        mFrames.swap(newRecords);
+    if (now - mSurplusSince >= kShrinkDelay) {
+        if (!setHwBufferCount(target)) {
+            ALOGE("Error when trying to reduce the in flight buffer count");
+        }
+        mSurplusSince = now;
     }
+}
 
-    return success;
+
+HalCamera::AllocationStats HalCamera::getAllocationStats() {
+    std::lock_guard<std::mutex> lock(mBufferLock);
+    return mAllocationStats;
 }
 
 
 Return<EvsResult> HalCamera::clientStreamStarting() {
     Return<EvsResult> result = EvsResult::OK;
 
+    std::unique_lock<std::mutex> lock(mStreamLock);
     if (mStreamState == STOPPED) {
         mStreamState = RUNNING;
         result = mHwCamera->startVideoStream(this);
+        if (!result.isOk() || result != EvsResult::OK) {
+            mStreamState = STOPPED;
+        }
+        const bool started = (mStreamState == RUNNING);
+        lock.unlock();
+
+        // Start watching for the frames we now expect
+        if (started) {
+            startWatchdog();
+        }
     }
 
     return result;
@@ -141,77 +291,825 @@ Return<EvsResult> HalCamera::clientStreamStarting() {
 void HalCamera::clientStreamEnding() {
     // Do we still have a running client?
     bool stillRunning = false;
-    for (auto&& client : mClients) {
-        sp<VirtualCamera> virtCam = client.promote();
-        if (virtCam != nullptr) {
-            stillRunning |= virtCam->isStreaming();
+    for (auto&& virtCam : getClients()) {
+        stillRunning |= virtCam->isStreaming();
+    }
+
+    if (!stillRunning && mPrerollEnabled) {
+        // Keep pre-rolling; the watchdog will stop us if nobody comes back for a while
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        mPrerollIdleSince = std::chrono::steady_clock::now();
+    } else if (!stillRunning) {
+        // If not, then stop the hardware stream
+        // The watchdog may be waiting on mStreamLock to restart us, so let it go first
+        stopWatchdog();
+
+        std::lock_guard<std::mutex> lock(mStreamLock);
+        if (mStreamState != STOPPED) {
+            mStreamState = STOPPED;
+            mHwCamera->stopVideoStream();
         }
     }
 
-    // If not, then stop the hardware stream
-    if (!stillRunning) {
-        mStreamState = STOPPED;
-        mHwCamera->stopVideoStream();
+    // Let go of any stream variant nobody is asking for any more, and maybe buffers too
+    pruneVariants();
+    trimBuffers();
+}
+
+
+std::atomic<int32_t>* HalCamera::getFrameRefCount(uint32_t bufferId) {
+    if (bufferId < kMaxDirectFrameIds) {
+        return &mFrameRefCounts[bufferId];
     }
+
+    // Unordered map nodes never move, so the counter stays valid after we drop the lock
+    std::lock_guard<std::mutex> lock(mOverflowLock);
+    return &mOverflowRefCounts[bufferId];
 }
 
 
 Return<void> HalCamera::doneWithFrame(const BufferDesc& buffer) {
-    // Find this frame in our list of outstanding frames
-    unsigned i;
-    for (i=0; i<mFrames.size(); i++) {
-        if (mFrames[i].frameId == buffer.bufferId) {
-            break;
-        }
+    // Converted frames belong to one of our stream variants rather than to the hardware
+    if (StreamVariant::isVariantBuffer(buffer.bufferId)) {
+        releaseVariantFrame(buffer);
+        return Void();
     }
-    if (i == mFrames.size()) {
+
+    // Find this frame in our table of outstanding frames
+    std::atomic<int32_t>* refCount = getFrameRefCount(buffer.bufferId);
+    int32_t prevCount = refCount->fetch_sub(1);
+    if (prevCount <= 0) {
         ALOGE("We got a frame back with an ID we don't recognize!");
-    } else {
-        // Are there still clients using this buffer?
-        mFrames[i].refCount--;
-        if (mFrames[i].refCount <= 0) {
-            // Since all our clients are done with this buffer, return it to the device layer
-            mHwCamera->doneWithFrame(buffer);
-        }
+        refCount->fetch_add(1);
+    } else if (prevCount == 1) {
+        // Since all our clients are done with this buffer, return it to the device layer
+        returnToHardware(buffer);
     }
 
     return Void();
 }
 
 
+void HalCamera::returnToHardware(const BufferDesc& buffer) {
+    // Nobody holds this frame anymore, and the hardware can't deliver it again until we return it
+    if (buffer.bufferId >= kMaxDirectFrameIds) {
+        std::lock_guard<std::mutex> lock(mOverflowLock);
+        mOverflowRefCounts.erase(buffer.bufferId);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    mHwCamera->doneWithFrame(buffer);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    mFramesInFlight--;
+
+    std::lock_guard<std::mutex> lock(mReturnLock);
+    mReturnStats.hwReturnCalls++;
+    mReturnStats.returnCpuNs += (end.tv_sec - start.tv_sec) * 1000000000LL +
+                                (end.tv_nsec - start.tv_nsec);
+}
+
+
+HalCamera::ReturnStats HalCamera::getReturnStats() {
+    std::lock_guard<std::mutex> lock(mReturnLock);
+    return mReturnStats;
+}
+
+
 Return<void> HalCamera::deliverFrame(const BufferDesc& buffer) {
+    if (buffer.memHandle == nullptr) {
+        // Each restart stops the hardware stream once, and the driver sends a marker for that
+        // stop whenever it gets to it.  Our clients shouldn't see those, however late they come.
+        unsigned expected = mMarkersToSwallow.load();
+        while (expected > 0 && !mMarkersToSwallow.compare_exchange_weak(expected, expected - 1)) {
+        }
+        if (expected > 0) {
+            ALOGD("Swallowing end of stream marker from a stream restart");
+            return Void();
+        }
+    }
+
+    if (buffer.memHandle != nullptr && mMarkersToSwallow.load(std::memory_order_relaxed) > 0) {
+        // The driver sends the marker for a stop ahead of the first frame of the stream it starts
+        // next, and we only restart a stream once its frames have stopped coming.  So with frames
+        // flowing again, any marker still expected was never sent, and we mustn't swallow a real
+        // end of stream in its place.
+        mMarkersToSwallow = 0;
+    }
+
+    if (buffer.memHandle != nullptr) {
+        // Note the frame's arrival for the watchdog, and finish the books on any recovery
+        std::lock_guard<std::mutex> lock(mWatchdogLock);
+        mLastFrameTime = std::chrono::steady_clock::now();
+        if (mRecovering) {
+            mRecovering = false;
+            const int64_t recoveryUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                    mLastFrameTime - mStallDetectedTime).count();
+            mRecoveryStats.recoveries++;
+            mRecoveryStats.lastRecoveryUs = recoveryUs;
+            mRecoveryStats.maxRecoveryUs = std::max(mRecoveryStats.maxRecoveryUs, recoveryUs);
+            ALOGI("Stream recovered %" PRId64 " ms after the stall was detected",
+                  recoveryUs / 1000);
+        }
+    }
+
+    if (buffer.memHandle == nullptr) {
+        // The end of stream marker isn't a real frame, so just pass it along to everyone
+        for (auto&& virtCam : getClients()) {
+            virtCam->deliverFrame(buffer);
+        }
+        return Void();
+    }
+
+    mFrameStats.framesReceived++;
+    mFrameRate.record();
+
+    // Hold our own reference while we hand the frame out so that a client returning it
+    // early can't send it back to the hardware before everyone has had a chance to see it.
+    std::atomic<int32_t>* refCount = getFrameRefCount(buffer.bufferId);
+    refCount->store(1);
+    mFramesInFlight++;
+
+    // If this is the last buffer the hardware has, only our highest priority clients get it,
+    // so that lower priority clients can't starve them of buffers.
+    const std::vector<sp<VirtualCamera>> clients = getClients();
+    const bool buffersScarce = (mFramesInFlight >= mHwBufferCount);
+    int32_t minPriority = INT32_MIN;
+    if (buffersScarce) {
+        for (auto&& virtCam : clients) {
+            if (virtCam->isStreaming()) {
+                minPriority = std::max(minPriority, virtCam->getPriority());
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mVariantLock);
+        mNativeDesc = buffer;
+    }
+
     // Run through all our clients and deliver this frame to any who are eligible
+    // NOTE:  Each client only queues the frame here, so this doesn't wait on any client process.
+    //        Clients wanting a converted frame are left to our variant thread.
     unsigned frameDeliveries = 0;
-    for (auto&& client : mClients) {
-        sp<VirtualCamera> virtCam = client.promote();
-        if (virtCam != nullptr) {
-            if (virtCam->deliverFrame(buffer)) {
-                frameDeliveries++;
+    VariantJob variantJob = {buffer, {}};
+    for (auto&& virtCam : clients) {
+        uint32_t format, width, height;
+        if (!virtCam->getOutputFormat(buffer, &format, &width, &height)) {
+            // This client takes the hardware frame as is
+            if (virtCam->getPriority() >= minPriority) {
+                refCount->fetch_add(1);
+                if (virtCam->deliverFrame(buffer)) {
+                    frameDeliveries++;
+                } else {
+                    refCount->fetch_sub(1);
+                }
             }
+        } else if (virtCam->isReadyForFrame()) {
+            // Converted frames only tie up the hardware buffer until they're produced, so they
+            // aren't subject to the priority cut off above
+            variantJob.requests.push_back({virtCam, format, width, height});
         }
     }
 
+    // The job keeps the hardware frame until every variant it needs has been produced
+    if (!variantJob.requests.empty()) {
+        frameDeliveries += variantJob.requests.size();
+        refCount->fetch_add(1);
+        queueVariantJob(std::move(variantJob));
+    }
+
+    mFrameStats.clientDeliveries += frameDeliveries;
     if (frameDeliveries < 1) {
         // If none of our clients could accept the frame, then return it right away
         ALOGI("Trivially rejecting frame with no acceptances");
-        mHwCamera->doneWithFrame(buffer);
-    } else {
-        // Add an entry for this frame in our tracking list
-        unsigned i;
-        for (i=0; i<mFrames.size(); i++) {
-            if (mFrames[i].refCount == 0) {
-                break;
+        mFrameStats.framesUnaccepted++;
+    }
+
+    // Keep this frame around for clients yet to start, if we're pre-rolling
+    if (mPrerollEnabled) {
+        retainForPreroll(buffer);
+    }
+
+    // Drop our own reference, returning the frame if no client is still holding it
+    doneWithFrame(buffer);
+
+    return Void();
+}
+
+void HalCamera::startWatchdog() {
+    // Without stall detection, we still need the watchdog's ticks to end an idle pre-roll
+    if ((sStallTimeout.count() == 0 && !mPrerollEnabled) || mShutdown) {
+        return;
+    }
+
+    stopWatchdog();
+    std::lock_guard<std::mutex> lock(mWatchdogLock);
+    mLastFrameTime = std::chrono::steady_clock::now();
+    mRecovering = false;
+    mWatchdogRunning = true;
+    mWatchdogThread = std::thread([this, weakThis = wp<HalCamera>(this)](){
+        watchdogLoop(weakThis);
+    });
+}
+
+
+void HalCamera::watchdogLoop(const wp<HalCamera>& weakThis) {
+    // Wake up often enough to catch a stall within half a timeout of it passing the limit
+    const std::chrono::milliseconds tick = (sStallTimeout.count() > 0) ?
+                                           sStallTimeout / 2 : std::chrono::milliseconds(1000);
+
+    std::unique_lock<std::mutex> lock(mWatchdogLock);
+    while (mWatchdogRunning) {
+        mWatchdogSignal.wait_for(lock, tick);
+        if (!mWatchdogRunning) {
+            break;
+        }
+
+        // Keep ourselves alive while we work.  If we're already on our way out, our destructor
+        // is waiting for us to finish.
+        sp<HalCamera> self = weakThis.promote();
+        if (self == nullptr) {
+            break;
+        }
+
+        // We're awake anyway, so see if we've been holding surplus buffers long enough,
+        // or pre-rolling for nobody long enough
+        lock.unlock();
+        trimBuffers();
+        stopIdlePreroll();
+        lock.lock();
+
+        const auto now = std::chrono::steady_clock::now();
+        if (sStallTimeout.count() == 0 || now - mLastFrameTime < sStallTimeout) {
+            continue;
+        }
+
+        // If our clients are holding every buffer, the pause is their doing, not the driver's
+        if (mFramesInFlight >= mHwBufferCount) {
+            mLastFrameTime = now;
+            continue;
+        }
+
+        ALOGW("No frame from the hardware camera in %lld ms - restarting its stream",
+              (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now - mLastFrameTime).count());
+        if (!mRecovering) {
+            // Time to recover is measured from the first detection, across repeated attempts
+            mRecovering = true;
+            mStallDetectedTime = now;
+        }
+        mLastFrameTime = now;
+        mRecoveryStats.restarts++;
+
+        lock.unlock();
+        restartHwStream();
+        lock.lock();
+    }
+}
+
+
+void HalCamera::stopWatchdog() {
+    {
+        std::lock_guard<std::mutex> lock(mWatchdogLock);
+        mWatchdogRunning = false;
+    }
+    mWatchdogSignal.notify_one();
+
+    if (mWatchdogThread.joinable()) {
+        mWatchdogThread.join();
+    }
+}
+
+
+void HalCamera::restartHwStream() {
+    std::lock_guard<std::mutex> lock(mStreamLock);
+    if (mStreamState != RUNNING) {
+        // Our clients stopped the stream while we were deciding to restart it
+        return;
+    }
+
+    // Our clients keep running across the restart; they'll just see a gap in the frames.
+    // Frames they are holding remain valid, and are returned to the hardware as usual.
+    // The end of stream marker for this stop may arrive after the new stream has started, so
+    // we count it rather than flag the restart
+    mMarkersToSwallow++;
+    mHwCamera->stopVideoStream();
+    Return<EvsResult> result = mHwCamera->startVideoStream(this);
+
+    if (!result.isOk() || result != EvsResult::OK) {
+        // We'll try again once another stall timeout has gone by
+        ALOGE("Failed to restart the stalled hardware stream");
+    }
+}
+
+
+HalCamera::RecoveryStats HalCamera::getRecoveryStats() {
+    std::lock_guard<std::mutex> lock(mWatchdogLock);
+    return mRecoveryStats;
+}
+
+
+HalCamera::FrameStats HalCamera::getFrameStats() {
+    // Plain counters written on the delivery thread, so this is a best effort snapshot
+    return mFrameStats;
+}
+
+
+bool HalCamera::requestNativeFormat(const VirtualCamera* client, uint32_t format) {
+    const std::vector<sp<VirtualCamera>> clients = getClients();
+    std::lock_guard<std::mutex> lock(mStreamLock);
+
+    // Changing what the hardware produces is only safe when nobody else can see it happen
+    if (mStreamState != STOPPED || clients.size() != 1 || clients.front().get() != client) {
+        return false;
+    }
+    if (format == mHwFormat) {
+        return true;
+    }
+
+    // Other hardware may give our identifier a meaning of its own, so we only pass it on to
+    // hardware that reports a current output format for it, as our sample driver does
+    if (mHwFormatSupport == UNKNOWN) {
+        Return<int32_t> current = mHwCamera->getExtendedInfo(kExtInfoOutputFormat);
+        mHwFormatSupport = (current.isOk() && current != 0) ? SUPPORTED : UNSUPPORTED;
+        ALOGI("Hardware %s choosing its output format",
+              (mHwFormatSupport == SUPPORTED) ? "supports" : "doesn't support");
+    }
+    if (mHwFormatSupport != SUPPORTED) {
+        return false;
+    }
+
+    Return<EvsResult> result = mHwCamera->setExtendedInfo(kExtInfoOutputFormat, format);
+    if (!result.isOk() || result != EvsResult::OK) {
+        ALOGI("Hardware can't produce format 0x%X, converting it here instead", format);
+        return false;
+    }
+
+    ALOGI("Hardware now produces format 0x%X for its only client", format);
+    mHwFormat = format;
+    return true;
+}
+
+
+void HalCamera::restoreHwFormat() {
+    std::lock_guard<std::mutex> lock(mStreamLock);
+
+    // If the stream is running, whoever shares it sees the format we asked for as native until
+    // the stream next stops and another client changes it
+    if (mHwFormat == 0 || mStreamState != STOPPED) {
+        return;
+    }
+
+    Return<EvsResult> result = mHwCamera->setExtendedInfo(kExtInfoOutputFormat, 0);
+    if (!result.isOk() || result != EvsResult::OK) {
+        ALOGW("Failed to restore the hardware's default output format");
+        return;
+    }
+    mHwFormat = 0;
+}
+
+
+void HalCamera::dump(int fd) {
+    std::string cameraId;
+    mHwCamera->getCameraInfo([&cameraId](CameraDesc desc) {
+        cameraId = desc.cameraId;
+    });
+
+    const FrameStats frameStats = getFrameStats();
+    const RecoveryStats recoveryStats = getRecoveryStats();
+    dprintf(fd, "  Camera %s: %s, %u clients\n",
+            cameraId.c_str(), (mStreamState == RUNNING) ? "running" : "stopped", getClientCount());
+    if (mHwFormat != 0) {
+        dprintf(fd, "    hardware producing format 0x%X for its only client\n", mHwFormat);
+    }
+    dprintf(fd, "    %.1f fps over the last %us; %u frames in flight of %u allocated\n",
+            mFrameRate.getRate(), RollingRate::kBuckets - 1,
+            mFramesInFlight.load(), mHwBufferCount.load());
+    dprintf(fd, "    %u frames received, %u client deliveries, %u accepted by no client\n",
+            frameStats.framesReceived, frameStats.clientDeliveries, frameStats.framesUnaccepted);
+    dprintf(fd, "    %u stall restarts, %u recoveries, recovery time last/max "
+                "%" PRId64 "/%" PRId64 " ms\n",
+            recoveryStats.restarts, recoveryStats.recoveries,
+            recoveryStats.lastRecoveryUs / 1000, recoveryStats.maxRecoveryUs / 1000);
+
+    if (mPrerollEnabled) {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        dprintf(fd, "    Pre-rolling %zu of %u frames, max rate %u fps, idle timeout %lld s\n",
+                mPrerollRing.size(), mPrerollDepth, mPrerollMaxRate,
+                (long long)mPrerollIdleTimeout.count());
+    }
+
+    const ReturnStats returnStats = getReturnStats();
+    dprintf(fd, "    %u frame returns to hardware, %" PRId64 " us CPU\n",
+            returnStats.hwReturnCalls, returnStats.returnCpuNs / 1000);
+
+    const AllocationStats allocStats = getAllocationStats();
+    const auto now = std::chrono::steady_clock::now();
+    dprintf(fd, "    Buffer pool: %u grows, %u shrinks, %u changes absorbed\n",
+            allocStats.grows, allocStats.shrinks, allocStats.absorbedChanges);
+    for (auto&& event : allocStats.recentEvents) {
+        dprintf(fd, "      %u -> %u buffers, %lld s ago\n", event.fromCount, event.toCount,
+                (long long)std::chrono::duration_cast<std::chrono::seconds>(
+                        now - event.time).count());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mVariantLock);
+        for (auto&& variant : mVariants) {
+            if (variant) {
+                variant->dump(fd);
+            }
+        }
+    }
+
+    for (auto&& virtCam : getClients()) {
+        virtCam->dump(fd);
+    }
+}
+
+
+void HalCamera::startPreroll(unsigned depth, unsigned maxRate, std::chrono::seconds idleTimeout) {
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        mPrerollEnabled = true;
+        mPrerollDepth = depth;
+        mPrerollMaxRate = maxRate;
+        mPrerollIdleTimeout = idleTimeout;
+        mPrerollIdleSince = std::chrono::steady_clock::now();
+    }
+
+    // Make sure the hardware has buffers for our ring as well as one to capture into
+    if (!changeFramesInFlight(0)) {
+        ALOGE("Failed to reserve %u buffers for pre-roll", depth);
+    }
+
+    Return<EvsResult> result = clientStreamStarting();
+    if (!result.isOk() || result != EvsResult::OK) {
+        ALOGE("Failed to start the pre-roll stream");
+    }
+}
+
+
+void HalCamera::hintStreamWanted() {
+    if (!mPrerollEnabled) {
+        return;
+    }
+
+    // A client is on its way, so get the stream going again if we'd let it go idle
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        mPrerollIdleSince = std::chrono::steady_clock::now();
+    }
+    clientStreamStarting();
+}
+
+
+void HalCamera::primeClient(const sp<VirtualCamera>& client) {
+    // Only clients taking our native stream can use the pre-rolled frames as is
+    uint32_t format, width, height;
+    BufferDesc frame = {};
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        if (mPrerollRing.empty() ||
+            client->getOutputFormat(mPrerollRing.back().buffer, &format, &width, &height) ||
+            std::chrono::steady_clock::now() - mPrerollRing.back().arrivalTime >
+                    kMaxPrimingFrameAge) {
+            return;
+        }
+        frame = mPrerollRing.back().buffer;
+
+        // Take the client's reference while the ring still holds its own, so the frame can't
+        // be evicted and sent back to the hardware before the client gets it
+        getFrameRefCount(frame.bufferId)->fetch_add(1);
+    }
+
+    if (!client->deliverFrame(frame)) {
+        doneWithFrame(frame);
+    }
+}
+
+
+void HalCamera::retainForPreroll(const BufferDesc& buffer) {
+    BufferDesc evicted = {};
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+
+        // Honor our rate limit, so pre-rolling costs less while nobody is watching
+        const auto now = std::chrono::steady_clock::now();
+        if (mPrerollMaxRate > 0) {
+            if (now < mNextPrerollTime) {
+                return;
             }
+            mNextPrerollTime = now + std::chrono::microseconds(1000000 / mPrerollMaxRate);
         }
-        if (i == mFrames.size()) {
-            mFrames.emplace_back(buffer.bufferId);
-        } else {
-            mFrames[i].frameId = buffer.bufferId;
+
+        getFrameRefCount(buffer.bufferId)->fetch_add(1);
+        mPrerollRing.push_back({buffer, now});
+        if (mPrerollRing.size() > mPrerollDepth) {
+            evicted = mPrerollRing.front().buffer;
+            mPrerollRing.pop_front();
         }
-        mFrames[i].refCount = frameDeliveries;
     }
 
-    return Void();
+    if (evicted.memHandle != nullptr) {
+        doneWithFrame(evicted);
+    }
+}
+
+
+void HalCamera::releasePrerollRing() {
+    std::deque<PrerollFrame> ring;
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        ring.swap(mPrerollRing);
+    }
+
+    for (auto&& frame : ring) {
+        doneWithFrame(frame.buffer);
+    }
+}
+
+
+// Ends a pre-roll that no client has wanted for longer than its idle timeout
+void HalCamera::stopIdlePreroll() {
+    {
+        std::lock_guard<std::mutex> lock(mPrerollLock);
+        if (!mPrerollEnabled || mPrerollIdleTimeout.count() == 0 ||
+            std::chrono::steady_clock::now() - mPrerollIdleSince < mPrerollIdleTimeout) {
+            return;
+        }
+    }
+
+    // Clients mark themselves streaming before they ask for the hardware stream, which needs
+    // mStreamLock, so checking for them under the same lock we stop the stream with means no
+    // client can start streaming in between and find the hardware stopped.
+    // NOTE:  Our client snapshot is declared first so it outlives the lock; a client going away
+    //        with it would otherwise call back into us for mStreamLock.
+    std::vector<sp<VirtualCamera>> clients;
+    {
+        std::lock_guard<std::mutex> lock(mStreamLock);
+        clients = getClients();
+        for (auto&& virtCam : clients) {
+            if (virtCam->isStreaming()) {
+                // Somebody is watching, so this isn't idle
+                std::lock_guard<std::mutex> prerollLock(mPrerollLock);
+                mPrerollIdleSince = std::chrono::steady_clock::now();
+                return;
+            }
+        }
+
+        if (mStreamState != STOPPED) {
+            ALOGI("Stopping idle pre-roll stream until the next client arrives");
+            mStreamState = STOPPED;
+            mHwCamera->stopVideoStream();
+        }
+    }
+
+    releasePrerollRing();
+
+    // We're on the watchdog thread, so just tell it to quit once we return
+    std::lock_guard<std::mutex> watchdogLock(mWatchdogLock);
+    mWatchdogRunning = false;
+}
+
+
+void HalCamera::queueVariantJob(VariantJob&& job) {
+    // A job still waiting when the next frame arrives is stale, so the newer one replaces it
+    BufferDesc staleFrame = {};
+    {
+        std::lock_guard<std::mutex> lock(mVariantJobLock);
+        if (!mVariantJobs.empty()) {
+            staleFrame = mVariantJobs.front().hwBuffer;
+            mVariantJobs.pop_front();
+        }
+        mVariantJobs.push_back(std::move(job));
+
+        if (mShutdown) {
+            // Nobody will convert this frame, so it goes straight back
+            staleFrame = mVariantJobs.back().hwBuffer;
+            mVariantJobs.pop_back();
+        } else if (!mVariantThreadRunning) {
+            if (mVariantThread.joinable()) {
+                mVariantThread.join();
+            }
+            mVariantThreadRunning = true;
+            mVariantThread = std::thread([this, weakThis = wp<HalCamera>(this)](){
+                variantLoop(weakThis);
+            });
+        }
+    }
+    mVariantSignal.notify_one();
+
+    if (staleFrame.memHandle != nullptr) {
+        doneWithFrame(staleFrame);
+    }
+}
+
+
+void HalCamera::variantLoop(const wp<HalCamera>& weakThis) {
+    std::unique_lock<std::mutex> lock(mVariantJobLock);
+    while (true) {
+        mVariantSignal.wait(lock, [this]() {
+            return !mVariantJobs.empty() || !mVariantThreadRunning;
+        });
+        if (!mVariantThreadRunning) {
+            break;
+        }
+
+        // Keep ourselves alive for the whole job, since the clients we deliver to may let go of
+        // us meanwhile.  If we're already on our way out, our destructor is waiting for us and
+        // will return the frames of the jobs we leave behind.
+        sp<HalCamera> self = weakThis.promote();
+        if (self == nullptr) {
+            break;
+        }
+
+        VariantJob job = std::move(mVariantJobs.front());
+        mVariantJobs.pop_front();
+        lock.unlock();
+        deliverVariants(job);
+        self = nullptr;
+        lock.lock();
+    }
+}
+
+
+void HalCamera::stopVariantThread() {
+    std::deque<VariantJob> jobs;
+    {
+        std::lock_guard<std::mutex> lock(mVariantJobLock);
+        mVariantThreadRunning = false;
+        jobs.swap(mVariantJobs);
+    }
+    mVariantSignal.notify_one();
+
+    if (mVariantThread.joinable()) {
+        mVariantThread.join();
+    }
+
+    // Give back the hardware frames of any jobs that never ran
+    for (auto&& job : jobs) {
+        doneWithFrame(job.hwBuffer);
+    }
+}
+
+
+void HalCamera::deliverVariants(const VariantJob& job) {
+    // Each variant of this frame is produced at most once, by the first client that needs it
+    struct VariantFrame {
+        uint32_t    format;
+        uint32_t    width;
+        uint32_t    height;
+        BufferDesc  buffer;
+    };
+    std::vector<VariantFrame> variantFrames;
+
+    for (auto&& request : job.requests) {
+        // The client may have gone away, or stopped, since the frame was queued for it
+        sp<VirtualCamera> virtCam = request.client.promote();
+        if (virtCam == nullptr || !virtCam->isReadyForFrame()) {
+            continue;
+        }
+
+        auto it = std::find_if(variantFrames.begin(), variantFrames.end(),
+                               [&](const VariantFrame& v) {
+                                   return v.format == request.format &&
+                                          v.width  == request.width &&
+                                          v.height == request.height;
+                               });
+        if (it == variantFrames.end()) {
+            variantFrames.push_back({request.format, request.width, request.height,
+                                     convertForVariant(job.hwBuffer, request.format,
+                                                       request.width, request.height)});
+            it = variantFrames.end() - 1;
+        }
+        if (it->buffer.memHandle == nullptr) {
+            // The conversion failed or the variant has no free buffers
+            continue;
+        }
+
+        retainVariantFrame(it->buffer);
+        if (!virtCam->deliverFrame(it->buffer)) {
+            releaseVariantFrame(it->buffer);
+        }
+    }
+
+    // Drop the references we took on the variant frames when we produced them
+    for (auto&& variant : variantFrames) {
+        if (variant.buffer.memHandle != nullptr) {
+            releaseVariantFrame(variant.buffer);
+        }
+    }
+
+    // We're done reading the hardware frame
+    doneWithFrame(job.hwBuffer);
+}
+
+
+BufferDesc HalCamera::convertForVariant(const BufferDesc& hwBuffer, uint32_t format,
+                                        uint32_t width, uint32_t height) {
+    // NOTE:  We hold our lock through the conversion, so clients returning variant frames
+    //        meanwhile will wait for it to finish.  This only ever runs on our variant thread.
+    std::lock_guard<std::mutex> lock(mVariantLock);
+
+    // Find the live variant that produces this format and size
+    StreamVariant* variant = nullptr;
+    for (auto&& v : mVariants) {
+        if (v && !v->isRetired() && v->matches(format, width, height)) {
+            variant = v.get();
+            break;
+        }
+    }
+
+    // Create it if this is the first time anyone has asked for it
+    if (variant == nullptr) {
+        auto slot = std::find(mVariants.begin(), mVariants.end(), nullptr);
+        if (slot == mVariants.end()) {
+            if (mVariants.size() >= StreamVariant::kMaxVariants) {
+                ALOGE("Too many stream variants to add %ux%u format 0x%X", width, height, format);
+                return {};
+            }
+            slot = mVariants.emplace(mVariants.end());
+        }
+        slot->reset(new StreamVariant(slot - mVariants.begin(), format, width, height));
+        variant = slot->get();
+    }
+
+    return variant->convertFrame(hwBuffer);
+}
+
+
+void HalCamera::retainVariantFrame(const BufferDesc& buffer) {
+    std::lock_guard<std::mutex> lock(mVariantLock);
+    const unsigned index = StreamVariant::getVariantIndex(buffer.bufferId);
+    if (index < mVariants.size() && mVariants[index]) {
+        mVariants[index]->addRef(buffer.bufferId);
+    }
+}
+
+
+void HalCamera::releaseVariantFrame(const BufferDesc& buffer) {
+    std::lock_guard<std::mutex> lock(mVariantLock);
+    const unsigned index = StreamVariant::getVariantIndex(buffer.bufferId);
+    if (index >= mVariants.size() || !mVariants[index]) {
+        ALOGE("We got a variant frame back with an ID we don't recognize!");
+        return;
+    }
+
+    mVariants[index]->releaseFrame(buffer.bufferId);
+
+    // A retired variant goes away once the last of its frames comes home
+    if (mVariants[index]->isRetired() && mVariants[index]->isIdle()) {
+        mVariants[index].reset();
+    }
+}
+
+
+void HalCamera::pruneVariants() {
+    BufferDesc nativeDesc;
+    {
+        std::lock_guard<std::mutex> lock(mVariantLock);
+        nativeDesc = mNativeDesc;
+    }
+
+    // Collect the variants our streaming clients still want
+    struct Wanted {
+        uint32_t format;
+        uint32_t width;
+        uint32_t height;
+    };
+    std::vector<Wanted> wanted;
+    for (auto&& virtCam : getClients()) {
+        if (virtCam->isStreaming()) {
+            Wanted w;
+            if (virtCam->getOutputFormat(nativeDesc, &w.format, &w.width, &w.height)) {
+                wanted.push_back(w);
+            }
+        }
+    }
+
+    // Retire the rest, destroying them right away if none of their frames are outstanding
+    std::lock_guard<std::mutex> lock(mVariantLock);
+    for (auto&& variant : mVariants) {
+        if (!variant) {
+            continue;
+        }
+        const bool inUse = std::any_of(wanted.begin(), wanted.end(), [&](const Wanted& w) {
+                               return variant->matches(w.format, w.width, w.height);
+                           });
+        if (!inUse) {
+            variant->retire();
+            if (variant->isIdle()) {
+                variant.reset();
+            }
+        }
+    }
+
+    // Trim trailing empty slots so the list doesn't only ever grow
+    while (!mVariants.empty() && !mVariants.back()) {
+        mVariants.pop_back();
+    }
 }
 
 } // namespace implementation
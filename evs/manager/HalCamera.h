@@ -23,6 +23,17 @@
 
 #include <thread>
 #include <list>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+
+#include "RollingRate.h"
 
 
 using namespace ::android::hardware::automotive::evs::V1_0;
@@ -37,6 +48,7 @@ namespace implementation {
 
 
 class VirtualCamera;    // From VirtualCamera.h
+class StreamVariant;    // From StreamVariant.h
 
 
 // This class wraps the actual hardware IEvsCamera objects.  There is a one to many
@@ -45,7 +57,12 @@ class VirtualCamera;    // From VirtualCamera.h
 // stream from the hardware camera and distribute it to the associated VirtualCamera objects.
 class HalCamera : public IEvsCameraStream {
 public:
-    HalCamera(sp<IEvsCamera> hwCamera) : mHwCamera(hwCamera) {};
+    HalCamera(sp<IEvsCamera> hwCamera);
+    virtual ~HalCamera();
+
+    // Stops our worker threads.  Our owner must call this before dropping its reference, so
+    // that we're never destroyed on one of those threads.
+    void                shutdown();
 
     // Factory methods for client VirtualCameras
     sp<VirtualCamera>   makeVirtualCamera();
@@ -53,9 +70,64 @@ public:
 
     // Implementation details
     sp<IEvsCamera>      getHwCamera()       { return mHwCamera; };
-    unsigned            getClientCount()    { return mClients.size(); };
+    unsigned            getClientCount();
+    unsigned            getFramesInFlight() { return mFramesInFlight; };
     bool                changeFramesInFlight(int delta);
 
+    // Stream stall detection and recovery
+    struct RecoveryStats {
+        unsigned    restarts            = 0;    // Times we restarted a stalled hardware stream
+        unsigned    recoveries          = 0;    // Times frames resumed after a restart
+        int64_t     lastRecoveryUs      = 0;    // Stall detection to first frame, most recent
+        int64_t     maxRecoveryUs       = 0;    // Stall detection to first frame, worst case
+    };
+    RecoveryStats       getRecoveryStats();
+
+    // Frame arrival and distribution statistics
+    struct FrameStats {
+        unsigned    framesReceived      = 0;    // Frames delivered to us by the hardware
+        unsigned    clientDeliveries    = 0;    // Frames accepted by clients, summed over clients
+        unsigned    framesUnaccepted    = 0;    // Frames that no client accepted
+    };
+    FrameStats          getFrameStats();
+
+    // Hardware buffer pool sizing history
+    struct AllocationEvent {
+        std::chrono::steady_clock::time_point   time;
+        unsigned                                fromCount;
+        unsigned                                toCount;
+    };
+    struct AllocationStats {
+        unsigned    grows               = 0;    // Times we asked the hardware for more buffers
+        unsigned    shrinks             = 0;    // Times we gave surplus buffers back
+        unsigned    absorbedChanges     = 0;    // Client changes served without reallocating
+        std::deque<AllocationEvent>     recentEvents;
+    };
+    AllocationStats     getAllocationStats();
+
+    // Frame return calls to the hardware camera
+    struct ReturnStats {
+        unsigned    hwReturnCalls       = 0;    // doneWithFrame calls made to the hardware
+        int64_t     returnCpuNs         = 0;    // Thread CPU time spent making those calls
+    };
+    ReturnStats         getReturnStats();
+
+    // Pre-roll keeps the hardware stream running into a small ring of recent frames even with
+    // no clients streaming, so a client starting its stream gets a frame right away.
+    void                startPreroll(unsigned depth, unsigned maxRate,
+                                     std::chrono::seconds idleTimeout);
+    bool                isPrerolling()      { return mPrerollEnabled; };
+    void                hintStreamWanted();
+    void                primeClient(const sp<VirtualCamera>& client);
+
+    // Asks the hardware to produce a client's output format itself, so that frames for our only
+    // client need no conversion.  Returns true if the hardware now produces that format.
+    bool                requestNativeFormat(const VirtualCamera* client, uint32_t format);
+
+    // Writes a human readable summary of this camera and its clients to the given fd
+    void                dump(int fd);
+    static void         setStallTimeout(std::chrono::milliseconds timeout);
+
     Return<EvsResult>   clientStreamStarting();
     void                clientStreamEnding();
     Return<void>        doneWithFrame(const BufferDesc& buffer);
@@ -64,21 +136,132 @@ public:
     Return<void> deliverFrame(const BufferDesc& buffer)  override;
 
 private:
+    void                            watchdogLoop(const wp<HalCamera>& weakThis);
+    void                            stopWatchdog();
+    void                            restartHwStream();
+    bool                            setHwBufferCount(unsigned bufferCount);
+    void                            returnToHardware(const BufferDesc& buffer);
+    void                            startWatchdog();
+    void                            retainForPreroll(const BufferDesc& buffer);
+    void                            releasePrerollRing();
+    void                            stopIdlePreroll();
+    void                            trimBuffers();
+    void                            restoreHwFormat();
+
+    std::vector<sp<VirtualCamera>>  getClients();
+
     sp<IEvsCamera>                  mHwCamera;
     std::list<wp<VirtualCamera>>    mClients;   // Weak pointers -> objects destruct if client dies
+    std::mutex                      mClientLock;    // Protects mClients
 
     enum {
         STOPPED,
         RUNNING,
         STOPPING,
     }                               mStreamState = STOPPED;
+    std::mutex                      mStreamLock;    // Serializes hardware stream start/stop
+    std::atomic<bool>               mShutdown = {false};    // No more worker threads
+    uint32_t                        mHwFormat = 0;  // Format we asked the hardware for, if any
+    enum {
+        UNKNOWN,        // Not yet asked
+        SUPPORTED,      // Reports its output format, so we may ask it for another
+        UNSUPPORTED,
+    }                               mHwFormatSupport = UNKNOWN;
+
+    // The watchdog restarts the hardware stream if frames stop arriving while it should be running
+    static std::chrono::milliseconds                sStallTimeout;  // Zero disables the watchdog
+    std::thread                                     mWatchdogThread;
+    bool                                            mWatchdogRunning = false;
+    std::condition_variable                         mWatchdogSignal;
+    std::chrono::steady_clock::time_point           mLastFrameTime;
+    std::chrono::steady_clock::time_point           mStallDetectedTime;
+    bool                                            mRecovering = false;
+    std::atomic<unsigned>                           mMarkersToSwallow = {0};  // From restarts
+    RecoveryStats                                   mRecoveryStats;
+    std::mutex                                      mWatchdogLock;  // Protects the above
+
+    std::atomic<int32_t>*           getFrameRefCount(uint32_t bufferId);
+
+    // Client reference counts for each outstanding frame, indexed by bufferId.
+    // Drivers hand out small, dense buffer ids (typically the index into their buffer pool),
+    // so we index a fixed table directly and only fall back to a map for ids beyond its range.
+    // Drivers that never reuse an id, like ours, leave that range over time, so map entries
+    // are dropped as their frames go back to the hardware.
+    static const unsigned           kMaxDirectFrameIds = 256;
+    std::array<std::atomic<int32_t>, kMaxDirectFrameIds>
+                                    mFrameRefCounts = {};
+    std::unordered_map<uint32_t, std::atomic<int32_t>>
+                                    mOverflowRefCounts;
+    std::mutex                      mOverflowLock;  // Protects mOverflowRefCounts
+
+    FrameStats                      mFrameStats;        // Only touched on the delivery thread
+    RollingRate                     mFrameRate;
+
+    std::atomic<unsigned>           mFramesInFlight = {0};  // Frames held by at least one client
+    std::atomic<unsigned>           mHwBufferCount  = {0};  // Buffers we asked the hardware for
+
+    // We grow the hardware buffer pool as soon as clients need it, with a little headroom, but
+    // only shrink it once the surplus has gone unused for a while.  This keeps clients coming
+    // and going on a running stream from making the driver reallocate its buffers every time.
+    unsigned                        mBuffersRequired = 0;   // Sum of our clients' allowances
+    std::chrono::steady_clock::time_point
+                                    mSurplusSince;          // When we last had just enough
+    AllocationStats                 mAllocationStats;
+    std::mutex                      mBufferLock;    // Protects the buffer pool sizing state
 
-    struct FrameRecord {
-        uint32_t    frameId;
-        uint32_t    refCount;
-        FrameRecord(uint32_t id) : frameId(id), refCount(0) {};
+    ReturnStats                                     mReturnStats;
+    std::mutex                                      mReturnLock;    // Protects mReturnStats
+
+    // Pre-roll state.  The ring holds a reference on each of its frames.
+    struct PrerollFrame {
+        BufferDesc                              buffer;
+        std::chrono::steady_clock::time_point   arrivalTime;
     };
-    std::vector<FrameRecord>        mFrames;
+    std::atomic<bool>                               mPrerollEnabled = {false};  // Read anywhere
+    unsigned                                        mPrerollDepth   = 0;
+    unsigned                                        mPrerollMaxRate = 0;    // Zero means no limit
+    std::chrono::seconds                            mPrerollIdleTimeout;    // Zero means forever
+    std::chrono::steady_clock::time_point           mPrerollIdleSince;
+    std::chrono::steady_clock::time_point           mNextPrerollTime;
+    std::deque<PrerollFrame>                        mPrerollRing;
+    std::mutex                                      mPrerollLock;   // Protects the above
+
+    // Alternate formats and sizes of our stream, produced on demand for clients that asked for
+    // them.  A variant's position in this list is encoded into the bufferIds of its frames, so
+    // destroyed variants leave a null entry behind rather than shifting their neighbors.
+    BufferDesc                      convertForVariant(const BufferDesc& hwBuffer, uint32_t format,
+                                                      uint32_t width, uint32_t height);
+    void                            retainVariantFrame(const BufferDesc& buffer);
+    void                            releaseVariantFrame(const BufferDesc& buffer);
+    void                            pruneVariants();
+
+    std::vector<std::unique_ptr<StreamVariant>>
+                                    mVariants;
+    BufferDesc                      mNativeDesc = {};   // Most recent hardware frame description
+    std::mutex                      mVariantLock;       // Protects mVariants and mNativeDesc
+
+    // Conversions run on our variant thread so that the hardware's delivery callback only has to
+    // take a reference on the frame and queue it.  A job holds that reference until it's done.
+    struct VariantRequest {
+        wp<VirtualCamera>   client;
+        uint32_t            format;
+        uint32_t            width;
+        uint32_t            height;
+    };
+    struct VariantJob {
+        BufferDesc                  hwBuffer;
+        std::vector<VariantRequest> requests;
+    };
+    void                            queueVariantJob(VariantJob&& job);
+    void                            deliverVariants(const VariantJob& job);
+    void                            variantLoop(const wp<HalCamera>& weakThis);
+    void                            stopVariantThread();
+
+    std::deque<VariantJob>          mVariantJobs;
+    std::thread                     mVariantThread;
+    bool                            mVariantThreadRunning = false;
+    std::condition_variable         mVariantSignal;
+    std::mutex                      mVariantJobLock;    // Protects the above
 };
 
 } // namespace implementation
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUTOMOTIVE_EVS_V1_0_ROLLINGRATE_H
+#define ANDROID_AUTOMOTIVE_EVS_V1_0_ROLLINGRATE_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <mutex>
+
+
+namespace android {
+namespace automotive {
+namespace evs {
+namespace V1_0 {
+namespace implementation {
+
+
+// Counts events in one second buckets so we can report their rate over the last several seconds
+// rather than over the whole lifetime of a stream.
+class RollingRate {
+public:
+    void record() {
+        std::lock_guard<std::mutex> lock(mLock);
+        advance(currentSecond());
+        mCounts[mCurrentSecond % kBuckets]++;
+    };
+
+    // Events per second over the completed buckets in our window
+    float getRate() {
+        std::lock_guard<std::mutex> lock(mLock);
+        advance(currentSecond());
+
+        const int64_t window = std::min<int64_t>(kBuckets - 1, mCurrentSecond - mFirstSecond);
+        if (window <= 0) {
+            return 0.0f;
+        }
+
+        unsigned total = 0;
+        for (int64_t s = mCurrentSecond - window; s < mCurrentSecond; s++) {
+            total += mCounts[s % kBuckets];
+        }
+        return float(total) / window;
+    };
+
+    static const unsigned kBuckets = 10;
+
+private:
+    static int64_t currentSecond() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+
+    // Moves our window forward to the given second, clearing the buckets we skip over
+    void advance(int64_t second) {
+        if (mFirstSecond < 0) {
+            mFirstSecond = mCurrentSecond = second;
+            return;
+        }
+        if (second - mCurrentSecond >= kBuckets) {
+            mCounts = {};
+        } else {
+            for (int64_t s = mCurrentSecond + 1; s <= second; s++) {
+                mCounts[s % kBuckets] = 0;
+            }
+        }
+        if (second > mCurrentSecond) {
+            mCurrentSecond = second;
+        }
+    };
+
+    std::array<unsigned, kBuckets>  mCounts = {};
+    int64_t                         mFirstSecond = -1;
+    int64_t                         mCurrentSecond = 0;
+    std::mutex                      mLock;
+};
+
+} // namespace implementation
+} // namespace V1_0
+} // namespace evs
+} // namespace automotive
+} // namespace android
+
+#endif  // ANDROID_AUTOMOTIVE_EVS_V1_0_ROLLINGRATE_H
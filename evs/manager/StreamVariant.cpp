@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "StreamVariant.h"
+
+#include <ui/GraphicBufferAllocator.h>
+#include <ui/GraphicBufferMapper.h>
+
+#include <atomic>
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+
+
+namespace android {
+namespace automotive {
+namespace evs {
+namespace V1_0 {
+namespace implementation {
+
+
+// Round up to the nearest multiple of the given alignment value
+template<unsigned alignment>
+int align(int value) {
+    static_assert((alignment && !(alignment & (alignment - 1))),
+                  "alignment must be a power of 2");
+
+    unsigned mask = alignment - 1;
+    return (value + mask) & ~mask;
+}
+
+
+static inline uint8_t clampToByte(int v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return v;
+}
+
+
+// Fixed point (8 fractional bits) versions of the conversions used throughout EVS
+static inline uint32_t yuvToRgbx(int Y, int U, int V) {
+    U -= 128;
+    V -= 128;
+    const uint8_t R = clampToByte(Y + ((292 * V) >> 8));
+    const uint8_t G = clampToByte(Y - ((101 * U + 149 * V) >> 8));
+    const uint8_t B = clampToByte(Y + ((520 * U) >> 8));
+    return R | (G << 8) | (B << 16) | 0xFF000000;
+}
+
+
+static inline void rgbxToYuv(uint32_t rgbx, uint8_t* Y, uint8_t* U, uint8_t* V) {
+    const int R = (rgbx)       & 0xFF;
+    const int G = (rgbx >> 8)  & 0xFF;
+    const int B = (rgbx >> 16) & 0xFF;
+    *Y = clampToByte(( 77 * R + 150 * G +  29 * B) >> 8);
+    *U = clampToByte(((-38 * R -  74 * G + 112 * B) >> 8) + 128);
+    *V = clampToByte(((157 * R - 132 * G -  26 * B) >> 8) + 128);
+}
+
+
+// Reads one (nearest neighbor scaled) row of the source image into 32bit RGBx values
+static void readRowAsRgbx(const BufferDesc& src, const uint8_t* pixels, unsigned srcRow,
+                          const std::vector<unsigned>& colMap, uint32_t* out) {
+    switch (src.format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888: {
+        const uint32_t* row = (const uint32_t*)pixels + srcRow * src.stride;
+        for (unsigned c = 0; c < colMap.size(); c++) {
+            out[c] = row[colMap[c]];
+        }
+        break;
+    }
+    case HAL_PIXEL_FORMAT_YCBCR_422_I: {    // YUYV
+        const uint8_t* row = pixels + srcRow * src.stride * 2;
+        for (unsigned c = 0; c < colMap.size(); c++) {
+            const uint8_t* macroPixel = row + (colMap[c] & ~1) * 2;
+            out[c] = yuvToRgbx(row[colMap[c] * 2], macroPixel[1], macroPixel[3]);
+        }
+        break;
+    }
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP: {   // NV21, laid out as the EVS sample driver does
+        const unsigned strideLum = align<16>(src.width);
+        const uint8_t* rowY  = pixels + srcRow * strideLum;
+        const uint8_t* rowUV = pixels + strideLum * src.height + (srcRow / 2) * strideLum;
+        for (unsigned c = 0; c < colMap.size(); c++) {
+            const unsigned uCol = colMap[c] & ~1;
+            out[c] = yuvToRgbx(rowY[colMap[c]], rowUV[uCol], rowUV[uCol | 1]);
+        }
+        break;
+    }
+    }
+}
+
+
+// Writes one row of 32bit RGBx values into the target image
+static void writeRowFromRgbx(const BufferDesc& tgt, uint8_t* pixels, unsigned tgtRow,
+                             const uint32_t* in) {
+    switch (tgt.format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        memcpy((uint32_t*)pixels + tgtRow * tgt.stride, in, tgt.width * sizeof(uint32_t));
+        break;
+    case HAL_PIXEL_FORMAT_YCBCR_422_I: {    // YUYV
+        uint8_t* row = pixels + tgtRow * tgt.stride * 2;
+        for (unsigned c = 0; c + 1 < tgt.width; c += 2) {
+            uint8_t Y1, Y2, U, V, U2, V2;
+            rgbxToYuv(in[c],     &Y1, &U,  &V);
+            rgbxToYuv(in[c + 1], &Y2, &U2, &V2);
+            row[c * 2 + 0] = Y1;
+            row[c * 2 + 1] = (U + U2) >> 1;
+            row[c * 2 + 2] = Y2;
+            row[c * 2 + 3] = (V + V2) >> 1;
+        }
+        break;
+    }
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP: {   // NV21, laid out as the EVS sample driver does
+        const unsigned strideLum = align<16>(tgt.width);
+        uint8_t* rowY  = pixels + tgtRow * strideLum;
+        uint8_t* rowUV = pixels + strideLum * tgt.height + (tgtRow / 2) * strideLum;
+        for (unsigned c = 0; c < tgt.width; c++) {
+            uint8_t U, V;
+            rgbxToYuv(in[c], &rowY[c], &U, &V);
+            // Chroma is subsampled 2x2, so take it from the even rows and columns
+            if (((tgtRow & 1) == 0) && ((c & 1) == 0)) {
+                rowUV[c]     = U;
+                rowUV[c | 1] = V;
+            }
+        }
+        break;
+    }
+    }
+}
+
+
+bool StreamVariant::isSupportedFormat(uint32_t format) {
+    return format == HAL_PIXEL_FORMAT_RGBA_8888 ||
+           format == HAL_PIXEL_FORMAT_YCBCR_422_I ||
+           format == HAL_PIXEL_FORMAT_YCRCB_420_SP;
+}
+
+
+static uint32_t pixelSizeOf(uint32_t format) {
+    switch (format) {
+    case HAL_PIXEL_FORMAT_RGBA_8888:    return 4;
+    case HAL_PIXEL_FORMAT_YCBCR_422_I:  return 2;
+    default:                            return 1;
+    }
+}
+
+
+// Variants come and go in the same slots, so each one stamps its bufferIds with a generation
+// of its own to keep them from naming a predecessor's buffers
+static std::atomic<uint32_t> sNextGeneration(0);
+
+
+StreamVariant::StreamVariant(unsigned index, uint32_t format, uint32_t width, uint32_t height) :
+    mIndex(index),
+    mGeneration(sNextGeneration++ & kGenerationMask),
+    mFormat(format),
+    mWidth(width),
+    mHeight(height) {
+    ALOGI("Creating stream variant %u: %ux%u format 0x%X", index, width, height, format);
+}
+
+
+StreamVariant::~StreamVariant() {
+    ALOGI("Destroying stream variant %u after %u conversions", mIndex, mConversions);
+
+    GraphicBufferAllocator& alloc(GraphicBufferAllocator::get());
+    for (auto&& rec : mBuffers) {
+        if (rec.refCount > 0) {
+            ALOGW("Error - releasing variant buffer despite remote ownership");
+        }
+        alloc.free(rec.handle);
+    }
+    mBuffers.clear();
+}
+
+
+BufferDesc StreamVariant::convertFrame(const BufferDesc& srcBuffer) {
+    BufferDesc tgtBuffer = {};
+
+    if (!isSupportedFormat(srcBuffer.format) || !isSupportedFormat(mFormat)) {
+        ALOGE("Unsupported stream variant conversion from 0x%X to 0x%X",
+              srcBuffer.format, mFormat);
+        return tgtBuffer;
+    }
+
+    // Find a free buffer, growing our pool if everything we have is in use
+    unsigned idx;
+    for (idx = 0; idx < mBuffers.size(); idx++) {
+        if (mBuffers[idx].refCount == 0) {
+            break;
+        }
+    }
+    if (idx == mBuffers.size()) {
+        if (mBuffers.size() >= kMaxVariantBuffers) {
+            ALOGW("Skipping variant frame because all %zu buffers are in use", mBuffers.size());
+            return tgtBuffer;
+        }
+
+        buffer_handle_t handle = nullptr;
+        uint32_t pixelsPerLine = 0;
+        GraphicBufferAllocator& alloc(GraphicBufferAllocator::get());
+        status_t result = alloc.allocate(mWidth, mHeight, mFormat, 1,
+                                         GRALLOC_USAGE_HW_TEXTURE |
+                                         GRALLOC_USAGE_SW_READ_RARELY |
+                                         GRALLOC_USAGE_SW_WRITE_OFTEN,
+                                         &handle, &pixelsPerLine, 0, "EvsStreamVariant");
+        if (result != NO_ERROR || !handle) {
+            ALOGE("Error %d allocating %d x %d variant buffer", result, mWidth, mHeight);
+            return tgtBuffer;
+        }
+        mStride = pixelsPerLine;
+        mBuffers.emplace_back(handle);
+    }
+
+    tgtBuffer.width     = mWidth;
+    tgtBuffer.height    = mHeight;
+    tgtBuffer.stride    = mStride;
+    tgtBuffer.pixelSize = pixelSizeOf(mFormat);
+    tgtBuffer.format    = mFormat;
+    tgtBuffer.usage     = GRALLOC_USAGE_HW_TEXTURE;
+    tgtBuffer.bufferId  = kVariantBufferFlag | (mGeneration << 16) | (mIndex << 8) | idx;
+    tgtBuffer.memHandle = mBuffers[idx].handle;
+
+    // Map both images so we can do the conversion on the CPU
+    const auto start = std::chrono::steady_clock::now();
+    GraphicBufferMapper& mapper = GraphicBufferMapper::get();
+    uint8_t* srcPixels = nullptr;
+    uint8_t* tgtPixels = nullptr;
+    mapper.lock(srcBuffer.memHandle, GRALLOC_USAGE_SW_READ_OFTEN,
+                android::Rect(srcBuffer.width, srcBuffer.height), (void**)&srcPixels);
+    mapper.lock(tgtBuffer.memHandle, GRALLOC_USAGE_SW_WRITE_OFTEN,
+                android::Rect(tgtBuffer.width, tgtBuffer.height), (void**)&tgtPixels);
+    if (!srcPixels || !tgtPixels) {
+        ALOGE("Failed to map buffers for stream variant conversion");
+        if (srcPixels) mapper.unlock(srcBuffer.memHandle);
+        if (tgtPixels) mapper.unlock(tgtBuffer.memHandle);
+        return {};
+    }
+
+    // Nearest neighbor scaling via precomputed source columns, converting a row at a time
+    std::vector<unsigned> colMap(mWidth);
+    for (unsigned c = 0; c < mWidth; c++) {
+        colMap[c] = c * srcBuffer.width / mWidth;
+    }
+    std::vector<uint32_t> rowBuffer(mWidth);
+    for (unsigned r = 0; r < mHeight; r++) {
+        readRowAsRgbx(srcBuffer, srcPixels, r * srcBuffer.height / mHeight, colMap,
+                      rowBuffer.data());
+        writeRowFromRgbx(tgtBuffer, tgtPixels, r, rowBuffer.data());
+    }
+
+    mapper.unlock(tgtBuffer.memHandle);
+    mapper.unlock(srcBuffer.memHandle);
+
+    mConversions++;
+    mConversionTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    // The caller holds the first reference
+    mBuffers[idx].refCount = 1;
+    return tgtBuffer;
+}
+
+
+void StreamVariant::addRef(uint32_t bufferId) {
+    const unsigned idx = bufferId & 0xFF;
+    if (idx < mBuffers.size() && isOurs(bufferId)) {
+        mBuffers[idx].refCount++;
+    }
+}
+
+
+void StreamVariant::releaseFrame(uint32_t bufferId) {
+    const unsigned idx = bufferId & 0xFF;
+    if (idx >= mBuffers.size() || !isOurs(bufferId) || mBuffers[idx].refCount <= 0) {
+        ALOGE("We got a variant frame back with an ID we don't recognize!");
+        return;
+    }
+    mBuffers[idx].refCount--;
+}
+
+
+bool StreamVariant::isIdle() const {
+    for (auto&& rec : mBuffers) {
+        if (rec.refCount > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StreamVariant::dump(int fd) const {
+    unsigned inUse = 0;
+    for (auto&& rec : mBuffers) {
+        if (rec.refCount > 0) {
+            inUse++;
+        }
+    }
+
+    dprintf(fd, "    Variant %u: %ux%u format 0x%X%s, %u of %zu buffers in use, "
+                "%u conversions averaging %" PRId64 " us\n",
+            mIndex, mWidth, mHeight, mFormat, mRetired ? " (retired)" : "",
+            inUse, mBuffers.size(), mConversions,
+            mConversions ? mConversionTimeUs / mConversions : 0);
+}
+
+} // namespace implementation
+} // namespace V1_0
+} // namespace evs
+} // namespace automotive
+} // namespace android
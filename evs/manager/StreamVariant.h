@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_AUTOMOTIVE_EVS_V1_0_STREAMVARIANT_H
+#define ANDROID_AUTOMOTIVE_EVS_V1_0_STREAMVARIANT_H
+
+#include <android/hardware/automotive/evs/1.0/types.h>
+#include <ui/GraphicBuffer.h>
+
+#include <vector>
+
+
+using namespace ::android::hardware::automotive::evs::V1_0;
+
+namespace android {
+namespace automotive {
+namespace evs {
+namespace V1_0 {
+namespace implementation {
+
+
+// This class produces one alternate format and/or size of a hardware camera's stream.
+// Each hardware frame is converted at most once into a buffer from our own small pool, and that
+// buffer is then shared by every client that asked for this variant.  Our buffers are handed to
+// clients with bufferIds carrying kVariantBufferFlag so returns can be routed back to us, and a
+// generation so that no other variant's buffer, even in our slot, ever shares an id with ours.
+class StreamVariant {
+public:
+    StreamVariant(unsigned index, uint32_t format, uint32_t width, uint32_t height);
+    ~StreamVariant();
+
+    bool        matches(uint32_t format, uint32_t width, uint32_t height) const {
+                    return format == mFormat && width == mWidth && height == mHeight;
+                };
+
+    // Converts the given hardware frame into one of our buffers.  The returned frame carries one
+    // reference for the caller.  If no buffer is available, the returned memHandle is null.
+    BufferDesc  convertFrame(const BufferDesc& srcBuffer);
+
+    void        addRef(uint32_t bufferId);
+    void        releaseFrame(uint32_t bufferId);
+
+    // Once no client wants this variant any more, it is retired and may be destroyed as soon
+    // as all its buffers have come back.
+    void        retire()            { mRetired = true; };
+    bool        isRetired() const   { return mRetired; };
+    bool        isIdle() const;
+
+    unsigned    getConversionCount() const  { return mConversions; };
+    int64_t     getConversionTimeUs() const { return mConversionTimeUs; };
+
+    // Writes a human readable summary of this variant to the given fd
+    void        dump(int fd) const;
+
+    static bool     isSupportedFormat(uint32_t format);
+    static bool     isVariantBuffer(uint32_t bufferId)  { return bufferId & kVariantBufferFlag; };
+    static unsigned getVariantIndex(uint32_t bufferId)  { return (bufferId >> 8) & 0xFF; };
+
+    // Limits on the number of variants per camera and the size of each variant's buffer pool
+    static const unsigned kMaxVariants          = 256;
+    static const unsigned kMaxVariantBuffers    = 16;
+
+private:
+    static const uint32_t kVariantBufferFlag    = 0x80000000;
+    static const uint32_t kGenerationMask       = 0x7FFF;
+
+    bool        isOurs(uint32_t bufferId) const {
+                    return ((bufferId >> 16) & kGenerationMask) == mGeneration;
+                };
+
+    struct BufferRecord {
+        buffer_handle_t handle;
+        int32_t         refCount;
+
+        explicit BufferRecord(buffer_handle_t h) : handle(h), refCount(0) {};
+    };
+
+    const unsigned  mIndex;
+    const uint32_t  mGeneration;
+    const uint32_t  mFormat;
+    const uint32_t  mWidth;
+    const uint32_t  mHeight;
+    uint32_t        mStride = 0;    // Pixels per row, as reported by the allocator
+
+    std::vector<BufferRecord>   mBuffers;
+    bool            mRetired = false;
+
+    unsigned        mConversions = 0;
+    int64_t         mConversionTimeUs = 0;
+};
+
+} // namespace implementation
+} // namespace V1_0
+} // namespace evs
+} // namespace automotive
+} // namespace android
+
+#endif  // ANDROID_AUTOMOTIVE_EVS_V1_0_STREAMVARIANT_H
@@ -17,10 +17,15 @@
 #include "VirtualCamera.h"
 #include "HalCamera.h"
 #include "Enumerator.h"
+#include "ExtendedInfo.h"
+#include "StreamVariant.h"
 
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <inttypes.h>
+#include <stdio.h>
+
 
 namespace android {
 namespace automotive {
@@ -29,6 +34,11 @@ namespace V1_0 {
 namespace implementation {
 
 
+// How many frames we'll let pile up waiting for a slow client before we start replacing the
+// oldest queued frame with the newest one.
+static const unsigned kMaxQueueDepth = 2;
+
+
 VirtualCamera::VirtualCamera(sp<HalCamera> halCamera) :
     mHalCamera(halCamera) {
 }
@@ -41,35 +51,82 @@ VirtualCamera::~VirtualCamera() {
 
 void VirtualCamera::shutdown() {
     // In normal operation, the stream should already be stopped by the time we get here
-    if (mStreamState != STOPPED) {
+    if (abandonStream()) {
         // Note that if we hit this case, no terminating frame will be sent to the client,
         // but they're probably already dead anyway.
-        ALOGW("Virtual camera being shutdown while stream is running");
+        ALOGW("Virtual camera was shutdown while stream was running");
+    }
 
-        // Tell the frame delivery pipeline we don't want any more frames
-        mStreamState = STOPPING;
+    // Drop our reference to our associated hardware camera
+    mHalCamera = nullptr;
+}
 
-        if (mFramesHeld.size() > 0) {
-            ALOGW("VirtualCamera destructing with frames in flight.");
 
-            // Return to the underlying hardware camera any buffers the client was holding
-            for (auto&& heldBuffer : mFramesHeld) {
-                // Tell our parent that we're done with this buffer
-                mHalCamera->doneWithFrame(heldBuffer);
-            }
-            mFramesHeld.clear();
+// Stops a running stream without telling the client, returning every frame the client was holding
+// or hadn't received yet.  Returns false if there was no stream to stop.
+bool VirtualCamera::abandonStream() {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (mStreamState == STOPPED) {
+        return false;
+    }
+
+    // Tell the frame delivery pipeline we don't want any more frames
+    mStreamState = STOPPING;
+
+    // Collect any buffers the client was holding or hadn't received yet
+    std::deque<BufferDesc> framesToReturn;
+    for (auto&& [id, held] : mFramesHeld) {
+        framesToReturn.push_back(held.buffer);
+    }
+    mFramesHeld.clear();
+    for (auto&& queued : mFramesQueued) {
+        if (queued.buffer.memHandle != nullptr) {
+            framesToReturn.push_back(queued.buffer);
         }
+    }
+    mFramesQueued.clear();
+    sp<IEvsCameraStream> stream = mStream;
+    lock.unlock();
+
+    // Our delivery thread has nothing left to send, so let it go
+    stopDeliveryThread();
+    if (stream != nullptr && mDeathRecipient != nullptr) {
+        stream->unlinkToDeath(mDeathRecipient);
+    }
 
-        // Give the underlying hardware camera the heads up that it might be time to stop
-        mHalCamera->clientStreamEnding();
+    if (framesToReturn.size() > 0) {
+        ALOGW("Reclaiming %zu frames in flight from abandoned stream.", framesToReturn.size());
+
+        // Return to the underlying hardware camera any buffers the client was holding
+        for (auto&& heldBuffer : framesToReturn) {
+            // Tell our parent that we're done with this buffer
+            mHalCamera->doneWithFrame(heldBuffer);
+        }
     }
 
-    // Drop our reference to our associated hardware camera
-    mHalCamera = nullptr;
+    // Give the underlying hardware camera the heads up that it might be time to stop
+    lock.lock();
+    mStreamState = STOPPED;
+    lock.unlock();
+    mHalCamera->clientStreamEnding();
+
+    return true;
+}
+
+
+void VirtualCamera::ClientDeathRecipient::serviceDied(
+        uint64_t /*cookie*/, const wp<::android::hidl::base::V1_0::IBase>& /*who*/) {
+    sp<VirtualCamera> camera = mCamera.promote();
+    if (camera != nullptr) {
+        ALOGW("Client stream died - reclaiming its frames");
+        camera->abandonStream();
+    }
 }
 
 
 bool VirtualCamera::deliverFrame(const BufferDesc& buffer) {
+    std::unique_lock<std::mutex> lock(mLock);
+
     if (buffer.memHandle == nullptr) {
         // Warn if we got an unexpected stream termination
         if (mStreamState != STOPPING) {
@@ -78,30 +135,210 @@ bool VirtualCamera::deliverFrame(const BufferDesc& buffer) {
         }
 
         // This is the stream end marker, so send it along, then mark the stream as stopped
-        mStream->deliverFrame(buffer);
         mStreamState = STOPPED;
+        if (mDeliveryRunning) {
+            // Let the delivery thread send it after any frames still ahead of it in the queue
+            mFramesQueued.push_back({buffer, std::chrono::steady_clock::now()});
+            lock.unlock();
+            mDeliverySignal.notify_one();
+        } else if (mStream != nullptr) {
+            sp<IEvsCameraStream> stream = mStream;
+            lock.unlock();
+            stream->deliverFrame(buffer);
+        }
         return true;
     } else {
-        if (mStreamState == STOPPED) {
+        if (mStreamState != RUNNING) {
             // A stopped stream gets no frames
             return false;
-        } else if (mFramesHeld.size() >= mFramesAllowed) {
+        }
+
+        // If the client asked for a lower frame rate, skip frames that come in too early.
+        // We allow a quarter period of slack so that capture jitter doesn't cost us the
+        // frame we actually wanted.
+        if (mMaxFrameRate > 0) {
+            const auto now = std::chrono::steady_clock::now();
+            const auto period = std::chrono::microseconds(1000000 / mMaxFrameRate);
+            if (now + period / 4 < mNextDeliveryTime) {
+                mStats.framesDecimated++;
+                return false;
+            }
+            mNextDeliveryTime += period;
+            if (mNextDeliveryTime < now) {
+                // We've fallen behind (or this is the first frame), so restart the cadence
+                mNextDeliveryTime = now + period;
+            }
+        }
+
+        // If the client is at quota, or not keeping up with delivery, we prefer to replace the
+        // oldest frame it hasn't seen yet rather than turn away the newest one.
+        BufferDesc droppedFrame = {};
+        const bool atQuota = (mFramesHeld.size() + mFramesQueued.size()) >= mFramesAllowed;
+        if ((atQuota || mFramesQueued.size() >= kMaxQueueDepth) && !mFramesQueued.empty()) {
+            droppedFrame = mFramesQueued.front().buffer;
+            mFramesQueued.pop_front();
+            mStats.framesDropped++;
+        } else if (atQuota) {
             // Indicate that we declined to send the frame to the client because they're at quota
             ALOGI("Skipping new frame as we hold %zu of %u allowed.",
                   mFramesHeld.size(), mFramesAllowed);
+            mStats.framesRejected++;
             return false;
-        } else {
-            // Keep a record of this frame so we can clean up if we have to in case of client death
-            mFramesHeld.push_back(buffer);
+        }
+
+        // Queue this frame for our delivery thread
+        mFramesQueued.push_back({buffer, std::chrono::steady_clock::now()});
+        if (mFramesQueued.size() > mStats.maxQueueDepth) {
+            mStats.maxQueueDepth = mFramesQueued.size();
+        }
+        lock.unlock();
+        mDeliverySignal.notify_one();
 
-            // Pass this buffer through to our client
-            mStream->deliverFrame(buffer);
-            return true;
+        // The frame we displaced never reached the client, so give it back right away
+        if (droppedFrame.memHandle != nullptr) {
+            mHalCamera->doneWithFrame(droppedFrame);
         }
+        return true;
     }
 }
 
 
+bool VirtualCamera::getOutputFormat(const BufferDesc& nativeBuffer,
+                                    uint32_t* format, uint32_t* width, uint32_t* height) {
+    std::lock_guard<std::mutex> lock(mLock);
+    *format = mOutputFormat ? mOutputFormat : nativeBuffer.format;
+    *width  = mOutputWidth  ? mOutputWidth  : nativeBuffer.width;
+    *height = mOutputHeight ? mOutputHeight : nativeBuffer.height;
+
+    return *format != nativeBuffer.format ||
+           *width  != nativeBuffer.width  ||
+           *height != nativeBuffer.height;
+}
+
+
+bool VirtualCamera::isReadyForFrame() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mStreamState != RUNNING) {
+        return false;
+    }
+
+    // Mirror the decimation and quota checks in deliverFrame without changing any state
+    if (mMaxFrameRate > 0) {
+        const auto period = std::chrono::microseconds(1000000 / mMaxFrameRate);
+        if (std::chrono::steady_clock::now() + period / 4 < mNextDeliveryTime) {
+            return false;
+        }
+    }
+    const bool atQuota = (mFramesHeld.size() + mFramesQueued.size()) >= mFramesAllowed;
+    return !atQuota || !mFramesQueued.empty();
+}
+
+
+void VirtualCamera::deliveryLoop() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        // Wait until we have something to send or we're told to quit
+        mDeliverySignal.wait(lock, [this]() {
+            return !mFramesQueued.empty() || !mDeliveryRunning;
+        });
+        if (mFramesQueued.empty()) {
+            break;
+        }
+
+        QueuedFrame frame = mFramesQueued.front();
+        mFramesQueued.pop_front();
+
+        // Keep a record of this frame so we can clean up if we have to in case of client death
+        const bool endOfStream = (frame.buffer.memHandle == nullptr);
+        if (!endOfStream) {
+            mFramesHeld[frame.buffer.bufferId] = {frame.buffer, std::chrono::steady_clock::now()};
+        }
+
+        // Pass this buffer through to our client without holding our lock
+        sp<IEvsCameraStream> stream = mStream;
+        lock.unlock();
+        auto result = stream->deliverFrame(frame.buffer);
+        if (!result.isOk()) {
+            ALOGE("Frame delivery call to client failed");
+        }
+        const int64_t latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - frame.queueTime).count();
+        lock.lock();
+
+        if (endOfStream) {
+            break;
+        }
+
+        if (mStats.framesDelivered == 0) {
+            mStats.firstFrameUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                    frame.queueTime - mStreamStartTime).count() + latencyUs;
+            ALOGI("First frame reached client %" PRId64 " us after its stream started",
+                  mStats.firstFrameUs);
+        }
+        mStats.framesDelivered++;
+        mDeliveryRate.record();
+        mStats.totalLatencyUs += latencyUs;
+        if (latencyUs > mStats.maxLatencyUs) {
+            mStats.maxLatencyUs = latencyUs;
+        }
+    }
+
+    mDeliveryRunning = false;
+}
+
+
+void VirtualCamera::stopDeliveryThread() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mDeliveryRunning = false;
+    }
+    mDeliverySignal.notify_one();
+
+    if (mDeliveryThread.joinable()) {
+        mDeliveryThread.join();
+    }
+}
+
+
+VirtualCamera::DeliveryStats VirtualCamera::getDeliveryStats() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mStats;
+}
+
+
+unsigned VirtualCamera::getQueueDepth() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mFramesQueued.size();
+}
+
+
+void VirtualCamera::dump(int fd) {
+    std::unique_lock<std::mutex> lock(mLock);
+    const DeliveryStats stats = mStats;
+    const char* state = (mStreamState == RUNNING)  ? "running" :
+                        (mStreamState == STOPPING) ? "stopping" : "stopped";
+    const unsigned held = mFramesHeld.size();
+    const unsigned queued = mFramesQueued.size();
+    lock.unlock();
+
+    dprintf(fd, "    Client %p: %s, priority %d, max rate %u fps, output 0x%X %ux%u\n",
+            this, state, mPriority.load(), mMaxFrameRate, mOutputFormat, mOutputWidth, mOutputHeight);
+    dprintf(fd, "      %.1f fps over the last %us; holding %u and queued %u of %u allowed\n",
+            mDeliveryRate.getRate(), RollingRate::kBuckets - 1, held, queued, mFramesAllowed);
+    dprintf(fd, "      %u delivered, %u dropped, %u rejected at quota, %u decimated, "
+                "max queue depth %u\n",
+            stats.framesDelivered, stats.framesDropped, stats.framesRejected,
+            stats.framesDecimated, stats.maxQueueDepth);
+    dprintf(fd, "      delivery latency avg/max %" PRId64 "/%" PRId64 " us, "
+                "hold time avg/max %" PRId64 "/%" PRId64 " us\n",
+            stats.framesDelivered ? stats.totalLatencyUs / stats.framesDelivered : 0,
+            stats.maxLatencyUs,
+            stats.framesReturned ? stats.totalHoldUs / stats.framesReturned : 0,
+            stats.maxHoldUs);
+    dprintf(fd, "      first frame %" PRId64 " us after stream start\n", stats.firstFrameUs);
+}
+
+
 // Methods from ::android::hardware::automotive::evs::V1_0::IEvsCamera follow.
 Return<void> VirtualCamera::getCameraInfo(getCameraInfo_cb info_cb) {
     // Straight pass through to hardware layer
@@ -121,12 +358,15 @@ Return<EvsResult> VirtualCamera::setMaxFramesInFlight(uint32_t bufferCount) {
     }
 
     // Update our notion of how many frames we're allowed
+    std::lock_guard<std::mutex> lock(mLock);
     mFramesAllowed = bufferCount;
     return EvsResult::OK;
 }
 
 
 Return<EvsResult> VirtualCamera::startVideoStream(const ::android::sp<IEvsCameraStream>& stream)  {
+    std::unique_lock<std::mutex> lock(mLock);
+
     // We only support a single stream at a time
     if (mStreamState != STOPPED) {
         ALOGE("ignoring startVideoStream call when a stream is already running.");
@@ -136,21 +376,50 @@ Return<EvsResult> VirtualCamera::startVideoStream(const ::android::sp<IEvsCamera
     // Validate our held frame count is starting out at zero as we expect
     assert(mFramesHeld.size() == 0);
 
+    // Make sure the delivery thread from any previous stream has finished up
+    if (mDeliveryThread.joinable()) {
+        lock.unlock();
+        mDeliveryThread.join();
+        lock.lock();
+    }
+
     // Record the user's callback for use when we have a frame ready
     mStream = stream;
+    if (mDeathRecipient == nullptr) {
+        mDeathRecipient = new ClientDeathRecipient(this);
+    }
+    Return<bool> linked = mStream->linkToDeath(mDeathRecipient, 0);
+    if (!linked.isOk() || !linked) {
+        ALOGW("Failed to watch for client death; its frames won't be reclaimed if it dies");
+    }
     mStreamState = RUNNING;
+    mStats = {};
+    mNextDeliveryTime = {};
+    mStreamStartTime = std::chrono::steady_clock::now();
+
+    // Fire up the thread that will hand frames to this client
+    mDeliveryRunning = true;
+    mDeliveryThread = std::thread([this](){ deliveryLoop(); });
+    lock.unlock();
 
     // Tell the underlying camera hardware that we want to stream
     Return<EvsResult> result = mHalCamera->clientStreamStarting();
     if ((!result.isOk()) || (result != EvsResult::OK)) {
         // If we failed to start the underlying stream, then we're not actually running
+        stopDeliveryThread();
+        stream->unlinkToDeath(mDeathRecipient);
+
+        lock.lock();
         mStream = nullptr;
         mStreamState = STOPPED;
         return EvsResult::UNDERLYING_SERVICE_ERROR;
     }
 
-    // TODO:  Detect and exit if we encounter a stalled stream or unresponsive driver?
-    // Consider using a timer and watching for frame arrival?
+    // NOTE:  Our HalCamera watches for frame arrival and restarts a stalled hardware stream
+    //        on its own, so nothing more is needed here.
+
+    // If the hardware stream was already running, we may not need to wait for our first frame
+    mHalCamera->primeClient(this);
 
     return EvsResult::OK;
 }
@@ -160,21 +429,24 @@ Return<void> VirtualCamera::doneWithFrame(const BufferDesc& buffer) {
     if (buffer.memHandle == nullptr) {
         ALOGE("ignoring doneWithFrame called with invalid handle");
     } else {
+        std::unique_lock<std::mutex> lock(mLock);
+
         // Find this buffer in our "held" list
-        auto it = mFramesHeld.begin();
-        while (it != mFramesHeld.end()) {
-            if (it->bufferId == buffer.bufferId) {
-                // found it!
-                break;
-            }
-            ++it;
-        }
+        auto it = mFramesHeld.find(buffer.bufferId);
         if (it == mFramesHeld.end()) {
             // We should always find the frame in our "held" list
             ALOGE("Ignoring doneWithFrame called with unrecognized frameID %d", buffer.bufferId);
         } else {
             // Take this frame out of our "held" list
+            const int64_t holdUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - it->second.deliveryTime).count();
             mFramesHeld.erase(it);
+            mStats.framesReturned++;
+            mStats.totalHoldUs += holdUs;
+            if (holdUs > mStats.maxHoldUs) {
+                mStats.maxHoldUs = holdUs;
+            }
+            lock.unlock();
 
             // Tell our parent that we're done with this buffer
             mHalCamera->doneWithFrame(buffer);
@@ -186,22 +458,49 @@ Return<void> VirtualCamera::doneWithFrame(const BufferDesc& buffer) {
 
 
 Return<void> VirtualCamera::stopVideoStream()  {
+    std::unique_lock<std::mutex> lock(mLock);
     if (mStreamState == RUNNING) {
         // Tell the frame delivery pipeline we don't want any more frames
         mStreamState = STOPPING;
 
-        // Deliver an empty frame to close out the frame stream
+        // Frames the client hasn't seen yet go straight back to the hardware camera
+        std::deque<BufferDesc> framesToReturn;
+        for (auto&& queued : mFramesQueued) {
+            if (queued.buffer.memHandle != nullptr) {
+                framesToReturn.push_back(queued.buffer);
+            }
+        }
+        mFramesQueued.clear();
+
+        // Queue an empty frame to close out the frame stream
         BufferDesc nullBuff = {};
-        auto result = mStream->deliverFrame(nullBuff);
-        if (!result.isOk()) {
-            ALOGE("Error delivering end of stream marker");
+        mFramesQueued.push_back({nullBuff, std::chrono::steady_clock::now()});
+        lock.unlock();
+
+        for (auto&& buffer : framesToReturn) {
+            mHalCamera->doneWithFrame(buffer);
         }
 
-        // Since we are single threaded, no frame can be delivered while this function is running,
-        // so we can go directly to the STOPPED state here on the server.
+        // Block until the delivery thread has sent the end of stream marker along
+        stopDeliveryThread();
+        mStream->unlinkToDeath(mDeathRecipient);
+
+        // Since the delivery thread is done, no frame can be delivered while this function is
+        // running, so we can go directly to the STOPPED state here on the server.
         // Note, however, that there still might be frames already queued that client will see
         // after returning from the client side of this call.
+        lock.lock();
         mStreamState = STOPPED;
+        const DeliveryStats stats = mStats;
+        lock.unlock();
+
+        ALOGI("Client stream stopped: %u delivered, %u dropped, %u rejected, %u decimated, "
+              "max queue depth %u, avg/max latency %" PRId64 "/%" PRId64 " us",
+              stats.framesDelivered, stats.framesDropped, stats.framesRejected,
+              stats.framesDecimated,
+              stats.maxQueueDepth,
+              stats.framesDelivered ? stats.totalLatencyUs / stats.framesDelivered : 0,
+              stats.maxLatencyUs);
 
         // Give the underlying hardware camera the heads up that it might be time to stop
         mHalCamera->clientStreamEnding();
@@ -212,15 +511,76 @@ Return<void> VirtualCamera::stopVideoStream()  {
 
 
 Return<int32_t> VirtualCamera::getExtendedInfo(uint32_t opaqueIdentifier)  {
-    // Pass straight through to the hardware device
-    return mHalCamera->getHwCamera()->getExtendedInfo(opaqueIdentifier);
+    // Report our own per client settings
+    switch (opaqueIdentifier) {
+    case kExtInfoMaxFrameRate:      return mMaxFrameRate;
+    case kExtInfoClientPriority:    return mPriority.load();
+    case kExtInfoOutputFormat:      return mOutputFormat;
+    case kExtInfoOutputWidth:       return mOutputWidth;
+    case kExtInfoOutputHeight:      return mOutputHeight;
+    case kExtInfoStreamRestarts:    return mHalCamera->getRecoveryStats().restarts;
+    case kExtInfoStreamRecoveryMs:  return mHalCamera->getRecoveryStats().lastRecoveryUs / 1000;
+    default:
+        // Pass straight through to the hardware device
+        return mHalCamera->getHwCamera()->getExtendedInfo(opaqueIdentifier);
+    }
 }
 
 
 Return<EvsResult> VirtualCamera::setExtendedInfo(uint32_t opaqueIdentifier, int32_t opaqueValue)  {
-    // Pass straight through to the hardware device
-    // TODO: Should we restrict access to this entry point somehow?
-    return mHalCamera->getHwCamera()->setExtendedInfo(opaqueIdentifier, opaqueValue);
+    // Settings that only apply to this client are handled here
+    switch (opaqueIdentifier) {
+    case kExtInfoMaxFrameRate:
+        if (opaqueValue < 0) {
+            ALOGE("Ignoring request for negative max frame rate %d", opaqueValue);
+            return EvsResult::INVALID_ARG;
+        } else {
+            std::lock_guard<std::mutex> lock(mLock);
+            mMaxFrameRate = opaqueValue;
+            mNextDeliveryTime = {};
+            return EvsResult::OK;
+        }
+    case kExtInfoClientPriority:
+        mPriority = opaqueValue;
+        return EvsResult::OK;
+    case kExtInfoOutputFormat:
+    case kExtInfoOutputWidth:
+    case kExtInfoOutputHeight: {
+        std::unique_lock<std::mutex> lock(mLock);
+        if (mStreamState != STOPPED) {
+            ALOGE("Output format and size may only be changed while the stream is stopped");
+            return EvsResult::STREAM_ALREADY_RUNNING;
+        }
+        if (opaqueValue < 0) {
+            ALOGE("Ignoring request for negative output setting %d", opaqueValue);
+            return EvsResult::INVALID_ARG;
+        }
+        if (opaqueIdentifier == kExtInfoOutputFormat) {
+            if (opaqueValue != 0 && !StreamVariant::isSupportedFormat(opaqueValue)) {
+                ALOGE("Unsupported output format 0x%X", opaqueValue);
+                return EvsResult::INVALID_ARG;
+            }
+            mOutputFormat = opaqueValue;
+            lock.unlock();
+
+            // Better still if the hardware can produce this format for us directly
+            mHalCamera->requestNativeFormat(this, opaqueValue);
+        } else if (opaqueIdentifier == kExtInfoOutputWidth) {
+            mOutputWidth = opaqueValue;
+        } else {
+            mOutputHeight = opaqueValue;
+        }
+        return EvsResult::OK;
+    }
+    case kExtInfoStreamRestarts:
+    case kExtInfoStreamRecoveryMs:
+        ALOGE("Ignoring attempt to set read only extended info 0x%X", opaqueIdentifier);
+        return EvsResult::INVALID_ARG;
+    default:
+        // Pass straight through to the hardware device
+        // TODO: Should we restrict access to this entry point somehow?
+        return mHalCamera->getHwCamera()->setExtendedInfo(opaqueIdentifier, opaqueValue);
+    }
 }
 
 } // namespace implementation
@@ -20,9 +20,17 @@
 #include <android/hardware/automotive/evs/1.0/types.h>
 #include <android/hardware/automotive/evs/1.0/IEvsCamera.h>
 #include <ui/GraphicBuffer.h>
+#include <hidl/HidlSupport.h>
+
+#include "RollingRate.h"
 
 #include <thread>
+#include <atomic>
 #include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 
 using namespace ::android::hardware::automotive::evs::V1_0;
@@ -52,10 +60,42 @@ public:
     sp<HalCamera>       getHalCamera()      { return mHalCamera; };
     unsigned            getAllowedBuffers() { return mFramesAllowed; };
     bool                isStreaming()       { return mStreamState == RUNNING; }
+    int32_t             getPriority()       { return mPriority; }
+
+    // Reports the format and size this client wants given the hardware's native frame.
+    // Returns true if that differs from the native frame, and so requires a stream variant.
+    bool                getOutputFormat(const BufferDesc& nativeBuffer,
+                                        uint32_t* format, uint32_t* width, uint32_t* height);
+
+    // True if a call to deliverFrame right now would likely be accepted.  Used to avoid
+    // producing converted frames that no client is going to take.
+    bool                isReadyForFrame();
 
     // Proxy to receive frames and forward them to the client's stream
+    // NOTE:  This only queues the frame; the actual call into the client happens on our own
+    //        delivery thread so that a slow client cannot stall the hardware callback.
     bool                deliverFrame(const BufferDesc& buffer);
 
+    // Frame delivery statistics for this client
+    struct DeliveryStats {
+        unsigned    framesDelivered     = 0;    // Frames actually sent to the client
+        unsigned    framesDropped       = 0;    // Queued frames replaced by newer ones
+        unsigned    framesRejected      = 0;    // Frames declined because we were at quota
+        unsigned    framesDecimated     = 0;    // Frames skipped to honor our max frame rate
+        unsigned    maxQueueDepth       = 0;    // Deepest the delivery queue has been
+        int64_t     totalLatencyUs      = 0;    // Sum of queue-to-client latencies
+        int64_t     maxLatencyUs        = 0;    // Worst queue-to-client latency
+        unsigned    framesReturned      = 0;    // Frames the client has given back
+        int64_t     totalHoldUs         = 0;    // Sum of times the client held returned frames
+        int64_t     maxHoldUs           = 0;    // Longest the client has held a frame
+        int64_t     firstFrameUs        = 0;    // From stream start to the first delivery
+    };
+    DeliveryStats       getDeliveryStats();
+    unsigned            getQueueDepth();
+
+    // Writes a human readable summary of this client's state and statistics to the given fd
+    void                dump(int fd);
+
     // Methods from ::android::hardware::automotive::evs::V1_0::IEvsCamera follow.
     Return<void>        getCameraInfo(getCameraInfo_cb _hidl_cb)  override;
     Return<EvsResult>   setMaxFramesInFlight(uint32_t bufferCount) override;
@@ -66,16 +106,65 @@ public:
     Return<EvsResult>   setExtendedInfo(uint32_t opaqueIdentifier, int32_t opaqueValue) override;
 
 private:
+    void                deliveryLoop();
+    void                stopDeliveryThread();
+    bool                abandonStream();
+
+    // Lets us take back everything a client was holding as soon as its process dies, rather
+    // than waiting for its last reference to us to drop.
+    class ClientDeathRecipient : public ::android::hardware::hidl_death_recipient {
+    public:
+        explicit ClientDeathRecipient(wp<VirtualCamera> camera) : mCamera(camera) {};
+        void serviceDied(uint64_t cookie,
+                         const wp<::android::hidl::base::V1_0::IBase>& who) override;
+    private:
+        wp<VirtualCamera>   mCamera;
+    };
+
     sp<HalCamera>           mHalCamera;     // The low level camera interface that backs this proxy
     sp<IEvsCameraStream>    mStream;
-
-    std::deque<BufferDesc>  mFramesHeld;
+    sp<ClientDeathRecipient>
+                            mDeathRecipient;
+
+    // A frame waiting on our delivery thread, along with when it was queued
+    struct QueuedFrame {
+        BufferDesc                              buffer;
+        std::chrono::steady_clock::time_point   queueTime;
+    };
+
+    // A frame the client owns, along with when we handed it over
+    struct HeldFrame {
+        BufferDesc                              buffer;
+        std::chrono::steady_clock::time_point   deliveryTime;
+    };
+
+    std::unordered_map<uint32_t, HeldFrame>
+                            mFramesHeld;    // Frames the client currently owns, by bufferId
+    std::deque<QueuedFrame> mFramesQueued;  // Frames accepted but not yet sent to the client
     unsigned                mFramesAllowed  = 1;
+    unsigned                mMaxFrameRate   = 0;    // Zero means no limit
+    std::atomic<int32_t>    mPriority       = {0};  // Read on the delivery thread
+    uint32_t                mOutputFormat   = 0;    // Zero means the hardware's native value
+    uint32_t                mOutputWidth    = 0;
+    uint32_t                mOutputHeight   = 0;
+    std::chrono::steady_clock::time_point   mNextDeliveryTime;
+    std::chrono::steady_clock::time_point   mStreamStartTime;
     enum {
         STOPPED,
         RUNNING,
         STOPPING,
     }                       mStreamState    = STOPPED;
+
+    // The delivery thread drains mFramesQueued into the client's stream
+    std::thread             mDeliveryThread;
+    bool                    mDeliveryRunning = false;
+    std::condition_variable mDeliverySignal;
+    DeliveryStats           mStats;
+    RollingRate             mDeliveryRate;
+
+    // Protects the frame lists, stream state and stats above, which are touched both by
+    // the binder thread and by our delivery thread.
+    std::mutex              mLock;
 };
 
 } // namespace implementation
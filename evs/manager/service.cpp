@@ -16,6 +16,8 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <hidl/HidlTransportSupport.h>
 #include <utils/Errors.h>
 #include <utils/StrongPointer.h>
@@ -38,6 +40,13 @@ using namespace android::automotive::evs::V1_0::implementation;
 using namespace android;
 
 
+// Optional camera to keep streaming before any client asks for it
+static const char*  sPrerollCameraId    = nullptr;
+static unsigned     sPrerollDepth       = 1;
+static unsigned     sPrerollMaxRate     = 0;
+static unsigned     sPrerollIdleTimeout = 0;
+
+
 static void startService(const char *hardwareServiceName, const char * managerServiceName) {
     ALOGI("EVS managed service connecting to hardware service at %s", hardwareServiceName);
     android::sp<Enumerator> service = new Enumerator();
@@ -46,6 +55,11 @@ static void startService(const char *hardwareServiceName, const char * managerSe
         exit(1);
     }
 
+    if (sPrerollCameraId != nullptr) {
+        service->startPreroll(sPrerollCameraId, sPrerollDepth, sPrerollMaxRate,
+                              std::chrono::seconds(sPrerollIdleTimeout));
+    }
+
     // Register our service -- if somebody is already registered by our name,
     // they will be killed (their thread pool will throw an exception).
     ALOGI("EVS managed service is starting as %s", managerServiceName);
@@ -76,6 +90,41 @@ int main(int argc, char** argv) {
             } else {
                 evsHardwareServiceName = argv[i];
             }
+        } else if (strcmp(argv[i], "--stall-timeout") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--stall-timeout <milliseconds> was not provided with a timeout\n");
+            } else {
+                HalCamera::setStallTimeout(std::chrono::milliseconds(atoi(argv[i])));
+            }
+        } else if (strcmp(argv[i], "--preroll") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--preroll <camera_id> was not provided with a camera id\n");
+            } else {
+                sPrerollCameraId = argv[i];
+            }
+        } else if (strcmp(argv[i], "--preroll-depth") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--preroll-depth <frames> was not provided with a frame count\n");
+            } else {
+                sPrerollDepth = std::max(1, atoi(argv[i]));
+            }
+        } else if (strcmp(argv[i], "--preroll-rate") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--preroll-rate <fps> was not provided with a frame rate\n");
+            } else {
+                sPrerollMaxRate = std::max(0, atoi(argv[i]));
+            }
+        } else if (strcmp(argv[i], "--preroll-timeout") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--preroll-timeout <seconds> was not provided with a timeout\n");
+            } else {
+                sPrerollIdleTimeout = std::max(0, atoi(argv[i]));
+            }
         } else if (strcmp(argv[i], "--help") == 0) {
             printHelp = true;
         } else {
@@ -86,7 +135,16 @@ int main(int argc, char** argv) {
     if (printHelp) {
         printf("Options include:\n");
         printf("  --mock                   Connect to the mock driver at EvsEnumeratorHw-Mock\n");
-        printf("  --target <service_name>  Connect to the named IEvsEnumerator service");
+        printf("  --target <service_name>  Connect to the named IEvsEnumerator service\n");
+        printf("  --stall-timeout <ms>     Restart a camera stream after this long without a frame\n");
+        printf("                           (default 2000, 0 disables)\n");
+        printf("  --preroll <camera_id>    Keep this camera streaming even without clients\n");
+        printf("  --preroll-depth <n>      Recent frames kept while pre-rolling (default 1)\n");
+        printf("  --preroll-rate <fps>     Most frames per second kept while pre-rolling\n");
+        printf("                           (default 0, no limit)\n");
+        printf("  --preroll-timeout <s>    Stop pre-rolling after this long without a client,\n");
+        printf("                           resuming when the camera is next opened\n");
+        printf("                           (default 0, never stop)\n");
     }
 
 
@@ -10,6 +10,8 @@ LOCAL_SRC_FILES := \
     EvsGlDisplay.cpp \
     GlWrapper.cpp \
     VideoCapture.cpp \
+    CaptureReactor.cpp \
+    GpuConverter.cpp \
     bufferCopy.cpp \
 
 
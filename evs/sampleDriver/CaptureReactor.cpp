@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cutils/log.h>
+
+#include "CaptureReactor.h"
+#include "VideoCapture.h"
+
+
+// Most events we'll handle per wake up of a loop
+static const int kMaxEvents = 8;
+
+unsigned CaptureReactor::sThreadCount  = 1;
+int      CaptureReactor::sFifoPriority = 0;
+uint64_t CaptureReactor::sCpuMask      = 0;
+
+
+void CaptureReactor::configure(unsigned threadCount, int fifoPriority, uint64_t cpuMask) {
+    sThreadCount  = threadCount;
+    sFifoPriority = fifoPriority;
+    sCpuMask      = cpuMask;
+}
+
+
+CaptureReactor* CaptureReactor::get() {
+    if (sThreadCount == 0) {
+        return nullptr;
+    }
+
+    // Created on first use so the configuration from our command line is in place
+    static CaptureReactor* sReactor = new CaptureReactor(sThreadCount);
+    return sReactor;
+}
+
+
+void CaptureReactor::applyThreadPolicy() {
+    if (sCpuMask != 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (unsigned cpu = 0; cpu < 64; cpu++) {
+            if (sCpuMask & (uint64_t(1) << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            ALOGE("Failed to set capture thread affinity to 0x%llx (%s)",
+                  (unsigned long long)sCpuMask, strerror(errno));
+        }
+    }
+
+    if (sFifoPriority > 0) {
+        sched_param param = {};
+        param.sched_priority = sFifoPriority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+            ALOGE("Failed to set SCHED_FIFO priority %d on capture thread (%s)",
+                  sFifoPriority, strerror(errno));
+        }
+    }
+}
+
+
+CaptureReactor::CaptureReactor(unsigned threadCount) {
+    mRunning = true;
+    for (unsigned i = 0; i < threadCount; i++) {
+        std::unique_ptr<Loop> loop(new Loop());
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        loop->wakeFd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (loop->epollFd < 0 || loop->wakeFd < 0) {
+            ALOGE("Failed to create capture loop %u (%s)", i, strerror(errno));
+            continue;
+        }
+
+        // A null data pointer marks our wake up event
+        epoll_event event = {};
+        event.events   = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event);
+
+        mLoops.emplace_back(std::move(loop));
+    }
+
+    for (unsigned i = 0; i < mLoops.size(); i++) {
+        mLoops[i]->thread = std::thread([this, i](){ runLoop(i); });
+    }
+
+    ALOGI("Capture reactor running %zu loop(s), priority %d, cpu mask 0x%llx",
+          mLoops.size(), sFifoPriority, (unsigned long long)sCpuMask);
+}
+
+
+CaptureReactor::~CaptureReactor() {
+    mRunning = false;
+    for (auto&& loop : mLoops) {
+        uint64_t one = 1;
+        if (write(loop->wakeFd, &one, sizeof(one)) < 0) {
+            ALOGE("Failed to wake capture loop (%s)", strerror(errno));
+        }
+    }
+    for (auto&& loop : mLoops) {
+        if (loop->thread.joinable()) {
+            loop->thread.join();
+        }
+        close(loop->epollFd);
+        close(loop->wakeFd);
+    }
+}
+
+
+bool CaptureReactor::add(VideoCapture* capture) {
+    if (mLoops.empty()) {
+        return false;
+    }
+
+    // Put the device on whichever loop has the fewest devices already
+    unsigned best = 0;
+    size_t bestCount = SIZE_MAX;
+    for (unsigned i = 0; i < mLoops.size(); i++) {
+        std::lock_guard<std::mutex> lock(mLoops[i]->dispatchLock);
+        if (mLoops[i]->captures.size() < bestCount) {
+            bestCount = mLoops[i]->captures.size();
+            best = i;
+        }
+    }
+
+    Loop& loop = *mLoops[best];
+    std::lock_guard<std::mutex> lock(loop.dispatchLock);
+    capture->mReactorLoop = best;
+    loop.captures.insert(capture);
+
+    epoll_event event = {};
+    event.events   = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = capture;
+    if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, capture->mDeviceFd, &event) != 0) {
+        ALOGE("Failed to add capture device to loop %u (%s)", best, strerror(errno));
+        loop.captures.erase(capture);
+        capture->mReactorLoop = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+void CaptureReactor::remove(VideoCapture* capture) {
+    if (capture->mReactorLoop < 0 || capture->mReactorLoop >= (int)mLoops.size()) {
+        return;
+    }
+
+    // Once we hold the dispatch lock the loop isn't in the middle of a callback to this capture,
+    // and dropping it from our set keeps any event already collected from reaching it.
+    Loop& loop = *mLoops[capture->mReactorLoop];
+    std::lock_guard<std::mutex> lock(loop.dispatchLock);
+    epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, capture->mDeviceFd, nullptr);
+    loop.captures.erase(capture);
+    capture->mReactorLoop = -1;
+}
+
+
+void CaptureReactor::rearm(VideoCapture* capture) {
+    // This races with remove() by design -- a frame returned while the stream is stopping
+    // simply finds the device is no longer on the loop.
+    const int index = capture->mReactorLoop;
+    if (index < 0 || index >= (int)mLoops.size()) {
+        return;
+    }
+
+    epoll_event event = {};
+    event.events   = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = capture;
+    if (epoll_ctl(mLoops[index]->epollFd, EPOLL_CTL_MOD, capture->mDeviceFd, &event) != 0 &&
+        errno != ENOENT) {
+        ALOGE("Failed to rearm capture device on loop %d (%s)", index, strerror(errno));
+    }
+}
+
+
+// Each loop runs on its own thread to dequeue and dispatch frames for the devices assigned to it
+void CaptureReactor::runLoop(unsigned index) {
+    char name[16];
+    snprintf(name, sizeof(name), "evs_capture%u", index);
+    pthread_setname_np(pthread_self(), name);
+    applyThreadPolicy();
+
+    Loop& loop = *mLoops[index];
+    epoll_event events[kMaxEvents];
+    while (mRunning) {
+        int count = epoll_wait(loop.epollFd, events, kMaxEvents, -1);
+        if (count < 0) {
+            if (errno != EINTR) {
+                ALOGE("Capture loop %u wait failed (%s)", index, strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(loop.dispatchLock);
+        for (int i = 0; i < count; i++) {
+            VideoCapture* capture = static_cast<VideoCapture*>(events[i].data.ptr);
+            if (capture == nullptr) {
+                // Our wake up event; mRunning tells us whether to keep going
+                continue;
+            }
+            if (loop.captures.count(capture) == 0) {
+                // Removed after this event was collected
+                continue;
+            }
+            if (!capture->dispatchFrame()) {
+                // Nothing was there after all, so keep waiting on this device
+                rearm(capture);
+            }
+        }
+    }
+
+    ALOGD("Capture loop %u ending", index);
+}
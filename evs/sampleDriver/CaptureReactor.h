@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_CAPTUREREACTOR_H
+#define ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_CAPTUREREACTOR_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+
+class VideoCapture;
+
+
+// Services every streaming VideoCapture from a small, fixed set of epoll loops rather than
+// a thread per device, so a multi-camera system doesn't have one unpinned capture thread per
+// camera competing with rendering.  Devices are armed one shot at a time:  a loop dequeues a
+// frame when its device becomes readable and doesn't watch that device again until the frame
+// has been given back to the driver.
+class CaptureReactor {
+public:
+    // Must be called before the first stream starts.  A thread count of zero keeps the
+    // original behavior of a dedicated capture thread per device.  A priority above zero runs
+    // the capture threads as SCHED_FIFO at that priority, and a non-zero mask pins them to
+    // those CPUs.  Both also apply to dedicated capture threads.
+    static void configure(unsigned threadCount, int fifoPriority, uint64_t cpuMask);
+
+    // Returns nullptr when we're configured for a thread per device
+    static CaptureReactor* get();
+
+    // Applies the configured scheduling policy and affinity to the calling thread
+    static void applyThreadPolicy();
+
+    ~CaptureReactor();
+
+    // The capture must already be streaming.  After remove() returns, no loop is dispatching
+    // to the capture nor will it again.
+    bool add(VideoCapture* capture);
+    void remove(VideoCapture* capture);
+
+    // Watch the capture's device for its next frame again
+    void rearm(VideoCapture* capture);
+
+private:
+    struct Loop {
+        int                             epollFd = -1;
+        int                             wakeFd  = -1;
+        std::thread                     thread;
+        std::mutex                      dispatchLock;   // Held while dispatching events
+        std::unordered_set<VideoCapture*>
+                                        captures;       // Protected by dispatchLock
+    };
+
+    explicit CaptureReactor(unsigned threadCount);
+    void runLoop(unsigned index);
+
+    std::vector<std::unique_ptr<Loop>>  mLoops;
+    std::atomic<bool>                   mRunning;
+
+    static unsigned                     sThreadCount;
+    static int                          sFifoPriority;
+    static uint64_t                     sCpuMask;
+};
+
+#endif // ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_CAPTUREREACTOR_H
@@ -18,6 +18,7 @@
 #include "EvsV4lCamera.h"
 #include "EvsGlDisplay.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <hardware_legacy/uevent.h>
 #include <hwbinder/IPCThreadState.h>
@@ -41,6 +42,11 @@ std::unordered_map<std::string, EvsEnumerator::CameraRecord> EvsEnumerator::sCam
 wp<EvsGlDisplay>                                             EvsEnumerator::sActiveDisplay;
 std::mutex                                                   EvsEnumerator::sLock;
 std::condition_variable                                      EvsEnumerator::sCameraSignal;
+size_t                                                       EvsEnumerator::sBufferBudget = 0;
+size_t                                                       EvsEnumerator::sBufferBytes = 0;
+size_t                                                       EvsEnumerator::sBufferPeakBytes = 0;
+std::unordered_map<std::string, EvsEnumerator::BufferUsage>  EvsEnumerator::sBufferUsage;
+std::mutex                                                   EvsEnumerator::sBufferLock;
 
 // Constants
 const auto kEnumerationTimeout = 10s;
@@ -332,6 +338,73 @@ Return<DisplayState> EvsEnumerator::getDisplayState()  {
 }
 
 
+// Methods from ::android::hidl::base::V1_0::IBase follow.
+Return<void> EvsEnumerator::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /*options*/) {
+    if (fd.getNativeHandle() == nullptr || fd->numFds < 1) {
+        ALOGE("Ignoring debug request without a file descriptor");
+        return Void();
+    }
+    const int outFd = fd->data[0];
+
+    std::lock_guard<std::mutex> lock(sBufferLock);
+
+    if (sBufferBudget > 0) {
+        dprintf(outFd, "EVS driver buffer memory: %zu of %zu KB in use, peak %zu KB\n",
+                sBufferBytes / 1024, sBufferBudget / 1024, sBufferPeakBytes / 1024);
+    } else {
+        dprintf(outFd, "EVS driver buffer memory: %zu KB in use, peak %zu KB, no budget\n",
+                sBufferBytes / 1024, sBufferPeakBytes / 1024);
+    }
+    for (const auto& [cameraId, usage] : sBufferUsage) {
+        dprintf(outFd, "  %s: %zu KB in use, peak %zu KB, %u refused\n",
+                cameraId.c_str(), usage.bytes / 1024, usage.peakBytes / 1024, usage.refusals);
+    }
+
+    return Void();
+}
+
+
+void EvsEnumerator::setBufferBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(sBufferLock);
+    sBufferBudget = bytes;
+}
+
+
+bool EvsEnumerator::reserveBufferMemory(const std::string& cameraId, size_t bytes) {
+    std::lock_guard<std::mutex> lock(sBufferLock);
+
+    BufferUsage& usage = sBufferUsage[cameraId];
+    if (sBufferBudget > 0 && sBufferBytes + bytes > sBufferBudget) {
+        usage.refusals++;
+        ALOGW("Buffer budget exhausted: %s wants %zu KB more, holds %zu KB, "
+              "%zu of %zu KB in use across all cameras",
+              cameraId.c_str(), bytes / 1024, usage.bytes / 1024,
+              sBufferBytes / 1024, sBufferBudget / 1024);
+        return false;
+    }
+
+    usage.bytes += bytes;
+    usage.peakBytes = std::max(usage.peakBytes, usage.bytes);
+    sBufferBytes += bytes;
+    sBufferPeakBytes = std::max(sBufferPeakBytes, sBufferBytes);
+    return true;
+}
+
+
+void EvsEnumerator::releaseBufferMemory(const std::string& cameraId, size_t bytes) {
+    std::lock_guard<std::mutex> lock(sBufferLock);
+
+    auto found = sBufferUsage.find(cameraId);
+    if (found == sBufferUsage.end() || found->second.bytes < bytes) {
+        ALOGE("Releasing %zu bytes of buffer memory %s never reserved", bytes, cameraId.c_str());
+        return;
+    }
+
+    found->second.bytes -= bytes;
+    sBufferBytes -= bytes;
+}
+
+
 bool EvsEnumerator::qualifyCaptureDevice(const char* deviceName) {
     class FileHandleWrapper {
     public:
@@ -23,6 +23,7 @@
 #include <unordered_map>
 #include <thread>
 #include <atomic>
+#include <mutex>
 
 namespace android {
 namespace hardware {
@@ -45,12 +46,21 @@ public:
     Return<void> closeDisplay(const ::android::sp<IEvsDisplay>& display)  override;
     Return<DisplayState> getDisplayState()  override;
 
+    // Methods from ::android::hidl::base::V1_0::IBase follow.
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
+
     // Implementation details
     EvsEnumerator();
 
     // Listen to video device uevents
     static void EvsUeventThread(std::atomic<bool>& running);
 
+    // All our cameras draw their graphics buffers from one memory budget so that no single
+    // client can exhaust memory for the others.  A budget of zero means no limit.
+    static void setBufferBudget(size_t bytes);
+    static bool reserveBufferMemory(const std::string& cameraId, size_t bytes);
+    static void releaseBufferMemory(const std::string& cameraId, size_t bytes);
+
 private:
     struct CameraRecord {
         CameraDesc          desc;
@@ -79,6 +89,18 @@ private:
 
     static std::mutex                       sLock;          // Mutex on shared camera device list.
     static std::condition_variable          sCameraSignal;  // Signal on camera device addition.
+
+    struct BufferUsage {
+        size_t      bytes       = 0;
+        size_t      peakBytes   = 0;
+        unsigned    refusals    = 0;    // Reservations turned down for lack of budget
+    };
+    static size_t                           sBufferBudget;
+    static size_t                           sBufferBytes;   // Reserved across all cameras
+    static size_t                           sBufferPeakBytes;
+    static std::unordered_map<std::string,
+                              BufferUsage>  sBufferUsage;   // Keyed by camera id
+    static std::mutex                       sBufferLock;    // Protects the buffer budget state
 };
 
 } // namespace implementation
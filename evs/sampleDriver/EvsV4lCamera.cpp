@@ -21,6 +21,8 @@
 #include <ui/GraphicBufferAllocator.h>
 #include <ui/GraphicBufferMapper.h>
 
+#include <chrono>
+
 
 namespace android {
 namespace hardware {
@@ -34,6 +36,39 @@ namespace implementation {
 // Safeguards against unreasonable resource consumption and provides a testable limit
 static const unsigned MAX_BUFFERS_IN_FLIGHT = 100;
 
+// The EVS manager's extended info identifier for a client's output pixel format, which it
+// forwards to us when a single client could use our output without further conversion.
+// Zero selects our default of RGBA.
+static const uint32_t kExtInfoOutputFormat = 0x45564D03;
+
+
+// Picks the function that moves camera imagery of the given V4L2 format into output buffers
+// of the given HAL format, or returns nullptr if we can't do that conversion.
+static void (*selectFillFunction(uint32_t halFormat, uint32_t v4lFormat))
+        (const BufferDesc&, uint8_t*, void*, unsigned) {
+    switch (halFormat) {
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP:
+        switch (v4lFormat) {
+        case V4L2_PIX_FMT_NV21:     return fillNV21FromNV21;
+        case V4L2_PIX_FMT_YUYV:     return fillNV21FromYUYV;
+        }
+        break;
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+        switch (v4lFormat) {
+        case V4L2_PIX_FMT_YUYV:     return fillRGBAFromYUYV;
+        }
+        break;
+    case HAL_PIXEL_FORMAT_YCBCR_422_I:
+        switch (v4lFormat) {
+        case V4L2_PIX_FMT_YUYV:     return fillYUYVFromYUYV;
+        case V4L2_PIX_FMT_UYVY:     return fillYUYVFromUYVY;
+        }
+        break;
+    }
+
+    return nullptr;
+}
+
 
 EvsV4lCamera::EvsV4lCamera(const char *deviceName) :
         mFramesAllowed(0),
@@ -47,14 +82,18 @@ EvsV4lCamera::EvsV4lCamera(const char *deviceName) :
         ALOGE("Failed to open v4l device %s\n", deviceName);
     }
 
-    // Output buffer format.
-    // TODO: Does this need to be configurable?
+    // Output buffer format, unless a client asks for another with setExtendedInfo()
     mFormat = HAL_PIXEL_FORMAT_RGBA_8888;
 
     // How we expect to use the gralloc buffers we'll exchange with our client
     mUsage  = GRALLOC_USAGE_HW_TEXTURE     |
               GRALLOC_USAGE_SW_READ_RARELY |
               GRALLOC_USAGE_SW_WRITE_OFTEN;
+
+    // The GPU conversion backend renders into these buffers when it can
+    if (GpuConverter::isEnabled()) {
+        mUsage |= GRALLOC_USAGE_HW_RENDER;
+    }
 }
 
 
@@ -92,6 +131,12 @@ void EvsV4lCamera::shutdown()
         }
         mBuffers.clear();
     }
+
+    // Give back everything we were holding against the shared buffer budget
+    if (mBufferBytes > 0) {
+        EvsEnumerator::releaseBufferMemory(mDescription.cameraId, mBufferBytes);
+        mBufferBytes = 0;
+    }
 }
 
 
@@ -158,40 +203,28 @@ Return<EvsResult> EvsV4lCamera::startVideoStream(const ::android::sp<IEvsCameraS
     ALOGI("Configuring to accept %4.4s camera data and convert to 0x%X",
           (char*)&videoSrcFormat, mFormat);
 
-    switch (mFormat) {
-    case HAL_PIXEL_FORMAT_YCRCB_420_SP:
-        switch (videoSrcFormat) {
-        case V4L2_PIX_FMT_NV21:     mFillBufferFromVideo = fillNV21FromNV21;    break;
-        case V4L2_PIX_FMT_YUYV:     mFillBufferFromVideo = fillNV21FromYUYV;    break;
-        default:
-            ALOGE("Unhandled camera output format %c%c%c%c (0x%8X)\n",
-                  ((char*)&videoSrcFormat)[0],
-                  ((char*)&videoSrcFormat)[1],
-                  ((char*)&videoSrcFormat)[2],
-                  ((char*)&videoSrcFormat)[3],
-                  videoSrcFormat);
-        }
-        break;
-    case HAL_PIXEL_FORMAT_RGBA_8888:
-        switch (videoSrcFormat) {
-        case V4L2_PIX_FMT_YUYV:     mFillBufferFromVideo = fillRGBAFromYUYV;    break;
-        default:
-            ALOGE("Unhandled camera format %4.4s", (char*)&videoSrcFormat);
-        }
-        break;
-    case HAL_PIXEL_FORMAT_YCBCR_422_I:
-        switch (videoSrcFormat) {
-        case V4L2_PIX_FMT_YUYV:     mFillBufferFromVideo = fillYUYVFromYUYV;    break;
-        case V4L2_PIX_FMT_UYVY:     mFillBufferFromVideo = fillYUYVFromUYVY;    break;
-        default:
-            ALOGE("Unhandled camera format %4.4s", (char*)&videoSrcFormat);
-        }
-        break;
-    default:
-        ALOGE("Unhandled output format %4.4s", (char*)&mFormat);
+    mFillBufferFromVideo = selectFillFunction(mFormat, videoSrcFormat);
+    if (mFillBufferFromVideo == nullptr) {
+        ALOGE("Unhandled conversion from camera format %c%c%c%c (0x%8X) to 0x%X",
+              ((char*)&videoSrcFormat)[0],
+              ((char*)&videoSrcFormat)[1],
+              ((char*)&videoSrcFormat)[2],
+              ((char*)&videoSrcFormat)[3],
+              videoSrcFormat, mFormat);
     }
 
 
+    // Hand the conversion to the GPU if we've been asked to and it can do this one
+    mGpuTiming = {};
+    mCpuTiming = {};
+    if (GpuConverter::isEnabled() && GpuConverter::isSupported(videoSrcFormat, mFormat)) {
+        mGpuConverter.reset(new GpuConverter());
+        if (!mGpuConverter->initialize()) {
+            ALOGW("GPU conversion unavailable, converting on the CPU");
+            mGpuConverter.reset();
+        }
+    }
+
     // Record the user's callback for use when we have a frame ready
     mStream = stream;
 
@@ -201,6 +234,7 @@ Return<EvsResult> EvsV4lCamera::startVideoStream(const ::android::sp<IEvsCameraS
                             })
     ) {
         mStream = nullptr;  // No need to hold onto this if we failed to start
+        mGpuConverter.reset();
         ALOGE("underlying camera start stream failed");
         return EvsResult::UNDERLYING_SERVICE_ERROR;
     }
@@ -217,27 +251,28 @@ Return<void> EvsV4lCamera::doneWithFrame(const BufferDesc& buffer)  {
     if (!mVideo.isOpen()) {
         ALOGW("ignoring doneWithFrame call when camera has been lost.");
     } else {
+        const int idx = findBuffer_Locked(buffer.bufferId);
         if (buffer.memHandle == nullptr) {
             ALOGE("ignoring doneWithFrame called with null handle");
-        } else if (buffer.bufferId >= mBuffers.size()) {
-            ALOGE("ignoring doneWithFrame called with invalid bufferId %d (max is %zu)",
-                  buffer.bufferId, mBuffers.size()-1);
-        } else if (!mBuffers[buffer.bufferId].inUse) {
+        } else if (idx < 0) {
+            ALOGE("ignoring doneWithFrame called with unknown bufferId %d", buffer.bufferId);
+        } else if (!mBuffers[idx].inUse) {
             ALOGE("ignoring doneWithFrame called on frame %d which is already free",
                   buffer.bufferId);
         } else {
             // Mark the frame as available
-            mBuffers[buffer.bufferId].inUse = false;
+            mBuffers[idx].inUse = false;
             mFramesInUse--;
 
             // If this frame's index is high in the array, try to move it down
             // to improve locality after mFramesAllowed has been reduced.
-            if (buffer.bufferId >= mFramesAllowed) {
+            if (static_cast<unsigned>(idx) >= mFramesAllowed) {
                 // Find an empty slot lower in the array (which should always exist in this case)
                 for (auto&& rec : mBuffers) {
                     if (rec.handle == nullptr) {
-                        rec.handle = mBuffers[buffer.bufferId].handle;
-                        mBuffers[buffer.bufferId].handle = nullptr;
+                        rec.handle = mBuffers[idx].handle;
+                        rec.id = mBuffers[idx].id;
+                        mBuffers[idx].handle = nullptr;
                         break;
                     }
                 }
@@ -255,6 +290,10 @@ Return<void> EvsV4lCamera::stopVideoStream()  {
     // Tell the capture device to stop (and block until it does)
     mVideo.stopStream();
 
+    // No more frames will be converted until the next stream picks its backend
+    reportConversionTiming();
+    mGpuConverter.reset();
+
     if (mStream != nullptr) {
         std::unique_lock <std::mutex> lock(mAccessLock);
 
@@ -273,15 +312,20 @@ Return<void> EvsV4lCamera::stopVideoStream()  {
 }
 
 
-Return<int32_t> EvsV4lCamera::getExtendedInfo(uint32_t /*opaqueIdentifier*/)  {
+Return<int32_t> EvsV4lCamera::getExtendedInfo(uint32_t opaqueIdentifier)  {
     ALOGD("getExtendedInfo");
+    if (opaqueIdentifier == kExtInfoOutputFormat) {
+        // Never zero, which tells the manager it may ask us for another format
+        return mFormat;
+    }
+
     // Return zero by default as required by the spec
     return 0;
 }
 
 
-Return<EvsResult> EvsV4lCamera::setExtendedInfo(uint32_t /*opaqueIdentifier*/,
-                                                int32_t /*opaqueValue*/)  {
+Return<EvsResult> EvsV4lCamera::setExtendedInfo(uint32_t opaqueIdentifier,
+                                                int32_t opaqueValue)  {
     ALOGD("setExtendedInfo");
     std::lock_guard<std::mutex> lock(mAccessLock);
 
@@ -291,11 +335,61 @@ Return<EvsResult> EvsV4lCamera::setExtendedInfo(uint32_t /*opaqueIdentifier*/,
         return EvsResult::OWNERSHIP_LOST;
     }
 
-    // We don't store any device specific information in this implementation
+    if (opaqueIdentifier == kExtInfoOutputFormat) {
+        return setOutputFormat_Locked(opaqueValue ? opaqueValue : HAL_PIXEL_FORMAT_RGBA_8888);
+    }
+
+    // We don't store any other device specific information in this implementation
     return EvsResult::INVALID_ARG;
 }
 
 
+EvsResult EvsV4lCamera::setOutputFormat_Locked(uint32_t format) {
+    if (mStream != nullptr) {
+        ALOGE("Output format may only be changed while the stream is stopped");
+        return EvsResult::STREAM_ALREADY_RUNNING;
+    }
+    if (selectFillFunction(format, mVideo.getV4LFormat()) == nullptr) {
+        ALOGE("Can't produce output format 0x%X from this camera", format);
+        return EvsResult::INVALID_ARG;
+    }
+    if (format == mFormat) {
+        return EvsResult::OK;
+    }
+    if (mFramesInUse > 0) {
+        ALOGE("Can't change output format while %u frames are outstanding", mFramesInUse);
+        return EvsResult::BUFFER_NOT_AVAILABLE;
+    }
+
+    // Replace our buffers with the same number in the new format
+    const unsigned bufferCount = mFramesAllowed;
+    const uint32_t oldFormat = mFormat;
+    decreaseAvailableFrames_Locked(mFramesAllowed);
+    mFormat = format;
+    mStride = 0;
+    if (bufferCount > 0 && !setAvailableFrames_Locked(bufferCount)) {
+        ALOGE("Couldn't allocate buffers in output format 0x%X, keeping 0x%X", format, oldFormat);
+        mFormat = oldFormat;
+        mStride = 0;
+        setAvailableFrames_Locked(bufferCount);
+        return EvsResult::BUFFER_NOT_AVAILABLE;
+    }
+
+    ALOGI("Output format changed from 0x%X to 0x%X", oldFormat, format);
+    return EvsResult::OK;
+}
+
+
+int EvsV4lCamera::findBuffer_Locked(uint32_t bufferId) {
+    for (unsigned idx = 0; idx < mBuffers.size(); idx++) {
+        if (mBuffers[idx].handle != nullptr && mBuffers[idx].id == bufferId) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+
 bool EvsV4lCamera::setAvailableFrames_Locked(unsigned bufferCount) {
     if (bufferCount < 1) {
         ALOGE("Ignoring request to set buffer count to zero");
@@ -344,7 +438,19 @@ unsigned EvsV4lCamera::increaseAvailableFrames_Locked(unsigned numToAdd) {
     unsigned added = 0;
 
 
+    // Every buffer we hold is charged at the same rate until we've released them all
+    if (mBufferBytes == 0) {
+        mBytesPerBuffer = bytesPerBuffer();
+    }
+
     while (added < numToAdd) {
+        if (!EvsEnumerator::reserveBufferMemory(mDescription.cameraId, mBytesPerBuffer)) {
+            ALOGE("No buffer budget left for another %d x %d graphics buffer",
+                  mVideo.getWidth(),
+                  mVideo.getHeight());
+            break;
+        }
+
         unsigned pixelsPerLine;
         buffer_handle_t memHandle = nullptr;
         status_t result = alloc.allocate(mVideo.getWidth(), mVideo.getHeight(),
@@ -356,12 +462,15 @@ unsigned EvsV4lCamera::increaseAvailableFrames_Locked(unsigned numToAdd) {
                   result,
                   mVideo.getWidth(),
                   mVideo.getHeight());
+            EvsEnumerator::releaseBufferMemory(mDescription.cameraId, mBytesPerBuffer);
             break;
         }
         if (!memHandle) {
             ALOGE("We didn't get a buffer handle back from the allocator");
+            EvsEnumerator::releaseBufferMemory(mDescription.cameraId, mBytesPerBuffer);
             break;
         }
+        mBufferBytes += mBytesPerBuffer;
         if (mStride) {
             if (mStride != pixelsPerLine) {
                 ALOGE("We did not expect to get buffers with different strides!");
@@ -371,20 +480,23 @@ unsigned EvsV4lCamera::increaseAvailableFrames_Locked(unsigned numToAdd) {
             mStride = pixelsPerLine;
         }
 
-        // Find a place to store the new buffer
+        // Find a place to store the new buffer.  Each allocation gets an id of its own, so our
+        // clients can tell it from whatever buffer last had its place.
+        const uint32_t id = mNextBufferId++;
         bool stored = false;
         for (auto&& rec : mBuffers) {
             if (rec.handle == nullptr) {
                 // Use this existing entry
                 rec.handle = memHandle;
                 rec.inUse = false;
+                rec.id = id;
                 stored = true;
                 break;
             }
         }
         if (!stored) {
             // Add a BufferRecord wrapping this handle to our set of available buffers
-            mBuffers.emplace_back(memHandle);
+            mBuffers.emplace_back(memHandle, id);
         }
 
         mFramesAllowed++;
@@ -401,12 +513,19 @@ unsigned EvsV4lCamera::decreaseAvailableFrames_Locked(unsigned numToRemove) {
 
     unsigned removed = 0;
 
+    // The GPU mustn't keep images of buffers we're about to free
+    if (mGpuConverter) {
+        mGpuConverter->forgetTargets();
+    }
+
     for (auto&& rec : mBuffers) {
         // Is this record not in use, but holding a buffer that we can free?
         if ((rec.inUse == false) && (rec.handle != nullptr)) {
             // Release buffer and update the record so we can recognize it as "empty"
             alloc.free(rec.handle);
             rec.handle = nullptr;
+            EvsEnumerator::releaseBufferMemory(mDescription.cameraId, mBytesPerBuffer);
+            mBufferBytes -= mBytesPerBuffer;
 
             mFramesAllowed--;
             removed++;
@@ -421,6 +540,57 @@ unsigned EvsV4lCamera::decreaseAvailableFrames_Locked(unsigned numToRemove) {
 }
 
 
+// What we charge against the shared buffer budget for each of our graphics buffers.  Padding
+// the allocator adds at the end of each row isn't counted.
+size_t EvsV4lCamera::bytesPerBuffer() {
+    const size_t pixels = size_t(mVideo.getWidth()) * mVideo.getHeight();
+    switch (mFormat) {
+    case HAL_PIXEL_FORMAT_YCRCB_420_SP:     return pixels * 3 / 2;
+    case HAL_PIXEL_FORMAT_YCBCR_422_I:      return pixels * 2;
+    default:                                return pixels * 4;
+    }
+}
+
+
+// Converts a camera frame into the given output buffer with mFillBufferFromVideo
+bool EvsV4lCamera::fillOnCpu(const BufferDesc& buff, void* pData) {
+    // Lock our output buffer for writing
+    void *targetPixels = nullptr;
+    GraphicBufferMapper &mapper = GraphicBufferMapper::get();
+    mapper.lock(buff.memHandle,
+                GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_NEVER,
+                android::Rect(buff.width, buff.height),
+                (void **) &targetPixels);
+
+    // If we failed to lock the pixel buffer, we're about to crash, but log it first
+    if (!targetPixels) {
+        ALOGE("Camera failed to gain access to image buffer for writing");
+    }
+
+    mFillBufferFromVideo(buff, (uint8_t*)targetPixels, pData, mVideo.getStride());
+
+    // Unlock the output buffer
+    mapper.unlock(buff.memHandle);
+    return targetPixels != nullptr;
+}
+
+
+void EvsV4lCamera::reportConversionTiming() {
+    if (mGpuTiming.frames > 0) {
+        ALOGI("%s converted %u frames on the GPU: mean %lld us, max %lld us",
+              mDescription.cameraId.c_str(), mGpuTiming.frames,
+              (long long)(mGpuTiming.totalUs / mGpuTiming.frames),
+              (long long)mGpuTiming.maxUs);
+    }
+    if (mCpuTiming.frames > 0) {
+        ALOGI("%s converted %u frames on the CPU: mean %lld us, max %lld us",
+              mDescription.cameraId.c_str(), mCpuTiming.frames,
+              (long long)(mCpuTiming.totalUs / mCpuTiming.frames),
+              (long long)mCpuTiming.maxUs);
+    }
+}
+
+
 // This is the async callback from the video camera that tells us a frame is ready
 void EvsV4lCamera::forwardFrame(imageBuffer* /*pV4lBuff*/, void* pData) {
     bool readyForFrame = false;
@@ -467,28 +637,42 @@ void EvsV4lCamera::forwardFrame(imageBuffer* /*pV4lBuff*/, void* pData) {
         buff.stride     = mStride;
         buff.format     = mFormat;
         buff.usage      = mUsage;
-        buff.bufferId   = idx;
+        buff.bufferId   = mBuffers[idx].id;
         buff.memHandle  = mBuffers[idx].handle;
 
-        // Lock our output buffer for writing
-        void *targetPixels = nullptr;
-        GraphicBufferMapper &mapper = GraphicBufferMapper::get();
-        mapper.lock(buff.memHandle,
-                    GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_NEVER,
-                    android::Rect(buff.width, buff.height),
-                    (void **) &targetPixels);
-
-        // If we failed to lock the pixel buffer, we're about to crash, but log it first
-        if (!targetPixels) {
-            ALOGE("Camera failed to gain access to image buffer for writing");
-        }
-
         // Transfer the video image into the output buffer, making any needed
         // format conversion along the way
-        mFillBufferFromVideo(buff, (uint8_t*)targetPixels, pData, mVideo.getStride());
+        using namespace std::chrono;
+        bool converted = false;
+        if (mGpuConverter) {
+            // Benchmark the first frame of the stream on the CPU too, which the GPU overwrites
+            int64_t cpuUs = -1;
+            if (mGpuTiming.frames == 0) {
+                const auto cpuStart = steady_clock::now();
+                fillOnCpu(buff, pData);
+                cpuUs = duration_cast<microseconds>(steady_clock::now() - cpuStart).count();
+            }
 
-        // Unlock the output buffer
-        mapper.unlock(buff.memHandle);
+            const auto gpuStart = steady_clock::now();
+            converted = mGpuConverter->convert(buff, pData, mVideo.getStride(),
+                                               mVideo.getDmaBufFd());
+            const int64_t gpuUs =
+                    duration_cast<microseconds>(steady_clock::now() - gpuStart).count();
+            if (converted) {
+                if (cpuUs >= 0) {
+                    ALOGI("First %u x %u frame converted in %lld us on the GPU, "
+                          "%lld us on the CPU", buff.width, buff.height,
+                          (long long)gpuUs, (long long)cpuUs);
+                }
+                mGpuTiming.record(gpuUs);
+            }
+        }
+        if (!converted) {
+            const auto cpuStart = steady_clock::now();
+            fillOnCpu(buff, pData);
+            mCpuTiming.record(
+                    duration_cast<microseconds>(steady_clock::now() - cpuStart).count());
+        }
 
 
         // Give the video frame back to the underlying device for reuse
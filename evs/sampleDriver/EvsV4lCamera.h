@@ -23,8 +23,11 @@
 
 #include <thread>
 #include <functional>
+#include <memory>
+#include <algorithm>
 
 #include "VideoCapture.h"
+#include "GpuConverter.h"
 
 
 namespace android {
@@ -58,12 +61,16 @@ public:
     const CameraDesc& getDesc() { return mDescription; };
 
 private:
-    // These three functions are expected to be called while mAccessLock is held
+    // These functions are expected to be called while mAccessLock is held
     bool setAvailableFrames_Locked(unsigned bufferCount);
     unsigned increaseAvailableFrames_Locked(unsigned numToAdd);
     unsigned decreaseAvailableFrames_Locked(unsigned numToRemove);
+    EvsResult setOutputFormat_Locked(uint32_t format);
 
     void forwardFrame(imageBuffer* tgt, void* data);
+    bool fillOnCpu(const BufferDesc& buff, void* data);
+    void reportConversionTiming();
+    size_t bytesPerBuffer();
 
     sp <IEvsCameraStream> mStream = nullptr;  // The callback used to deliver each frame
 
@@ -77,18 +84,41 @@ private:
     struct BufferRecord {
         buffer_handle_t handle;
         bool inUse;
+        uint32_t id;        // Our clients' name for this allocation, never reused
 
-        explicit BufferRecord(buffer_handle_t h) : handle(h), inUse(false) {};
+        BufferRecord(buffer_handle_t h, uint32_t i) : handle(h), inUse(false), id(i) {};
     };
+    int findBuffer_Locked(uint32_t bufferId);
 
     std::vector <BufferRecord> mBuffers;    // Graphics buffers to transfer images
+    uint32_t mNextBufferId = 0;             // Given to the next buffer we allocate
     unsigned mFramesAllowed;                // How many buffers are we currently using
     unsigned mFramesInUse;                  // How many buffers are currently outstanding
+    size_t mBufferBytes = 0;                // What our buffers hold against the shared budget
+    size_t mBytesPerBuffer = 0;             // Charged for each buffer we hold
 
     // Which format specific function we need to use to move camera imagery into our output buffers
     void(*mFillBufferFromVideo)(const BufferDesc& tgtBuff, uint8_t* tgt,
                                 void* imgData, unsigned imgStride);
 
+    // Set at stream start when the GPU takes over conversion from mFillBufferFromVideo
+    std::unique_ptr<GpuConverter> mGpuConverter;
+
+    // How long our frame conversions take, so the two backends can be compared
+    struct ConversionTiming {
+        unsigned    frames  = 0;
+        int64_t     totalUs = 0;
+        int64_t     maxUs   = 0;
+
+        void record(int64_t us) {
+            frames++;
+            totalUs += us;
+            maxUs = std::max(maxUs, us);
+        }
+    };
+    ConversionTiming mGpuTiming;
+    ConversionTiming mCpuTiming;
+
     // Synchronization necessary to deconflict the capture thread from the main service thread
     // Note that the service interface remains single threaded (ie: not reentrant)
     std::mutex mAccessLock;
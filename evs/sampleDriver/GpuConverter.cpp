@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "GpuConverter.h"
+
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include <ui/GraphicBuffer.h>
+#include <ui/GraphicBufferMapper.h>
+#include <utils/Log.h>
+
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace evs {
+namespace V1_0 {
+namespace implementation {
+
+
+bool GpuConverter::sEnabled = false;
+
+// DRM_FORMAT_ABGR8888 ('AB24'), whose bytes are R, G, B, A in memory.  We read each YUYV pixel
+// pair through it as one texel, so Y0, U, Y1, V land in r, g, b, a.
+static const EGLint kDrmFormatAbgr8888 = 0x34324241;
+
+
+static const char kVertexShaderSource[] =
+        "#version 300 es                    \n"
+        "layout(location = 0) in vec4 pos;  \n"
+        "void main()                        \n"
+        "{                                  \n"
+        "   gl_Position = pos;              \n"
+        "}                                  \n";
+
+// Uses the same coefficients as yuvToRgbx() in bufferCopy.cpp
+static const char kPixelShaderSource[] =
+        "#version 300 es                                                        \n"
+        "precision highp float;                                                 \n"
+        "precision highp int;                                                   \n"
+        "uniform sampler2D yuyv;                                                \n"
+        "out vec4 color;                                                        \n"
+        "void main()                                                            \n"
+        "{                                                                      \n"
+        "    ivec2 p = ivec2(gl_FragCoord.xy);                                  \n"
+        "    vec4 texel = texelFetch(yuyv, ivec2(p.x / 2, p.y), 0);             \n"
+        "    float Y = ((p.x & 1) == 0) ? texel.r : texel.b;                    \n"
+        "    float U = texel.g - 128.0 / 255.0;                                 \n"
+        "    float V = texel.a - 128.0 / 255.0;                                 \n"
+        "    color = vec4(clamp(Y + 1.140 * V, 0.0, 1.0),                       \n"
+        "                 clamp(Y - 0.395 * U - 0.581 * V, 0.0, 1.0),           \n"
+        "                 clamp(Y + 2.032 * U, 0.0, 1.0),                       \n"
+        "                 1.0);                                                 \n"
+        "}                                                                      \n";
+
+
+static GLuint loadShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    if (shader == 0) {
+        return 0;
+    }
+
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char infoLog[512] = {};
+        glGetShaderInfoLog(shader, sizeof(infoLog), nullptr, infoLog);
+        ALOGE("Error compiling conversion shader:\n%s", infoLog);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+
+bool GpuConverter::isSupported(uint32_t v4lFormat, uint32_t halFormat) {
+    return v4lFormat == V4L2_PIX_FMT_YUYV && halFormat == HAL_PIXEL_FORMAT_RGBA_8888;
+}
+
+
+GpuConverter::~GpuConverter() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mDisplay == EGL_NO_DISPLAY) {
+        return;
+    }
+
+    if (makeCurrent()) {
+        for (auto&& [handle, target] : mTargets) {
+            destroyTarget(target);
+        }
+        mTargets.clear();
+        destroyTarget(mReadbackTarget);
+
+        if (mSourceImage != EGL_NO_IMAGE_KHR) {
+            eglDestroyImageKHR(mDisplay, mSourceImage);
+        }
+        glDeleteTextures(1, &mSourceTexture);
+        glDeleteProgram(mProgram);
+        releaseCurrent();
+    }
+
+    eglDestroySurface(mDisplay, mSurface);
+    eglDestroyContext(mDisplay, mContext);
+}
+
+
+bool GpuConverter::initialize() {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major = 0;
+    EGLint minor = 0;
+    if (mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, &major, &minor)) {
+        ALOGE("GPU conversion can't initialize EGL (0x%X)", eglGetError());
+        mDisplay = EGL_NO_DISPLAY;
+        return false;
+    }
+
+    const char* extensions = eglQueryString(mDisplay, EGL_EXTENSIONS);
+    if (extensions != nullptr) {
+        mCanImportDmabuf = strstr(extensions, "EGL_EXT_image_dma_buf_import") != nullptr;
+        mCanWrapTargets  = strstr(extensions, "EGL_ANDROID_image_native_buffer") != nullptr;
+    }
+
+    // We never show anything, so a tiny pbuffer is all the surface we need
+    const EGLint configAttribs[] = {
+            EGL_SURFACE_TYPE,       EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE,    EGL_OPENGL_ES3_BIT_KHR,
+            EGL_RED_SIZE,           8,
+            EGL_GREEN_SIZE,         8,
+            EGL_BLUE_SIZE,          8,
+            EGL_NONE
+    };
+    EGLConfig config = {};
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(mDisplay, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        ALOGE("GPU conversion found no suitable EGL config");
+        return false;
+    }
+
+    const EGLint surfaceAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    mSurface = eglCreatePbufferSurface(mDisplay, config, surfaceAttribs);
+    const EGLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+    mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if (mSurface == EGL_NO_SURFACE || mContext == EGL_NO_CONTEXT || !makeCurrent()) {
+        ALOGE("GPU conversion can't create its context (0x%X)", eglGetError());
+        return false;
+    }
+
+    GLuint vertexShader = loadShader(GL_VERTEX_SHADER, kVertexShaderSource);
+    GLuint pixelShader  = loadShader(GL_FRAGMENT_SHADER, kPixelShaderSource);
+    if (vertexShader != 0 && pixelShader != 0) {
+        mProgram = glCreateProgram();
+        glAttachShader(mProgram, vertexShader);
+        glAttachShader(mProgram, pixelShader);
+        glLinkProgram(mProgram);
+
+        GLint linked = 0;
+        glGetProgramiv(mProgram, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            ALOGE("Error linking conversion shader");
+            glDeleteProgram(mProgram);
+            mProgram = 0;
+        }
+    }
+    glDeleteShader(vertexShader);
+    glDeleteShader(pixelShader);
+
+    if (mProgram != 0) {
+        glUseProgram(mProgram);
+        glUniform1i(glGetUniformLocation(mProgram, "yuyv"), 0);
+    }
+
+    releaseCurrent();
+
+    ALOGI("GPU conversion initialized on EGL %d.%d, dmabuf import %s, direct render %s",
+          major, minor,
+          mCanImportDmabuf ? "available" : "unavailable",
+          mCanWrapTargets ? "available" : "unavailable");
+    return mProgram != 0;
+}
+
+
+bool GpuConverter::convert(const BufferDesc& tgtBuff, const void* imgData, unsigned imgStride,
+                           int dmabufFd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mProgram == 0 || !makeCurrent()) {
+        return false;
+    }
+
+    bool converted = false;
+    Target* target = findTarget(tgtBuff);
+    if (target == nullptr) {
+        target = readbackTarget(tgtBuff);
+    }
+    if (target != nullptr && bindSource(tgtBuff, imgData, imgStride, dmabufFd)) {
+        glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+        glViewport(0, 0, tgtBuff.width, tgtBuff.height);
+        glUseProgram(mProgram);
+        glDisable(GL_BLEND);
+
+        // One quad covering the whole target; the shader works from gl_FragCoord alone
+        static const GLfloat kQuad[] = { -1.0f, -1.0f,   1.0f, -1.0f,
+                                         -1.0f,  1.0f,   1.0f,  1.0f };
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, kQuad);
+        glEnableVertexAttribArray(0);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glDisableVertexAttribArray(0);
+
+        if (target == &mReadbackTarget) {
+            converted = readBack(tgtBuff);
+        } else {
+            // The client may read the buffer as soon as we deliver it
+            glFinish();
+            converted = true;
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    releaseCurrent();
+    return converted;
+}
+
+
+void GpuConverter::forgetTargets() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mTargets.empty() || !makeCurrent()) {
+        return;
+    }
+
+    for (auto&& [handle, target] : mTargets) {
+        destroyTarget(target);
+    }
+    mTargets.clear();
+    releaseCurrent();
+}
+
+
+bool GpuConverter::makeCurrent() {
+    if (!eglMakeCurrent(mDisplay, mSurface, mSurface, mContext)) {
+        ALOGE("GPU conversion can't make its context current (0x%X)", eglGetError());
+        return false;
+    }
+    return true;
+}
+
+
+void GpuConverter::releaseCurrent() {
+    eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+
+bool GpuConverter::bindSource(const BufferDesc& tgtBuff, const void* imgData, unsigned imgStride,
+                              int dmabufFd) {
+    // Each texel holds a pair of pixels
+    const unsigned texWidth = tgtBuff.width / 2;
+    const unsigned texHeight = tgtBuff.height;
+
+    if (mSourceTexture == 0) {
+        glGenTextures(1, &mSourceTexture);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, mSourceTexture);
+
+    // The camera's buffer is the same for the whole stream, so once imported we just sample it
+    if (mCanImportDmabuf && dmabufFd >= 0) {
+        if (mSourceImage != EGL_NO_IMAGE_KHR && dmabufFd == mSourceFd) {
+            return true;
+        }
+        if (mSourceImage != EGL_NO_IMAGE_KHR) {
+            eglDestroyImageKHR(mDisplay, mSourceImage);
+        }
+
+        const EGLint imageAttribs[] = {
+                EGL_WIDTH,                      EGLint(texWidth),
+                EGL_HEIGHT,                     EGLint(texHeight),
+                EGL_LINUX_DRM_FOURCC_EXT,       kDrmFormatAbgr8888,
+                EGL_DMA_BUF_PLANE0_FD_EXT,      dmabufFd,
+                EGL_DMA_BUF_PLANE0_OFFSET_EXT,  0,
+                EGL_DMA_BUF_PLANE0_PITCH_EXT,   EGLint(imgStride),
+                EGL_NONE
+        };
+        mSourceImage = eglCreateImageKHR(mDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT,
+                                         nullptr, imageAttribs);
+        if (mSourceImage != EGL_NO_IMAGE_KHR) {
+            glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, static_cast<GLeglImageOES>(mSourceImage));
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            mSourceFd = dmabufFd;
+            return true;
+        }
+
+        // Don't keep trying; a fresh texture takes the uploads from here on
+        ALOGW("dmabuf import failed (0x%X), uploading camera frames instead", eglGetError());
+        mCanImportDmabuf = false;
+        glDeleteTextures(1, &mSourceTexture);
+        glGenTextures(1, &mSourceTexture);
+        glBindTexture(GL_TEXTURE_2D, mSourceTexture);
+    }
+
+    if (mSourceWidth != texWidth || mSourceHeight != texHeight) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, texWidth, texHeight, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        mSourceWidth = texWidth;
+        mSourceHeight = texHeight;
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, imgStride / 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texWidth, texHeight,
+                    GL_RGBA, GL_UNSIGNED_BYTE, imgData);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    return glGetError() == GL_NO_ERROR;
+}
+
+
+GpuConverter::Target* GpuConverter::findTarget(const BufferDesc& tgtBuff) {
+    if (!mCanWrapTargets) {
+        return nullptr;
+    }
+
+    const native_handle_t* handle = tgtBuff.memHandle.getNativeHandle();
+    auto found = mTargets.find(handle);
+    if (found != mTargets.end()) {
+        return &found->second;
+    }
+
+    // Wrap the client's buffer so we can render into it directly
+    sp<GraphicBuffer> pGfxBuffer = new GraphicBuffer(
+            tgtBuff.width,
+            tgtBuff.height,
+            tgtBuff.format,
+            1,      /* layer count */
+            tgtBuff.usage,
+            tgtBuff.stride,
+            const_cast<native_handle_t*>(handle),
+            false   /* keep ownership */
+    );
+    EGLint imageAttribs[] = { EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE };
+    EGLClientBuffer clientBuffer = static_cast<EGLClientBuffer>(pGfxBuffer->getNativeBuffer());
+
+    Target target;
+    target.image = eglCreateImageKHR(mDisplay, EGL_NO_CONTEXT, EGL_NATIVE_BUFFER_ANDROID,
+                                     clientBuffer, imageAttribs);
+    if (target.image != EGL_NO_IMAGE_KHR) {
+        glGenTextures(1, &target.texture);
+        glBindTexture(GL_TEXTURE_2D, target.texture);
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, static_cast<GLeglImageOES>(target.image));
+
+        glGenFramebuffers(1, &target.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               target.texture, 0);
+        const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status == GL_FRAMEBUFFER_COMPLETE) {
+            return &(mTargets[handle] = target);
+        }
+    }
+
+    ALOGW("Can't render into client buffers directly, reading results back instead");
+    destroyTarget(target);
+    mCanWrapTargets = false;
+    return nullptr;
+}
+
+
+GpuConverter::Target* GpuConverter::readbackTarget(const BufferDesc& tgtBuff) {
+    if (mReadbackTarget.fbo != 0 &&
+        mReadbackWidth == tgtBuff.width && mReadbackHeight == tgtBuff.height) {
+        return &mReadbackTarget;
+    }
+
+    destroyTarget(mReadbackTarget);
+    glGenTextures(1, &mReadbackTarget.texture);
+    glBindTexture(GL_TEXTURE_2D, mReadbackTarget.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, tgtBuff.width, tgtBuff.height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+
+    glGenFramebuffers(1, &mReadbackTarget.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, mReadbackTarget.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           mReadbackTarget.texture, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        ALOGE("GPU conversion render target incomplete (0x%X)", status);
+        destroyTarget(mReadbackTarget);
+        return nullptr;
+    }
+
+    mReadbackWidth = tgtBuff.width;
+    mReadbackHeight = tgtBuff.height;
+    return &mReadbackTarget;
+}
+
+
+bool GpuConverter::readBack(const BufferDesc& tgtBuff) {
+    void* targetPixels = nullptr;
+    GraphicBufferMapper& mapper = GraphicBufferMapper::get();
+    mapper.lock(tgtBuff.memHandle,
+                GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_SW_READ_NEVER,
+                android::Rect(tgtBuff.width, tgtBuff.height),
+                &targetPixels);
+    if (targetPixels == nullptr) {
+        ALOGE("GPU conversion failed to gain access to image buffer for writing");
+        return false;
+    }
+
+    // Gralloc's stride is in pixels, which is what GL wants too
+    glPixelStorei(GL_PACK_ROW_LENGTH, tgtBuff.stride);
+    glReadPixels(0, 0, tgtBuff.width, tgtBuff.height, GL_RGBA, GL_UNSIGNED_BYTE, targetPixels);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+    mapper.unlock(tgtBuff.memHandle);
+    return glGetError() == GL_NO_ERROR;
+}
+
+
+void GpuConverter::destroyTarget(Target& target) {
+    if (target.fbo != 0) {
+        glDeleteFramebuffers(1, &target.fbo);
+    }
+    if (target.texture != 0) {
+        glDeleteTextures(1, &target.texture);
+    }
+    if (target.image != EGL_NO_IMAGE_KHR) {
+        eglDestroyImageKHR(mDisplay, target.image);
+    }
+    target = Target();
+}
+
+
+} // namespace implementation
+} // namespace V1_0
+} // namespace evs
+} // namespace automotive
+} // namespace hardware
+} // namespace android
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_GPUCONVERTER_H
+#define ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_GPUCONVERTER_H
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include <android/hardware/automotive/evs/1.0/types.h>
+
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace evs {
+namespace V1_0 {
+namespace implementation {
+
+
+// Converts YUYV camera frames into a client's RGBA gralloc buffer with a pixel shader instead
+// of the CPU loops in bufferCopy.cpp.  The camera frame is imported directly from its dmabuf
+// when EGL supports that, and is otherwise uploaded as a texture.  Likewise we render straight
+// into the client's buffer when we can wrap it as an EGLImage, and otherwise read the result
+// back into it, which is slow but lets a software GLES implementation stand in for testing.
+//
+// We keep our own pbuffer context and only hold it current for the duration of a call, so any
+// thread may use or destroy a converter.
+class GpuConverter {
+public:
+    // Set once at start up; cameras only try the GPU when enabled
+    static void setEnabled(bool enabled)    { sEnabled = enabled; };
+    static bool isEnabled()                 { return sEnabled; };
+
+    // Only YUYV to RGBA is handled here; everything else stays on the CPU
+    static bool isSupported(uint32_t v4lFormat, uint32_t halFormat);
+
+    ~GpuConverter();
+    bool initialize();
+
+    // Pass a negative dmabuf fd if the camera frame isn't exported as one.  Returns false if
+    // the frame wasn't converted and the caller should fall back to the CPU.
+    bool convert(const BufferDesc& tgtBuff, const void* imgData, unsigned imgStride,
+                 int dmabufFd);
+
+    // Our cached EGLImages must be dropped before the buffers they wrap are freed
+    void forgetTargets();
+
+private:
+    struct Target {
+        EGLImageKHR image   = EGL_NO_IMAGE_KHR;
+        GLuint      texture = 0;
+        GLuint      fbo     = 0;
+    };
+
+    bool makeCurrent();
+    void releaseCurrent();
+    bool bindSource(const BufferDesc& tgtBuff, const void* imgData, unsigned imgStride,
+                    int dmabufFd);
+    Target* findTarget(const BufferDesc& tgtBuff);
+    Target* readbackTarget(const BufferDesc& tgtBuff);
+    bool readBack(const BufferDesc& tgtBuff);
+    void destroyTarget(Target& target);
+
+    EGLDisplay      mDisplay = EGL_NO_DISPLAY;
+    EGLSurface      mSurface = EGL_NO_SURFACE;
+    EGLContext      mContext = EGL_NO_CONTEXT;
+    GLuint          mProgram = 0;
+    bool            mCanImportDmabuf = false;
+    bool            mCanWrapTargets = false;
+
+    // The camera frame, either wrapping its dmabuf or as our own uploaded copy
+    GLuint          mSourceTexture = 0;
+    EGLImageKHR     mSourceImage = EGL_NO_IMAGE_KHR;
+    int             mSourceFd = -1;
+    unsigned        mSourceWidth = 0;
+    unsigned        mSourceHeight = 0;
+
+    std::unordered_map<const native_handle_t*, Target>
+                    mTargets;               // Client buffers we render to directly
+    Target          mReadbackTarget;        // Our own render target when we can't
+    unsigned        mReadbackWidth = 0;
+    unsigned        mReadbackHeight = 0;
+
+    std::mutex      mLock;                  // Serializes use of our context
+
+    static bool     sEnabled;
+};
+
+} // namespace implementation
+} // namespace V1_0
+} // namespace evs
+} // namespace automotive
+} // namespace hardware
+} // namespace android
+
+#endif  // ANDROID_HARDWARE_AUTOMOTIVE_EVS_V1_0_GPUCONVERTER_H
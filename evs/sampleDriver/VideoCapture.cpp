@@ -17,8 +17,11 @@
 #include <stdlib.h>
 #include <error.h>
 #include <errno.h>
+#include <math.h>
+#include <algorithm>
 #include <memory.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -27,6 +30,11 @@
 #include "assert.h"
 
 #include "VideoCapture.h"
+#include "CaptureReactor.h"
+
+
+// How often, in frames, we log our dequeue timing while streaming
+static const unsigned kTimingReportInterval = 900;
 
 
 // NOTE:  This developmental code does not properly clean up resources in case of failure
@@ -211,9 +219,26 @@ bool VideoCapture::startStream(std::function<void(VideoCapture*, imageBuffer*, v
 
     // Remember who to tell about new frames as they arrive
     mCallback = callback;
-
-    // Fire up a thread to receive and dispatch the video frames
-    mCaptureThread = std::thread([this](){ collectFrames(); });
+    mDequeueStats = {};
+
+    // Hand the device to the capture reactor if we have one, which needs a non-blocking DQBUF.
+    // Otherwise, or if that fails, fire up our own thread to receive and dispatch the frames.
+    mUsingReactor = false;
+    int flags = fcntl(mDeviceFd, F_GETFL);
+    CaptureReactor* reactor = CaptureReactor::get();
+    if (reactor != nullptr && flags >= 0 &&
+        fcntl(mDeviceFd, F_SETFL, flags | O_NONBLOCK) == 0) {
+        mUsingReactor = reactor->add(this);
+        if (!mUsingReactor) {
+            ALOGW("Capture reactor refused fd %d, falling back to a capture thread", mDeviceFd);
+        }
+    }
+    if (!mUsingReactor) {
+        if (flags >= 0) {
+            fcntl(mDeviceFd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+        mCaptureThread = std::thread([this](){ collectFrames(); });
+    }
 
     ALOGD("Stream started.");
     return true;
@@ -230,10 +255,15 @@ void VideoCapture::stopStream() {
         ALOGE("stopStream called while stream is already stopping.  Reentrancy is not supported!");
         return;
     } else {
-        // Block until the background thread is stopped
-        if (mCaptureThread.joinable()) {
+        // Block until the background thread is stopped, or the reactor is done with us
+        if (mUsingReactor) {
+            CaptureReactor::get()->remove(this);
+            mRunMode = STOPPED;
+        } else if (mCaptureThread.joinable()) {
             mCaptureThread.join();
         }
+        reportTiming();
+        mUsingReactor = false;
 
         // Stop the underlying video stream (automatically empties the buffer queue)
         int type = mBufferInfo.type;
@@ -245,6 +275,11 @@ void VideoCapture::stopStream() {
     }
 
     // Unmap the buffers we allocated
+    if (mDmaBufFd >= 0) {
+        ::close(mDmaBufFd);
+        mDmaBufFd = -1;
+    }
+    mDmaBufTried = false;
     munmap(mPixelBuffer, mBufferInfo.length);
 
     // Tell the L4V2 driver to release our streaming buffers
@@ -259,6 +294,26 @@ void VideoCapture::stopStream() {
 }
 
 
+int VideoCapture::getDmaBufFd() {
+    // Only ask once per stream; drivers without VIDIOC_EXPBUF won't change their minds
+    if (!mDmaBufTried && (mRunMode & RUN)) {
+        mDmaBufTried = true;
+
+        v4l2_exportbuffer exportInfo = {};
+        exportInfo.type  = mBufferInfo.type;
+        exportInfo.index = mBufferInfo.index;
+        exportInfo.flags = O_RDONLY | O_CLOEXEC;
+        if (ioctl(mDeviceFd, VIDIOC_EXPBUF, &exportInfo) < 0) {
+            ALOGI("VIDIOC_EXPBUF: %s", strerror(errno));
+        } else {
+            mDmaBufFd = exportInfo.fd;
+        }
+    }
+
+    return mDmaBufFd;
+}
+
+
 void VideoCapture::markFrameReady() {
     mFrameReady = true;
 };
@@ -274,12 +329,19 @@ bool VideoCapture::returnFrame() {
         return false;
     }
 
+    // The reactor stops watching our device while we hold a frame, so let it know to start again
+    if (mUsingReactor) {
+        CaptureReactor::get()->rearm(this);
+    }
+
     return true;
 }
 
 
 // This runs on a background thread to receive and dispatch video frames
 void VideoCapture::collectFrames() {
+    CaptureReactor::applyThreadPolicy();
+
     // Run until our atomic signal is cleared
     while (mRunMode == RUN) {
         // Wait for a buffer to be ready
@@ -288,6 +350,7 @@ void VideoCapture::collectFrames() {
             break;
         }
 
+        recordDequeue();
         markFrameReady();
 
         // If a callback was requested per frame, do that now
@@ -300,3 +363,88 @@ void VideoCapture::collectFrames() {
     ALOGD("VideoCapture thread ending");
     mRunMode = STOPPED;
 }
+
+
+// This runs on a CaptureReactor loop when our device has become readable.  Returns false if
+// there was no frame after all, so the reactor should keep watching the device.
+bool VideoCapture::dispatchFrame() {
+    if (mRunMode != RUN) {
+        return true;
+    }
+
+    if (ioctl(mDeviceFd, VIDIOC_DQBUF, &mBufferInfo) < 0) {
+        if (errno == EAGAIN) {
+            return false;
+        }
+
+        // Stop watching a device that is failing; the stream will be torn down by its owner
+        ALOGE("VIDIOC_DQBUF: %s", strerror(errno));
+        return true;
+    }
+
+    recordDequeue();
+    markFrameReady();
+
+    // If a callback was requested per frame, do that now
+    if (mCallback) {
+        mCallback(this, &mBufferInfo, mPixelBuffer);
+    }
+
+    return true;
+}
+
+
+void VideoCapture::recordDequeue() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t nowUs = int64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+
+    DequeueStats& stats = mDequeueStats;
+    stats.frames++;
+    if (stats.lastDequeueUs != 0) {
+        // Welford's running mean and variance of the dequeue interval
+        const int64_t interval = nowUs - stats.lastDequeueUs;
+        stats.intervals++;
+        const double delta = interval - stats.intervalMeanUs;
+        stats.intervalMeanUs += delta / stats.intervals;
+        stats.intervalM2 += delta * (interval - stats.intervalMeanUs);
+        stats.intervalMinUs = std::min(stats.intervalMinUs, interval);
+        stats.intervalMaxUs = std::max(stats.intervalMaxUs, interval);
+    }
+    stats.lastDequeueUs = nowUs;
+
+    // The driver's timestamp is only comparable to ours if it uses the monotonic clock
+    if ((mBufferInfo.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        const int64_t capturedUs = int64_t(mBufferInfo.timestamp.tv_sec) * 1000000 +
+                                   mBufferInfo.timestamp.tv_usec;
+        const int64_t latency = nowUs - capturedUs;
+        if (latency >= 0) {
+            stats.latencies++;
+            stats.latencySumUs += latency;
+            stats.latencyMaxUs = std::max(stats.latencyMaxUs, latency);
+        }
+    }
+
+    if (stats.frames % kTimingReportInterval == 0) {
+        reportTiming();
+    }
+}
+
+
+void VideoCapture::reportTiming() {
+    const DequeueStats& stats = mDequeueStats;
+    if (stats.intervals == 0) {
+        return;
+    }
+
+    ALOGI("Capture timing on fd %d (%s): %u frames, interval mean %.0f us, "
+          "jitter %.0f us stddev, range %lld-%lld us",
+          mDeviceFd, mUsingReactor ? "reactor" : "thread", stats.frames,
+          stats.intervalMeanUs, sqrt(stats.intervalM2 / stats.intervals),
+          (long long)stats.intervalMinUs, (long long)stats.intervalMaxUs);
+    if (stats.latencies > 0) {
+        ALOGI("  dequeue latency mean %lld us, max %lld us",
+              (long long)(stats.latencySumUs / stats.latencies),
+              (long long)stats.latencyMaxUs);
+    }
+}
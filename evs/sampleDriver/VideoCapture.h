@@ -19,6 +19,7 @@
 #include <atomic>
 #include <thread>
 #include <functional>
+#include <stdint.h>
 #include <linux/videodev2.h>
 
 
@@ -47,15 +48,26 @@ public:
 
     bool isOpen()               { return mDeviceFd >= 0; };
 
+    // Our capture buffer shared as a dmabuf, or -1 if the driver can't export it.
+    // Valid only while the stream is running.
+    int getDmaBufFd();
+
 private:
+    friend class CaptureReactor;
+
     void collectFrames();
+    bool dispatchFrame();
     void markFrameReady();
     bool returnFrame();
+    void recordDequeue();
+    void reportTiming();
 
     int mDeviceFd = -1;
 
     v4l2_buffer mBufferInfo = {};
     void* mPixelBuffer = nullptr;
+    int mDmaBufFd = -1;
+    bool mDmaBufTried = false;
 
     __u32   mFormat = 0;
     __u32   mWidth  = 0;
@@ -65,9 +77,28 @@ private:
     std::function<void(VideoCapture*, imageBuffer*, void*)> mCallback;
 
     std::thread mCaptureThread;             // The thread we'll use to dispatch frames
+    std::atomic<int> mReactorLoop { -1 };   // Our CaptureReactor loop, when we're not threaded
+    bool mUsingReactor = false;
     std::atomic<int> mRunMode;              // Used to signal the frame loop (see RunModes below)
     std::atomic<bool> mFrameReady;          // Set when a frame has been delivered
 
+    // Timing of our frame dequeues, so the capture threading choices can be compared.  The
+    // interval spread is the jitter in when we dequeue frames; the latency is from the
+    // driver's capture timestamp to our dequeue.
+    struct DequeueStats {
+        unsigned    frames          = 0;
+        int64_t     lastDequeueUs   = 0;
+        unsigned    intervals       = 0;
+        double      intervalMeanUs  = 0.0;
+        double      intervalM2      = 0.0;      // Running sum of squared deviations
+        int64_t     intervalMinUs   = INT64_MAX;
+        int64_t     intervalMaxUs   = 0;
+        unsigned    latencies       = 0;
+        int64_t     latencySumUs    = 0;
+        int64_t     latencyMaxUs    = 0;
+    };
+    DequeueStats mDequeueStats;             // Only touched by whoever is dequeuing our frames
+
     // Careful changing these -- we're using bit-wise ops to manipulate these
     enum RunModes {
         STOPPED     = 0,
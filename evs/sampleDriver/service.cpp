@@ -15,6 +15,7 @@
  */
 
 #include <unistd.h>
+#include <algorithm>
 #include <atomic>
 
 #include <hidl/HidlTransportSupport.h>
@@ -25,6 +26,8 @@
 #include "ServiceNames.h"
 #include "EvsEnumerator.h"
 #include "EvsGlDisplay.h"
+#include "CaptureReactor.h"
+#include "GpuConverter.h"
 
 
 // libhidl:
@@ -40,9 +43,65 @@ using namespace android::hardware::automotive::evs::V1_0::implementation;
 using namespace android;
 
 
-int main() {
+int main(int argc, char** argv) {
     ALOGI("EVS Hardware Enumerator service is starting");
 
+    // Set up default behavior, then check for command line options
+    bool printHelp = false;
+    unsigned captureThreads = 1;
+    int capturePriority = 0;
+    uint64_t captureCpus = 0;
+    for (int i=1; i< argc; i++) {
+        if (strcmp(argv[i], "--capture-threads") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--capture-threads <count> was not provided with a thread count\n");
+            } else {
+                captureThreads = std::max(0, atoi(argv[i]));
+            }
+        } else if (strcmp(argv[i], "--capture-priority") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--capture-priority <priority> was not provided with a priority\n");
+            } else {
+                capturePriority = std::max(0, atoi(argv[i]));
+            }
+        } else if (strcmp(argv[i], "--capture-cpus") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--capture-cpus <mask> was not provided with a cpu mask\n");
+            } else {
+                captureCpus = strtoull(argv[i], nullptr, 16);
+            }
+        } else if (strcmp(argv[i], "--buffer-budget") == 0) {
+            i++;
+            if (i >= argc) {
+                ALOGE("--buffer-budget <megabytes> was not provided with a size\n");
+            } else {
+                EvsEnumerator::setBufferBudget(size_t(std::max(0, atoi(argv[i]))) << 20);
+            }
+        } else if (strcmp(argv[i], "--gpu-convert") == 0) {
+            GpuConverter::setEnabled(true);
+        } else if (strcmp(argv[i], "--help") == 0) {
+            printHelp = true;
+        } else {
+            printf("Ignoring unrecognized command line arg '%s'\n", argv[i]);
+            printHelp = true;
+        }
+    }
+    if (printHelp) {
+        printf("Options include:\n");
+        printf("  --capture-threads <n>     Threads servicing all capture devices (default 1),\n");
+        printf("                            or 0 for a thread per device\n");
+        printf("  --capture-priority <n>    Run capture threads as SCHED_FIFO at this priority\n");
+        printf("                            (default 0, normal scheduling)\n");
+        printf("  --capture-cpus <hex_mask> Pin capture threads to these CPUs (default any)\n");
+        printf("  --buffer-budget <MB>      Most graphics buffer memory for all cameras together\n");
+        printf("                            (default 0, no limit)\n");
+        printf("  --gpu-convert             Convert camera frames with a pixel shader when possible\n");
+    }
+    CaptureReactor::configure(captureThreads, capturePriority, captureCpus);
+
     // Start a thread to listen video device addition events.
     std::atomic<bool> running { true };
     std::thread ueventHandler(EvsEnumerator::EvsUeventThread, std::ref(running));